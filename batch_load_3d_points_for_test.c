@@ -93,16 +93,15 @@ rows_read++;
 }
          
         //start build kd- tree
-        kd_tree_node* root = kd_tree_get_root();  
-        while (rows_inserted < rows_read) {
-            //printf("inserted:\n");
-            if (rows_inserted < 10) {
-                kd_tree_print_data_for_debug(&batch_node_processing_space[rows_inserted],
-                        k_dimensions, 1);
-            }
-            kd_tree_add_points(&root, batch_node_processing_space[rows_inserted].dataset);
-            rows_inserted++;
+        for (; rows_inserted < data_row && rows_inserted < 10;
+                rows_inserted++) {
+            kd_tree_print_data_for_debug(
+                    &batch_node_processing_space[rows_inserted],
+                    k_dimensions, 1);
         }
+        /*the batch rows are contiguous, insert them with a single build*/
+        rows_inserted = kd_tree_add_points_batch(
+                batch_node_processing_space[0].dataset, data_row);
         
     }
     
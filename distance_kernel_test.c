@@ -0,0 +1,121 @@
+/*Copyright 2020, by the California Institute of Technology.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * File:   distance_kernel_test.c
+ * Author: anaim (aryan.e.naim@jpl.nasa.gov)
+ *
+ * Checks every distance kernel the CPU supports (scalar, SSE2, AVX2,
+ * AVX-512) against a double precision reference, for 1 to 130 dimensions,
+ * point vs point & query vs block. Then runs kNN on 64 dimensional points
+ * with each kernel, with one point per node & with leaf buckets that are
+ * scanned by the block kernel.
+ */
+
+#include <stdio.h>
+#include "kdtree.h"
+
+#define MAX_DIMENSIONS 130
+#define BLOCK_ROWS 37
+
+float a[MAX_DIMENSIONS];
+float block[BLOCK_ROWS * MAX_DIMENSIONS];
+float out[BLOCK_ROWS];
+
+double reference(const float* x, const float* y, int n) {
+    double total = 0.0;
+    int i = 0;
+    for (; i < n; i++) {
+        total += ((double) x[i] - y[i]) * ((double) x[i] - y[i]);
+    }
+    return total;
+}
+
+int close_enough(double expected, float actual) {
+    return fabs(expected - actual) <= 1e-4 * (1.0 + expected);
+}
+
+int main(int argc, char** argv) {
+
+    const char* names[] = {"scalar", "sse2", "avx2", "avx512"};
+    int default_kernel = kdtree_get_distance_kernel();
+    int kernel = KD_TREE_KERNEL_SCALAR;
+    int i = 0;
+
+    printf("default kernel: %s\n", names[default_kernel]);
+    srand(3);
+    for (i = 0; i < MAX_DIMENSIONS; i++) {
+        a[i] = rand() / (float) RAND_MAX * 10.0f - 5.0f;
+    }
+    for (i = 0; i < BLOCK_ROWS * MAX_DIMENSIONS; i++) {
+        block[i] = rand() / (float) RAND_MAX * 10.0f - 5.0f;
+    }
+
+    for (; kernel <= KD_TREE_KERNEL_AVX512; kernel++) {
+        int n = 1;
+        if (!kdtree_set_distance_kernel(kernel)) {
+            printf("kernel %s not supported, skipped\n", names[kernel]);
+            continue;
+        }
+        assert(kdtree_get_distance_kernel() == kernel);
+        for (; n <= MAX_DIMENSIONS; n++) {
+            int r = 0;
+            assert(close_enough(reference(a, block, n),
+                    kdtree_squared_distance(a, block, n)));
+            kdtree_squared_distance_block(a, block, BLOCK_ROWS, n, out);
+            for (; r < BLOCK_ROWS; r++) {
+                assert(close_enough(reference(a, block + r * n, n), out[r]));
+            }
+        }
+        printf("kernel %s ok\n", names[kernel]);
+    }
+
+    /*kNN on descriptors, every kernel finds the same nearest neighbor*/
+    int rows = 500;
+    int cols = 64;
+    float* data = (float*) malloc(sizeof (float) * rows * cols);
+    kdtree_t* tree = kdtree_alloc(rows, cols);
+    assert(data && tree);
+    kdtree_init(tree);
+    for (i = 0; i < rows * cols; i++) {
+        data[i] = rand() / (float) RAND_MAX;
+    }
+    int leaf_size = 1;
+    int count = 0;
+    int ok = 0;
+    for (; leaf_size <= 32; leaf_size *= 32) {
+        ok = kdtree_set_leaf_size(tree, leaf_size);
+        assert(ok);
+        count = kdtree_build(tree, data, rows);
+        assert(count == rows);
+        for (kernel = KD_TREE_KERNEL_SCALAR; kernel <= KD_TREE_KERNEL_AVX512;
+                kernel++) {
+            int q = 0;
+            if (!kdtree_set_distance_kernel(kernel)) {
+                continue;
+            }
+            for (; q < rows; q += 25) {
+                count = kdtree_knn(tree, data + q * cols, 1);
+                assert(count == 1);
+                assert(kdtree_get_knn_result_space(tree)[0].id == q);
+                assert(kdtree_get_knn_result_space(tree)[0].
+                        distance_to_neighbor == 0.0f);
+            }
+        }
+        printf("knn 64 dimensions, leaf size %d ok\n", leaf_size);
+    }
+    kdtree_set_distance_kernel(default_kernel);
+    kdtree_free(tree);
+    free(data);
+
+    return 0;
+}
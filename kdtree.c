@@ -15,13 +15,26 @@
  * Author: anaim (aryan.e.naim@jpl.nasa.gov) 
  */
 
+/*posix_memalign()*/
+#define _POSIX_C_SOURCE 200112L
 #include "kdtree.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+/*SIMD distance kernels are compiled per function with target attributes & 
+selected at load time, see kd_tree_select_distance_kernel()*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KD_TREE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
 /*macros are related to fast median algorithm, see kth_smallest()*/
 #define ELEM_SWAP(a,b) { register elem_type t=(a);(a)=(b);(b)=t; }
 #define median(a,n) kth_smallest(a,n,(((n)&1)?((n)/2):(((n)/2)-1)))
 int is_debug_run = 0; 
 /*=============================================================================
 variables -kdtree  
+ These are aliases of the default tree's heaps used by the legacy kd_tree_*
+ API, see kd_tree_set_kd_tree(). Every tree owns its heaps in _internals.
 ==============================================================================*/
 /*kd tree heap */
 kdtree_t* self = NULL;  
@@ -42,6 +55,29 @@ typedef struct kd_tree_stack_node
 } kd_tree_stack_node;
 /*stack heap*/
 kd_tree_stack_node* stack_processing_space; 
+/*kNN candidate, node of the tree & its distance to the query point. The 
+candidates of a query form a bounded max-heap, see kd_tree_knn_heap_push().
+Searches of a published version have no nodes, they set position instead*/
+typedef struct kd_tree_knn_candidate
+{
+  kd_tree_node* node;
+  float distance;
+  int position;
+} kd_tree_knn_candidate;
+/*read only points of a tree, see kdtree_publish(). The snapshot arrays of 
+kdtree_freeze(), which the version takes over from the tree, & the ids of the
+positions*/
+typedef struct kd_tree_version
+{
+  float* coordinates;
+  unsigned short* split_dimensions;
+  int* ids;
+  int size;
+  unsigned long number;
+  /*epoch in which a newer version replaced it & the next retired version*/
+  unsigned long retired;
+  struct kd_tree_version* next;
+} kd_tree_version;
 /*elem_type is related to fast median algorithm, see kth_smallest()*/
 typedef float elem_type ;
 
@@ -50,9 +86,18 @@ Global variables declared
 ==============================================================================*/
 /*kd-tree related*/
 int max_data_dimensions = 1;
+/*alias of the default tree's k_dimensions*/
 int k_dimensions = 1;
-/*default heap_size (aka row size is 10,000 nodes)*/
-int heap_size = 10000; 
+/*distance kernels, selected at load time see kdtree_set_distance_kernel()*/
+float kd_tree_squared_euclidean_scalar(const float* a, const float* b, int n);
+void kd_tree_squared_euclidean_block_scalar(const float* query,
+        const float* points, int rows, int n, float* out);
+float (*kd_tree_squared_euclidean_kernel)(const float* a, const float* b,
+        int n) = kd_tree_squared_euclidean_scalar;
+void (*kd_tree_squared_euclidean_block_kernel)(const float* query,
+        const float* points, int rows, int n, float* out) =
+        kd_tree_squared_euclidean_block_scalar;
+int distance_kernel = KD_TREE_KERNEL_SCALAR;
 /* stack related*/
 int snode_processing_heap_tail_index = 0; 
 int snode_processing_heap_head_index  = 0; 
@@ -62,89 +107,97 @@ Declarations
 ==============================================================================*/
 /*tree*/
 kdtree_t* kd_tree_alloc_tree_space();
-kdtree_t* kd_tree_get_tree_space();
 void kd_tree_free_tree_space(kdtree_t* tree);
 void kd_tree_init_tree_space(kdtree_t* tree);
 /*tree processing heap space*/
-kdtree_t*  kd_tree_alloc_tree_processing_space();
-kdtree_t*  kd_tree_get_processing_space();
+kdtree_t*  kd_tree_alloc_tree_processing_space(kdtree_t* tree);
+kdtree_t*  kd_tree_get_processing_space(kdtree_t* tree);
 void kd_tree_init_kdtree_processing_space(kdtree_t* tree);
 void kd_tree_free_kdtree_processing_space(kdtree_t* tree);
 /*tree internals heap space*/
 struct kdtree_internals* kd_tree_alloc_internals(); 
 void kd_tree_init_tree_internals(kdtree_t* tree);
 void kd_tree_free_internals(kdtree_t* tree);
+/*coordinate arenas*/
+float* kd_tree_alloc_coordinate_arena(int rows, int cols);
 /*leaf nodes*/
-void kd_tree_alloc_node_space_heap(int rows,int max_dimensions);
+void kd_tree_alloc_node_space_heap(kdtree_t* tree, int rows,
+        int max_dimensions);
 kd_tree_node*
-get_pre_allocated_kd_tree_node_heap();
-void kd_tree_init_node_heap(kd_tree_node** nodes, int max_dimensions);
-void kd_tree_free_node_space(kd_tree_node** nodes);
+get_pre_allocated_kd_tree_node_heap(kdtree_t* tree);
+void kd_tree_release_node(kdtree_t* tree, kd_tree_node* node);
+void kd_tree_init_node_heap(kdtree_t* tree);
+void kd_tree_free_node_space(kdtree_t* tree);
 /*leaf nodes processing*/
-void kd_tree_alloc_node_processing_space_heap(int rows,int max_dimensions);
-kd_tree_node*
-get_pre_allocated_processing_heap();
-void kd_tree_init_node_processing_space_heap(kd_tree_node** nodes, 
+void kd_tree_alloc_node_processing_space_heap(kdtree_t* tree, int rows,
         int max_dimensions);
-void kd_tree_free_node_processing_space_heap(kd_tree_node** nodes);
+kd_tree_node*
+get_pre_allocated_processing_heap(kdtree_t* tree);
+void kd_tree_init_node_processing_space_heap(kdtree_t* tree);
+void kd_tree_free_node_processing_space_heap(kdtree_t* tree);
 /*knn result space*/
-void kd_tree_alloc_node_knn_result_heap();
+void kd_tree_alloc_node_knn_result_heap(kdtree_t* tree);
 kd_tree_node*
-get_knn_result_heap();
-void kd_tree_init_node_knn_result_heap(kd_tree_node** nodes, 
-        int max_dimensions);
-void kd_tree_free_node_knn_result_heap(kd_tree_node** nodes);
+get_knn_result_heap(kdtree_t* tree);
+void kd_tree_init_node_knn_result_heap(kdtree_t* tree);
+void kd_tree_free_node_knn_result_heap(kdtree_t* tree);
 /*batch processing space*/
-void kd_tree_alloc_batch_processing_heap();
+void kd_tree_alloc_batch_processing_heap(kdtree_t* tree);
 kd_tree_node*
-get_kd_tree_batch_processing_heap();
-void kd_tree_init_batch_processing_heap(kd_tree_node** nodes, 
-        int max_dimensions);
-void kd_tree_free_batch_processing_heap(kd_tree_node** nodes);
+get_kd_tree_batch_processing_heap(kdtree_t* tree);
+void kd_tree_init_batch_processing_heap(kdtree_t* tree);
+void kd_tree_free_batch_processing_heap(kdtree_t* tree);
 /*median heap space*/
-void kd_tree_alloc_columns_median_heap(int k_dimensions);
-void kd_tree_init_columns_median_heap(float** medians, int k_dimensions);
-float* kd_tree_get_columns_median_heap();
-void kd_tree_free_columns_median_space(float** medians);
+void kd_tree_alloc_columns_median_heap(kdtree_t* tree, int k_dimensions);
+void kd_tree_init_columns_median_heap(kdtree_t* tree);
+float* kd_tree_get_columns_median_heap(kdtree_t* tree);
+void kd_tree_free_columns_median_space(kdtree_t* tree);
 /*median processing space */
-float* kd_tree_alloc_columns_median_processing_space(int rows);
-void kd_tree_init_columns_median_processing_space(float** medians, int rows);
-float* kd_tree_get_columns_median_processing_space();
-void kd_tree_free_columns_median_processing_space(float** medians);
+float* kd_tree_alloc_columns_median_processing_space(kdtree_t* tree, int rows);
+void kd_tree_init_columns_median_processing_space(kdtree_t* tree);
+float* kd_tree_get_columns_median_processing_space(kdtree_t* tree);
+void kd_tree_free_columns_median_processing_space(kdtree_t* tree);
 /*Minimal Stack function prototypes, push, pop, empty*/
 void kd_tree_stack_push(kd_tree_stack_node** top_ref, kd_tree_node *t); 
 kd_tree_node  *kd_tree_stack_pop(kd_tree_stack_node** top_ref); 
 int kd_tree_stack_is_stack_empty(kd_tree_stack_node *top); 
 /*other functions, setters & getters*/
 /*kd_tree_set_root is mutator*/
-void kd_tree_set_root(kd_tree_node* root);
+void kd_tree_set_root(kdtree_t* tree, kd_tree_node* root);
 void kd_tree_set_k_dimensions(int max_dimensions);
 int kd_tree_get_k_dimensions();
-void kd_tree_set_rows_size(int rows);
-int kd_tree_get_rows_size();
-int kd_tree_get_processing_size();
-void kd_tree_set_column_median(float median, int column_index);
-float kd_tree_get_column_median(int column_index);
-void kd_tree_set_column_median_processing_space(float median, int column_index);
-float kd_tree_get_column_median_processing_space(int column_index);
+void kd_tree_set_rows_size(kdtree_t* tree, int rows);
+int kd_tree_get_rows_size(kdtree_t* tree);
+int kd_tree_get_processing_size(kdtree_t* tree);
+void kd_tree_set_column_median(kdtree_t* tree, float median, int column_index);
+float kd_tree_get_column_median(kdtree_t* tree, int column_index);
 int get_column_vector_from_matrix (float * info, int row_length, 
 int  column_length, int column_dimension, float * out_put_array);
 kd_tree_node* 
-kd_tree_new_node (const float data[],const int k_dimensions,const int copying);
+kd_tree_new_node (kdtree_t* tree, const float data[],const int k_dimensions,
+        const int copying);
 /*mutator*/
 int
-kd_tree_rebuild (kd_tree_node* root,const int k_dimensions);
-void
-kd_tree_set_previous_tree_size (const int size);
+kd_tree_rebuild (kdtree_t* tree, kd_tree_node* root,const int k_dimensions);
+/*bulk construction, see kd_tree_bulk_build()*/
+int kd_tree_gather_points(kdtree_t* tree);
+kd_tree_node* kd_tree_bulk_build(kdtree_t* tree, int rows);
+kd_tree_node* kd_tree_build_subtree(kdtree_t* tree, int lo, int hi,
+        int depth);
+void kd_tree_select_row(kdtree_t* tree, int lo, int hi, int k, int dimension);
+int kd_tree_sliding_midpoint_row(kdtree_t* tree, int lo, int hi,
+        int dimension);
+void kd_tree_swap_rows(kdtree_t* tree, int i, int j);
 void
-kd_tree_set_previous_tree_size (const int size);
-float kd_tree_get_previous_tree_size();
+kd_tree_set_previous_tree_size (kdtree_t* tree, const int size);
+float kd_tree_get_previous_tree_size(kdtree_t* tree);
 void
-set_current_number_of_kd_tree_nodes(int number_of_nodes);
+set_current_number_of_kd_tree_nodes(kdtree_t* tree, int number_of_nodes);
 int
 kd_tree_get_current_number_of_kd_tree_nodes();
 void
-kd_tree_increment_current_number_of_kd_tree_nodes();
+kd_tree_increment_current_number_of_kd_tree_nodes(kdtree_t* tree);
+int kd_tree_get_subtree_height(kd_tree_node* node);
 
 /*=============================================================================
 Function       
@@ -152,35 +205,154 @@ Description:
 Notes:          Used for debugging.   
 ==========================================================*/
 void
-kd_tree_decrement_current_number_of_kd_tree_nodes ();
+kd_tree_decrement_current_number_of_kd_tree_nodes (kdtree_t* tree);
 /*mutator*/
-void kd_tree_add_record(kd_tree_node** root, const float key [], int depth,
-        const int k_dimensions, const int copying, 
-        const float rebuild_threshold);
+void kd_tree_add_record(kdtree_t* tree, kd_tree_node** root, const float key [],
+        int depth, const int k_dimensions, const int copying, 
+        const float rebuild_threshold, const int id);
 /*mutator*/
-int kd_tree_update_record(kd_tree_node* root, const float target_data [],  
-        const float new_data [],const int k_dimensions);
-int kd_tree_search_helper(kd_tree_node* root, const float data[], int depth, 
+int kd_tree_update_record(kdtree_t* tree, kd_tree_node* root,
+        const float target_data [], const float new_data [],
         const int k_dimensions);
+int kd_tree_search_helper(kd_tree_node* root, const float data[],
+        const int k_dimensions);
+kd_tree_node* kd_tree_find_node(kd_tree_node* root, const float data[],
+        const int k_dimensions);
+float kd_tree_n_dimensional_squared_euclidean(const float values_1 [],
+        const float values_2 [], const int k_dimensions);
 float kd_tree_n_dimensional_euclidean(const float values_1 [], 
         const float values_2 [], const int k_dimensions);
-int kd_tree_knn_helper(kd_tree_node* const root,const float data_point[],
+int kd_tree_knn_helper(kdtree_t* tree, kd_tree_node* const root,
+               const float data_point[],
                const int  k_dimensions,
                int number_of_nearest_neighbors);
-int kd_tree_delete_data_point_helper(kd_tree_node* root, 
+int kd_tree_delete_data_point_helper(kdtree_t* tree, kd_tree_node* root, 
         float const  data_point [], 
         int depth,
         const int k_dimensions);
 int
-kd_tree_knn_based_on_radius_helper (kd_tree_node* root, 
+kd_tree_knn_based_on_radius_helper (kdtree_t* tree, kd_tree_node* root, 
                     const float data_point[], 
                     const int k_dimensions, 
                     float range_from_data_point);
-void
-set_current_number_of_kd_tree_nodes(int number_of_nodes);
-void kd_tree_decrement_current_number_of_kd_tree_nodes();
-void
-kd_tree_increment_current_number_of_kd_tree_nodes();
+int
+kd_tree_in_order_traversal_helper (kdtree_t* tree, kd_tree_node *root,
+        int number_dimensions);
+/*exact kNN & radius search*/
+int kd_tree_knn_candidates(kdtree_t* tree, kd_tree_node* const root,
+        const float data_point[], const int k_dimensions,
+        int number_of_nearest_neighbors, kd_tree_knn_candidate* candidates);
+int kd_tree_radius_candidates(kdtree_t* tree, kd_tree_node* root,
+        const float data_point[], const int k_dimensions,
+        float range_from_data_point, kd_tree_knn_candidate* candidates);
+int kd_tree_knn_ids_helper(kdtree_t* tree, kd_tree_knn_candidate* candidates,
+        const float data_point[], int number_of_nearest_neighbors,
+        int* out_ids, float* out_dists);
+int kd_tree_radius_search_helper(kdtree_t* tree,
+        kd_tree_knn_candidate* candidates, const float* query, int* indices,
+        float* dists, int max_nn, float radius);
+/*published versions & epochs, see kdtree_publish()*/
+void kd_tree_free_version(kd_tree_version* version);
+void kd_tree_free_versions(kdtree_t* tree);
+void kd_tree_reclaim_versions(kdtree_t* tree);
+kd_tree_version* kd_tree_pin_version(kdtree_t* tree, kdtree_context_t* context);
+int kd_tree_claim_reader(kdtree_t* tree, kdtree_context_t* context);
+void kd_tree_unpin_version(kdtree_t* tree, kdtree_context_t* context);
+void kd_tree_version_knn_search(kd_tree_version* version, int position,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size);
+void kd_tree_version_radius_search(kd_tree_version* version, int position,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size);
+void kd_tree_knn_heap_push(kd_tree_knn_candidate* heap, int* size,
+        int capacity, kd_tree_node* node, float distance);
+void kd_tree_knn_heap_offer(kd_tree_knn_candidate* heap, int* size,
+        int capacity, const kd_tree_knn_candidate* candidate);
+void kd_tree_knn_heap_sort(kd_tree_knn_candidate* heap, int size);
+int kd_tree_knn_candidate_compare(const void* a, const void* b);
+void kd_tree_knn_search(kdtree_t* tree, kd_tree_node* node,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size);
+void kd_tree_radius_search(kdtree_t* tree, kd_tree_node* node,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size);
+/*leaf buckets*/
+void kd_tree_bucket_distances(kdtree_t* tree, kd_tree_node* node,
+        const float data_point[], const int k_dimensions, float* out);
+int kd_tree_bucket_index(kd_tree_node* node, const float data[],
+        const int k_dimensions);
+void kd_tree_bucket_remove(kdtree_t* tree, kd_tree_node* node, int index);
+/*compact nodes, see kdtree_compact()*/
+void kd_tree_drop_compact(kdtree_t* tree);
+int kd_tree_uses_compact(kdtree_t* tree, kd_tree_node* root);
+void kd_tree_compact_distances(kdtree_t* tree, int slot,
+        const float data_point[], const int k_dimensions, float* out);
+void kd_tree_compact_knn_search(kdtree_t* tree, int slot,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size);
+void kd_tree_compact_radius_search(kdtree_t* tree, int slot,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size);
+int kd_tree_choose_split_dimension(kdtree_t* tree, const int* slots, int lo,
+        int hi, int depth);
+/*breadth first snapshot, see kdtree_freeze()*/
+int kd_tree_left_balanced_size(int count);
+void kd_tree_select_slot(kdtree_t* tree, int* slots, int lo, int hi, int k,
+        int dimension);
+void kd_tree_build_snapshot(kdtree_t* tree, int* slots, int lo, int hi,
+        int position, int depth);
+/*subtree sizes & partial rebuilds, see kdtree_set_balance_factor()*/
+void kd_tree_count_insert(kdtree_t* tree, kd_tree_node** root,
+        kd_tree_node* node, int depth);
+void kd_tree_rebuild_on_insert(kdtree_t* tree, kd_tree_node** root,
+        const int k_dimensions);
+void kd_tree_count_delete(kd_tree_node* node);
+void kd_tree_rebuild_partial(kdtree_t* tree, kd_tree_node** root,
+        kd_tree_node* node, int depth);
+kd_tree_node* kd_tree_build_slots(kdtree_t* tree, int* slots, int lo, int hi,
+        int depth);
+/*forest of 2^i point trees, see kdtree_set_forest()*/
+kd_tree_node* kd_tree_build_forest(kdtree_t* tree, int rows);
+void kd_tree_forest_insert(kdtree_t* tree, const float key[],
+        const int k_dimensions, int id);
+kd_tree_node* kd_tree_forest_top(kdtree_t* tree);
+int kd_tree_search_from(kdtree_t* tree, kd_tree_node* root,
+        const float data[], const int k_dimensions);
+/*background rebuild, see kdtree_set_background_rebuild()*/
+int kd_tree_start_background_rebuild(kdtree_t* tree);
+void* kd_tree_background_rebuild_main(void* arg);
+int kd_tree_finish_background_rebuild(kdtree_t* tree, int wait, int apply);
+void kd_tree_log_delta(kdtree_t* tree, const float point[], int id);
+kd_tree_node* kd_tree_sync_background(kdtree_t* tree, kd_tree_node* root);
+/*insert buffer, see kdtree_set_buffer_size()*/
+int kd_tree_buffer_add(kdtree_t* tree, const float data[], int id);
+int kd_tree_buffer_find(kdtree_t* tree, const float data[]);
+int kd_tree_buffer_delete(kdtree_t* tree, const float data[]);
+int kd_tree_buffer_update(kdtree_t* tree, const float target_data[],
+        const float new_data[]);
+int kd_tree_flush_buffer(kdtree_t* tree);
+void kd_tree_free_buffer(kdtree_t* tree);
+void kd_tree_buffer_distances(kdtree_t* tree, int first, int rows,
+        const float data_point[], const int k_dimensions, float* out);
+void kd_tree_buffer_knn_search(kdtree_t* tree, const float data_point[],
+        const int k_dimensions, int capacity, kd_tree_knn_candidate* heap,
+        int* size);
+void kd_tree_buffer_radius_search(kdtree_t* tree, const float data_point[],
+        const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size);
+void kd_tree_snapshot_knn_search(kdtree_t* tree, int position,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size);
+void kd_tree_snapshot_radius_search(kdtree_t* tree, int position,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size);
+/*search of the snapshot, the compact nodes or the nodes*/
+void kd_tree_knn_search_from(kdtree_t* tree, kd_tree_node* root,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size);
+void kd_tree_radius_search_from(kdtree_t* tree, kd_tree_node* root,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size);
 /*function related to sorting,finding median of arrays*/
 void insertion_sort_based_on_distance(kd_tree_node* arr[], int n);
 void insertion_sort_based_on_distance2(kd_tree_node* arr, int n);
@@ -193,29 +365,46 @@ int is_empty_node(kd_tree_node* node, int number_of_dimensions);
 /*=============================================================================
 Implementations -kdtree  
 ==============================================================================*/
-int kdtree_build_index( kdtree_t* self,
-                        float* dataset,
-                             int rows,
-                             int cols);
+/*return default tree*/
+kdtree_t* kd_tree_get_kd_tree()
+{
+     return self;
+}
 
 /*=============================================================================
-Function        kdtree_free_index
-Description:    
+Function       kd_tree_set_kd_tree
+Description:   selects the default tree used by the legacy kd_tree_* API &
+ *             points the legacy heap variables at its heaps.
 ==========================================================*/
-void kdtree_free_index(kdtree_t* self);
-
-/*return tree*/
-kdtree_t* kd_tree_get_kd_tree()
+void kd_tree_set_kd_tree(kdtree_t* tree)
 {
-    if (NULL==self)
+    self = tree;
+    if (NULL != tree && NULL != tree->_internals)
     {
-     self = (kdtree_t*) calloc (1, sizeof (kdtree_t));
-     assert(self);
+        kd_tree_processing_space = tree->_internals->processing_space;
+        node_space = tree->_internals->node_space;
+        node_processing_space = tree->_internals->node_processing_space;
+        node_knn_result_space = tree->_internals->node_knn_result_space;
+        batch_node_processing_space =
+                tree->_internals->batch_node_processing_space;
+        columns_median_space = tree->_internals->columns_median_space;
+        columns_median_processing_space =
+                tree->_internals->columns_median_processing_space;
+        k_dimensions = tree->_internals->k_dimensions;
+    }
+    else
+    {
+        kd_tree_processing_space = NULL;
+        node_space = NULL;
+        node_processing_space = NULL;
+        node_knn_result_space = NULL;
+        batch_node_processing_space = NULL;
+        columns_median_space = NULL;
+        columns_median_processing_space = NULL;
     }
-     return self;
 }
 
-int kd_tree_is_debug_on()
+int kdtree_is_debug_on(kdtree_t* self)
 {
     if (NULL!=self)
     {
@@ -227,7 +416,7 @@ int kd_tree_is_debug_on()
     }
 }
 
-void kd_tree_set_debug_on(int on)
+void kdtree_set_debug_on(kdtree_t* self, int on)
 {
     if (NULL!=self)
     {
@@ -235,60 +424,110 @@ void kd_tree_set_debug_on(int on)
     }
 }
 
+int kd_tree_is_debug_on()
+{
+    return kdtree_is_debug_on(kd_tree_get_kd_tree());
+}
+
+void kd_tree_set_debug_on(int on)
+{
+    kdtree_set_debug_on(kd_tree_get_kd_tree(), on);
+}
+
 void kd_tree_set_k_dimensions(int max_dimensions)
 {
+    if (NULL != kd_tree_get_kd_tree())
+    {
+        kd_tree_get_kd_tree()->_internals->k_dimensions = max_dimensions;
+    }
     k_dimensions = max_dimensions;
 }
 
+int kdtree_get_k_dimensions(kdtree_t* self)
+{
+    if (NULL != self)
+    {
+        return self->_internals->k_dimensions;
+    }
+    else
+    {
+        return k_dimensions;
+    }
+}
+
 int kd_tree_get_k_dimensions()
 {
-    return k_dimensions; 
+    return kdtree_get_k_dimensions(kd_tree_get_kd_tree());
 }
 
-void kd_tree_set_rows_size(int rows)
+void kd_tree_set_rows_size(kdtree_t* tree, int rows)
 {
-    heap_size = rows; 
+    tree->_internals->heap_size = rows;
 }
-int kd_tree_get_rows_size()
+int kd_tree_get_rows_size(kdtree_t* tree)
 {
-    return heap_size; 
+    return tree->_internals->heap_size;
 }
-int kd_tree_get_processing_size()
+int kd_tree_get_processing_size(kdtree_t* tree)
 {
-    return  kd_tree_get_rows_size() *2; 
+    return  kd_tree_get_rows_size(tree) *2;
 }
 
 /*mutator*/
-void kd_tree_set_root(kd_tree_node* root)
+void kd_tree_set_root(kdtree_t* tree, kd_tree_node* root)
 {
  /*DONT check/block this function using  kd_tree_allow_update flag, because
     this function is used by kd_tree_rebuild(0 that will also block the 
   * rebuild!*/
-    if (NULL != kd_tree_get_kd_tree()) {
-        kd_tree_get_kd_tree()->_root = root;
+    if (NULL != tree) {
+        tree->_root = root;
     } else {
         printf("kd_tree_set_root(), kd_tree is NULL,call init. ");
     }
 }
 
+kd_tree_node* kdtree_get_root(kdtree_t* self)
+{
+    if (NULL != self)
+    {
+        return self->_root;
+    }
+    else
+    {
+        return NULL;
+    }
+}
+
 kd_tree_node* kd_tree_get_root()
 {
-  return kd_tree_get_kd_tree()->_root;
+  return kdtree_get_root(kd_tree_get_kd_tree());
+}
+
+kd_tree_node* kdtree_get_knn_result_space(kdtree_t* self)
+{
+    if (NULL != self)
+    {
+        return self->_internals->node_knn_result_space;
+    }
+    else
+    {
+        return NULL;
+    }
 }
 
 
 void
-kd_tree_set_previous_tree_size (const int size)
+kd_tree_set_previous_tree_size (kdtree_t* tree, const int size)
 {
-    if (NULL!=kd_tree_get_kd_tree())
+    if (NULL!=tree)
     {
-        kd_tree_get_kd_tree()->_internals->previous_tree_size = size;
+        tree->_internals->previous_tree_size = size;
     }
 }
 
-float kd_tree_get_previous_tree_size() {
-    if (NULL != kd_tree_get_kd_tree()) {
-        return kd_tree_get_kd_tree()->_internals->previous_tree_size;
+float kd_tree_get_previous_tree_size(kdtree_t* tree) {
+    if (NULL != tree) {
+        return tree->_internals->previous_tree_size;
 
     } else {
         return -1;
@@ -296,17 +535,17 @@ float kd_tree_get_previous_tree_size() {
 }
 
 void
-set_current_number_of_kd_tree_nodes(int number_of_nodes)
+set_current_number_of_kd_tree_nodes(kdtree_t* tree, int number_of_nodes)
 {
-     if (NULL!=self)
+     if (NULL!=tree)
      {
-    self->_internals->current_number_of_kd_tree_nodes=number_of_nodes;
+    tree->_internals->current_number_of_kd_tree_nodes=number_of_nodes;
      }
 }
 
 
 int
-kd_tree_get_current_number_of_kd_tree_nodes()
+kdtree_get_current_number_of_kd_tree_nodes(kdtree_t* self)
 {
     if (NULL!=self)
     {
@@ -318,23 +557,70 @@ kd_tree_get_current_number_of_kd_tree_nodes()
     }
 }
 
+int
+kd_tree_get_current_number_of_kd_tree_nodes()
+{
+    return kdtree_get_current_number_of_kd_tree_nodes(kd_tree_get_kd_tree());
+}
+
+int kd_tree_get_subtree_height(kd_tree_node* node)
+{
+    int left = 0;
+    int right = 0;
+    if (NULL == node)
+    {
+        return 0;
+    }
+    left = kd_tree_get_subtree_height(node->left);
+    right = kd_tree_get_subtree_height(node->right);
+    return 1 + (left > right ? left : right);
+}
+
+int kdtree_get_height(kdtree_t* self)
+{
+    int height = 0;
+    int level = 0;
+
+    if (NULL == self || is_empty_node(kdtree_get_root(self), 
+            kdtree_get_k_dimensions(self)))
+    {
+        return 0;
+    }
+    if (!self->_internals->forest)
+    {
+        return kd_tree_get_subtree_height(kdtree_get_root(self));
+    }
+    /*height of the highest level*/
+    for (; level < KD_TREE_FOREST_LEVELS; level++)
+    {
+        if (NULL != self->_internals->forest_roots[level] &&
+                kd_tree_get_subtree_height(
+                self->_internals->forest_roots[level]) > height)
+        {
+            height = kd_tree_get_subtree_height(
+                    self->_internals->forest_roots[level]);
+        }
+    }
+    return height;
+}
+
 void
-kd_tree_increment_current_number_of_kd_tree_nodes()
+kd_tree_increment_current_number_of_kd_tree_nodes(kdtree_t* tree)
 {
-    if (NULL!=kd_tree_get_kd_tree())
+    if (NULL!=tree)
     {
-    kd_tree_get_kd_tree()->_internals->current_number_of_kd_tree_nodes++;
+    tree->_internals->current_number_of_kd_tree_nodes++;
     }
 }
 
 
 void
-kd_tree_decrement_current_number_of_kd_tree_nodes ()
+kd_tree_decrement_current_number_of_kd_tree_nodes (kdtree_t* tree)
 {
-    if (NULL!=kd_tree_get_kd_tree() &&  
-       kd_tree_get_kd_tree()->_internals->current_number_of_kd_tree_nodes>0)
+    if (NULL!=tree &&
+       tree->_internals->current_number_of_kd_tree_nodes>0)
     {
-    kd_tree_get_kd_tree()->_internals->current_number_of_kd_tree_nodes--;
+    tree->_internals->current_number_of_kd_tree_nodes--;
     }
     
 }
@@ -344,33 +630,342 @@ kd_tree_decrement_current_number_of_kd_tree_nodes ()
 Function        set_rebuild_threshold
 Description:    setter for  rebuild_threshold. By default is 1. 
 ==========================================================*/
-void kd_tree_set_rebuild_threshold(const float threshold)
+void kdtree_set_rebuild_threshold(kdtree_t* self, const float threshold)
 {
-    if (NULL!=kd_tree_get_kd_tree())
+    if (NULL!=self)
     {
-     kd_tree_get_kd_tree()->_internals->rebuild_threshold = threshold;
+     self->_internals->rebuild_threshold = threshold;
     }
-    
+
+}
+
+void kd_tree_set_rebuild_threshold(const float threshold)
+{
+    kdtree_set_rebuild_threshold(kd_tree_get_kd_tree(), threshold);
 }
 
 /*=============================================================================
 Function        get_rebuild_threshold
 Description:    getter for rebuild_threshold By default it returns 1. 
 ==========================================================*/
-float kd_tree_get_rebuild_threshold() {
-    if (NULL != kd_tree_get_kd_tree()) {
+float kdtree_get_rebuild_threshold(kdtree_t* self) {
+    if (NULL != self) {
 
-        return kd_tree_get_kd_tree()->_internals->rebuild_threshold;
+        return self->_internals->rebuild_threshold;
     } else {
         return -1;
     }
 }
+
+float kd_tree_get_rebuild_threshold() {
+    return kdtree_get_rebuild_threshold(kd_tree_get_kd_tree());
+}
+
+/*=============================================================================
+Function        kdtree_set_leaf_size
+Description:    setter for leaf_size, the max points per leaf bucket of a bulk
+ *              build. Returns 0 if leaf_size is not in 
+ *              [1, KD_TREE_MAX_LEAF_SIZE]. 
+==========================================================*/
+int kdtree_set_leaf_size(kdtree_t* self, int leaf_size)
+{
+    if (NULL == self || leaf_size < 1 || leaf_size > KD_TREE_MAX_LEAF_SIZE)
+    {
+        printf("kdtree_set_leaf_size(), Error invalid tree or leaf_size.\n");
+        return 0;
+    }
+    self->_internals->leaf_size = leaf_size;
+    return 1;
+}
+
+int kdtree_get_leaf_size(kdtree_t* self)
+{
+    if (NULL != self)
+    {
+        return self->_internals->leaf_size;
+    }
+    return -1;
+}
+
+/*=============================================================================
+Function        kdtree_set_split_policy
+Description:    setter for split_policy, see kd_tree_choose_split_dimension().
+ *              Returns 0 if policy is not a KD_TREE_SPLIT_* value. 
+==========================================================*/
+int kdtree_set_split_policy(kdtree_t* self, int policy)
+{
+    if (NULL == self || policy < KD_TREE_SPLIT_ROUND_ROBIN ||
+            policy > KD_TREE_SPLIT_SLIDING_MIDPOINT)
+    {
+        printf("kdtree_set_split_policy(), Error invalid tree or policy.\n");
+        return 0;
+    }
+    self->_internals->split_policy = policy;
+    return 1;
+}
+
+int kdtree_get_split_policy(kdtree_t* self)
+{
+    if (NULL != self)
+    {
+        return self->_internals->split_policy;
+    }
+    return -1;
+}
+
+/*=============================================================================
+Function        kdtree_set_balance_factor
+Description:    setter for balance_factor, see kd_tree_count_insert(). 
+ *              Returns 0 unless alpha is 0 or in 
+ *              (KD_TREE_MIN_BALANCE_FACTOR, KD_TREE_MAX_BALANCE_FACTOR). 
+==========================================================*/
+int kdtree_set_balance_factor(kdtree_t* self, float alpha)
+{
+    if (NULL == self || (alpha != 0.0f &&
+            (alpha <= KD_TREE_MIN_BALANCE_FACTOR ||
+            alpha >= KD_TREE_MAX_BALANCE_FACTOR)))
+    {
+        printf("kdtree_set_balance_factor(), Error invalid tree or alpha.\n");
+        return 0;
+    }
+    self->_internals->balance_factor = alpha;
+    return 1;
+}
+
+float kdtree_get_balance_factor(kdtree_t* self)
+{
+    if (NULL != self)
+    {
+        return self->_internals->balance_factor;
+    }
+    return -1;
+}
+
+/*=============================================================================
+Function        kdtree_set_forest
+Description:    gathers the points & builds them again as a forest (on) or as
+ *              one tree (off), see kd_tree_bulk_build(). O(n log n), nothing
+ *              to do if the mode does not change. The forest holds a static,
+ *              fully built tree of 2^i points for every bit i set in n, an 
+ *              insert merges levels like a binary counter increment (see 
+ *              kd_tree_forest_insert()) & searches merge the results of every
+ *              level. Builds, rebuilds & kdtree_add_points_batch() lay out 
+ *              the levels from scratch. The rebuild_threshold & 
+ *              balance_factor policies do not apply while on.
+==========================================================*/
+int kdtree_set_forest(kdtree_t* self, int on)
+{
+    int rows = 0;
+
+    if (NULL == self || !self->_internals->kd_tree_allow_update)
+    {
+        printf("kdtree_set_forest(), Error invalid tree or a read only "
+                "index.\n");
+        return 0;
+    }
+    on = 0 != on;
+    if (self->_internals->forest != on)
+    {
+        rows = kd_tree_gather_points(self);
+        self->_internals->forest = on;
+        kd_tree_bulk_build(self, rows);
+        kd_tree_set_previous_tree_size(self, rows);
+    }
+    return 1;
+}
+
+int kdtree_is_forest(kdtree_t* self)
+{
+    return NULL != self && self->_internals->forest;
+}
+
+/*=============================================================================
+Function        kdtree_set_background_rebuild
+Description:    setter for background_rebuild, turning it off swaps in a 
+ *              running rebuild first, see kdtree_wait_rebuild(). The insert 
+ *              that crosses the threshold starts the thread, which copies the
+ *              points to a second node heap & builds the balanced tree there
+ *              while the writes to this tree are logged. The next write after
+ *              the build replays the log on the new tree & swaps the heaps, 
+ *              see kd_tree_finish_background_rebuild(). Builds, kdtree_init()
+ *              & kdtree_free() wait for the thread & drop its tree.
+==========================================================*/
+int kdtree_set_background_rebuild(kdtree_t* self, int on)
+{
+    if (NULL == self)
+    {
+        printf("kdtree_set_background_rebuild(), Error invalid tree.\n");
+        return 0;
+    }
+    if (!on)
+    {
+        kd_tree_finish_background_rebuild(self, 1, 1);
+    }
+    self->_internals->background_rebuild = 0 != on;
+    return 1;
+}
+
+int kdtree_is_rebuilding(kdtree_t* self)
+{
+    return NULL != self && self->_internals->background_running;
+}
+
+int kdtree_wait_rebuild(kdtree_t* self)
+{
+    return NULL != self && kd_tree_finish_background_rebuild(self, 1, 1);
+}
+
+/*=============================================================================
+Function        kdtree_set_buffer_size
+Description:    setter for buffer_capacity, merges the points buffered so far
+ *              & allocates the new buffer, see kd_tree_buffer_add(). An 
+ *              insert appends to the buffer, O(k_dimensions), & gets its id 
+ *              at once, a full buffer is inserted into the tree point by 
+ *              point (see kd_tree_flush_buffer()). Searches scan the 
+ *              buffered points with the block distance kernel & merge them 
+ *              with the results of the tree.
+==========================================================*/
+int kdtree_set_buffer_size(kdtree_t* self, int capacity)
+{
+    kdtree_internals* internals = NULL;
+    int k_dimensions = 0;
+    int i = 0;
+
+    if (NULL == self || capacity < 0 ||
+            capacity > kd_tree_get_rows_size(self) ||
+            !self->_internals->kd_tree_allow_update)
+    {
+        printf("kdtree_set_buffer_size(), Error invalid tree, capacity or a "
+                "read only index.\n");
+        return 0;
+    }
+    internals = self->_internals;
+    k_dimensions = kdtree_get_k_dimensions(self);
+    kd_tree_flush_buffer(self);
+    kd_tree_free_buffer(self);
+    if (0 == capacity)
+    {
+        return 1;
+    }
+    internals->buffer_nodes = (kd_tree_node*) calloc(capacity,
+            sizeof (kd_tree_node));
+    internals->buffer_coordinates = kd_tree_alloc_coordinate_arena(capacity,
+            k_dimensions);
+    if (NULL == internals->buffer_nodes ||
+            NULL == internals->buffer_coordinates)
+    {
+        printf("kdtree_set_buffer_size(), Error could not allocate the "
+                "buffer.\n");
+        kd_tree_free_buffer(self);
+        return 0;
+    }
+    for (; i < capacity; i++)
+    {
+        internals->buffer_nodes[i].dataset = internals->buffer_coordinates +
+                (size_t) i * k_dimensions;
+        internals->buffer_nodes[i].id = -1;
+        internals->buffer_nodes[i].bucket_size = 1;
+    }
+    internals->buffer_capacity = capacity;
+    return 1;
+}
+
+int kdtree_get_buffer_size(kdtree_t* self)
+{
+    return NULL != self ? self->_internals->buffer_capacity : 0;
+}
+
+int kdtree_get_buffered_points(kdtree_t* self)
+{
+    return NULL != self ? self->_internals->buffer_count : 0;
+}
+
+int kdtree_flush_buffer(kdtree_t* self)
+{
+    if (NULL == self || !self->_internals->kd_tree_allow_update)
+    {
+        return 0;
+    }
+    return kd_tree_flush_buffer(self);
+}
+
+/*=============================================================================
+Function        kd_tree_choose_split_dimension
+Description:    split dimension of a bulk build node over the points [lo, hi):
+ *              depth % k_dimensions for KD_TREE_SPLIT_ROUND_ROBIN, else the 
+ *              dimension with the largest max - min (KD_TREE_SPLIT_MAX_SPREAD)
+ *              or variance (KD_TREE_SPLIT_MAX_VARIANCE) of those points. 
+ *              KD_TREE_SPLIT_SLIDING_MIDPOINT uses the largest max - min.
+ *              O((hi - lo) * k_dimensions), no extra memory.
+Inputs:         slots - slots of node_space of the points, NULL if the points
+ *              are the rows [lo, hi) of node_space.
+References:     J. H. Friedman, J. L. Bentley, R. A. Finkel, 1977, split on 
+ *              the coordinate of largest spread.
+==========================================================*/
+int kd_tree_choose_split_dimension(kdtree_t* tree, const int* slots, int lo,
+        int hi, int depth)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    int policy = tree->_internals->split_policy;
+    int spread = policy != KD_TREE_SPLIT_MAX_VARIANCE;
+    int best = depth % k_dimensions;
+    double best_score = -1.0;
+    int c = 0;
+    int i = 0;
+
+    if (policy == KD_TREE_SPLIT_ROUND_ROBIN || hi - lo < 2)
+    {
+        return best;
+    }
+    for (; c < k_dimensions; c++)
+    {
+        float low = FLT_MAX;
+        float high = -FLT_MAX;
+        /*sums of the values shifted by the first one, avoids cancellation
+         of large offsets*/
+        double shift = nodes[NULL != slots ? slots[lo] : lo].dataset[c];
+        double sum = 0.0;
+        double sum_of_squares = 0.0;
+        double score = 0.0;
+        for (i = lo; i < hi; i++)
+        {
+            float value = nodes[NULL != slots ? slots[i] : i].dataset[c];
+            if (spread)
+            {
+                low = value < low ? value : low;
+                high = value > high ? value : high;
+            }
+            else
+            {
+                sum += value - shift;
+                sum_of_squares += (value - shift) * (value - shift);
+            }
+        }
+        if (spread)
+        {
+            score = (double) high - low;
+        }
+        else
+        {
+            score = sum_of_squares / (hi - lo) -
+                    (sum / (hi - lo)) * (sum / (hi - lo));
+        }
+        if (score > best_score)
+        {
+            best_score = score;
+            best = c;
+        }
+    }
+    return best;
+}
 /*=============================================================================
 Function        new_node
 Description:    given data create a noe & return it. 
 ==========================================================*/
 kd_tree_node*
-kd_tree_new_node(const float data[], const int k_dimensions, const int copying) 
+kd_tree_new_node(kdtree_t* tree, const float data[], const int k_dimensions,
+        const int copying) 
 {
     kd_tree_node* new_node = NULL; 
     /*DONT check/block this function using  kd_tree_allow_update flag, because
@@ -378,13 +973,16 @@ kd_tree_new_node(const float data[], const int k_dimensions, const int copying)
 
     /*if we are constructing the kd-tree */
     if (!copying) {
-        new_node = get_pre_allocated_kd_tree_node_heap();
-
-        kd_tree_increment_current_number_of_kd_tree_nodes();
+        new_node = get_pre_allocated_kd_tree_node_heap(tree);
+        if (NULL == new_node) {
+            return NULL;
+        }
+        kd_tree_drop_compact(tree);
+        kd_tree_increment_current_number_of_kd_tree_nodes(tree);
 
     }        /*else if we are creating a temporary copy */
     else {
-        new_node = get_pre_allocated_processing_heap();
+        new_node = get_pre_allocated_processing_heap(tree);
     }
     /*copy data*/
      int i = 0;
@@ -413,16 +1011,24 @@ Output:         Returns a pointer to new created or updated kd-tree type tree.
 ==========================================================*/
 /*mutator*/
 void kd_tree_add_points(kd_tree_node** root, const float data []) {
-
-    if (NULL != kd_tree_get_kd_tree()) {
-        if (kd_tree_get_kd_tree()->_internals->kd_tree_allow_update) {
-
-           kd_tree_add_record(root,
-                    data,
-                    0,
-                    kd_tree_get_k_dimensions(),
-                    0,
-                    kd_tree_get_rebuild_threshold());
+    kdtree_t* tree = kd_tree_get_kd_tree();
+
+    if (NULL != tree) {
+        if (tree->_internals->kd_tree_allow_update) {
+
+           *root = kd_tree_sync_background(tree, *root);
+           if (*root == kdtree_get_root(tree) &&
+                   kd_tree_buffer_add(tree, data, -1)) {
+               /*a merge of the buffer builds a new tree*/
+               *root = kdtree_get_root(tree);
+           } else {
+               kd_tree_add_record(tree, root,
+                        data,
+                        0,
+                        kdtree_get_k_dimensions(tree),
+                        0,
+                        kdtree_get_rebuild_threshold(tree), -1);
+           }
         
 
 
@@ -436,21 +1042,49 @@ void kd_tree_add_points(kd_tree_node** root, const float data []) {
     }
 }
 
+/*mutator*/
+void kdtree_add_points(kdtree_t* self, const float data []) {
+    kdtree_add_point_with_id(self, data, -1);
+}
+
+/*mutator*/
+void kdtree_add_point_with_id(kdtree_t* self, const float data [], int id) {
+
+    if (NULL != self) {
+        if (self->_internals->kd_tree_allow_update) {
+
+           kd_tree_sync_background(self, NULL);
+           if (!kd_tree_buffer_add(self, data, id)) {
+               kd_tree_add_record(self, &self->_root,
+                        data,
+                        0,
+                        kdtree_get_k_dimensions(self),
+                        0,
+                        kdtree_get_rebuild_threshold(self), id);
+           }
+
+        } else {
+            printf("kdtree_add_points(),"
+                    " kd_tree is locked for rebuild or a read only index!");
+        }
+    } else {
+        printf("kdtree_add_points(),"
+                " kd_tree is NULL call init");
+    }
+}
+
 /*=============================================================================
 Function        kd_tree_rebuild 
 Description:    
                 IF threshold is reached
                     THEN
  *                      1) lock all mutator operations allow only READ_ONLY
- *                      2)Similar to FLANN's implementation split based on 
- *                      statistic (median or variance). 
- *                      of specific column/dimension. 
- *                          a)traverse current tree & get back a vector
- *                          b)extract column wise values 
- *                          c)sort (only using text book median)
- *                          d)calc median & set column 
- *                      3) reset  previous tree memory (actually reset heap)
- *                      4) REBUILD 
+ *                      2) gather the points of the tree into the first
+ *                      rows of node_space (in place, no traversal). 
+ *                      3) calc column medians (statistics)
+ *                      4) REBUILD, similar to FLANN's implementation every
+ *                      subtree is split at the median of its own points,
+ *                      see kd_tree_bulk_build(). O(n log n).
  *                      5) Unlock tree update operations. DONE.
 References:             based on FLANN implementation.
  *                      FLANN’s implementation of k-d trees uses a simple
@@ -470,713 +1104,3818 @@ J. Jo, J. Seo, and J.-D. Fekete, “PANENE: A Progressive Algorithm for Indexing
 
 /*mutator*/
 int
-kd_tree_rebuild(kd_tree_node* root, const int k_dimensions) {
+kd_tree_rebuild(kdtree_t* tree, kd_tree_node* root, const int k_dimensions) {
     /*DEBUGGING*/
-    kd_tree_get_kd_tree()->_internals->rebuild_counter++; 
-    if (kd_tree_is_debug_on())
+    tree->_internals->rebuild_counter++; 
+    if (kdtree_is_debug_on(tree))
     {
         printf("REBUILD #,%d=\n", 
-                kd_tree_get_kd_tree()->_internals->rebuild_counter);
+                tree->_internals->rebuild_counter);
     }
 
 
     int result_size = 0;
-    float* info = NULL;
-    kd_tree_node* current = NULL;
-    kd_tree_node* inorder_traversed = NULL;
     if (NULL != root) {
-        current = root;
         /*1)lock all mutator operations allow only*/
-        kd_tree_get_kd_tree()->_internals->kd_tree_allow_update = 0;
-        /*2)Similar to nanoFlann or flann implementation, split using median 
-        a)traverse current tree & get back a vector*/      
-        /*START TRAVERSE*/
-        int heap_index = 0;
-        heap_index = kd_tree_in_order_traversal(current ,k_dimensions);
-        /* END TRAVERSAL*/
-        result_size = heap_index;
-        inorder_traversed = node_knn_result_space;
-        /*END TRAVERSE*/
-        /*b)extract column wise values*/
+        tree->_internals->kd_tree_allow_update = 0;
+        /*2)gather the points of the tree into rows [0, result_size) of 
+         node_space, see kd_tree_gather_points()*/
+        result_size = kd_tree_gather_points(tree);
+        /*3)column medians & 4) REBUILD, every subtree is split at its own
+         median, see kd_tree_bulk_build()*/
         if (result_size > 0) {
-            /* START - calculate column medians */
-            kd_tree_init_columns_median_processing_space(
-                    &columns_median_processing_space, kd_tree_get_rows_size());
-           
-            int column = 0;
-            float median_val2;
-            for (; column < k_dimensions; column++) {
-                /*printf ("column {");*/
-                int row = 0;
-                for (; row < result_size; row++) {
-
-                    if (NULL != inorder_traversed[row].dataset) {
-                        info = (float *) inorder_traversed[row].dataset;
+            kd_tree_bulk_build(tree, result_size);
+        }//end if result > 0 
+        /*5) Unlock tree update operations. DONE.*/
+        tree->_internals->kd_tree_allow_update = 1;
+    }//end if root is NOT null 
+    return result_size;
+}
 
-                        if (NULL != info && info[0] != FLT_MAX) {
+/*=============================================================================
+Function        kd_tree_gather_points
+Description:    moves the points of the tree to rows [0, n) of node_space, in
+ *              place & without traversal. Every slot below the bump index 
+ *              that is not empty (released slots are set to FLT_MAX) holds a
+ *              point of the tree. The links are left as they are, a bulk 
+ *              build of the n rows must follow.
+Output:         n, the number of points.
+==========================================================*/
+int kd_tree_gather_points(kdtree_t* tree)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    int result_size = 0;
+    int i = 0;
 
-                            columns_median_processing_space[row] = 
-                            *(info + column);
-                            
-                        }
-                    }
-                }/*end row loop*/
-                /*printf ("}\n");*/
-                /*sort (only using text book median)*/
-                /*used before regular median 
-                 * insertion_sort(columns_median_processing_space, 
-                 * result_size);*/
-                /*DEBUGGING printf ("result_size=%d:\n", result_size);*/
-                /*step 3- start column median calculation*/
-                median_val2 = median(columns_median_processing_space,
-                        result_size);
-                kd_tree_set_column_median(median_val2,column);
-                /*printf ("median_val2=%f:\n", median_val2);*/
-
-            }/*end column median calculation loop */       
-    /*4) batch delete entire node_space all tree nodes except the tree.
-     Note: we reset the median before delete so we cannot use the APIs,
-     delete function, because a new median means we CANNOT find nodes, 
-     that were based on the old median. Nor do we want to delete 1 by 1, 
-     because thats slow, therefore  we just reset the heap. */      
-    int i = 0;
-    int c=0;
-    for (; i <  kd_tree_get_rows_size(); i++)
+    for (; i < tree->_internals->node_bump_index; i++)
     {
-         /*reset  values */
-        if (NULL!=node_space[i].dataset)
+        if (nodes[i].dataset[0] != FLT_MAX)
         {
-            c=0;
-            for (; c<kd_tree_get_k_dimensions(); c++)
+            if (i != result_size)
             {
-                node_space[i].dataset[c] =  FLT_MAX;
+                memcpy(nodes[result_size].dataset, nodes[i].dataset,
+                        sizeof (float)*k_dimensions);
+                nodes[result_size].id = nodes[i].id;
             }
-        }   
-        
-        node_space[i].distance_to_neighbor= FLT_MAX;
-        node_space[i].left = NULL;
-        node_space[i].right=NULL;
-        node_space[i].parent= NULL; 
-        
+            result_size++;
+        }
     }
-    set_current_number_of_kd_tree_nodes(0);
-  
-    /*printf("DEBUGGING dimension %d, regular_median=%f, median_wirth=%f:\n", 
-     column, median_val , median_val2);*/
-            /*4) REBUILD kd-tree loop. Add points back based on new medians*/
-            i = 0;
-            for (; i < result_size; i++) {
-                if (
-                        NULL != inorder_traversed[i].dataset) {
-                    info = (float *) inorder_traversed[i].dataset;
-
-                    if (NULL != info) {
-
-                        kd_tree_add_record(&root,
-                                inorder_traversed[i].dataset,
-                                0,
-                                kd_tree_get_k_dimensions(),
-                                0,
-                                kd_tree_get_rebuild_threshold());
-                    }
-                }
-
-            }/*rebuild loop */
-       
-        }//end if result > 0 
-        /*5) Unlock tree update operations. DONE.*/
-        kd_tree_get_kd_tree()->_internals->kd_tree_allow_update = 1;
-    }//end if root is NOT null 
     return result_size;
 }
+
 /*=============================================================================
-Function        kd_tree_add_record
-Description:    build a kd tree
-References:     1) https://www.sanfoundry.com/java-program-find-nearest-
- *                neighbour-using-k-d-tree-search/
-                2) https://www.cs.cmu.edu/~ckingsf/bioinfo-lectures/kdtrees.pdf
-                3) https://www.geeksforgeeks.org/k-dimensional-tree/
-                4) https://github.com/jtsiomb/kdtree 
-                5) https://www.tutorialspoint.com/data_structures_algorithms/
- *                 tree_traversal_in_c.htm
-Inputs:         tree * root - The  pointer to the root of the kd-tree
- *              float data [] - use data with k_dimensions.
- *              int depth - Current dimension used for building the kd-tree
- *              int k_dimensions - number of columns in the dataset 
- *              (number  of  features).
- *              int copying - Either 0(false) or 1(true). By default 0 is used 
- *              to insert a new record. This function is also used to return
- *              internally new kd-tree used for traversal operations. 
-Output:         Returns a pointer to new created or updated kd-tree type tree. 
-TODO:           Implement iterative version. 
+Function        kd_tree_start_background_rebuild
+Description:    makes processing_space the owner of a second node heap as 
+ *              large as node_space (allocated by the first rebuild & kept) &
+ *              starts background_thread on kd_tree_background_rebuild_main().
+ *              O(1), the thread copies the points. Writes from now on wait 
+ *              for the copy, then they are logged, see kd_tree_log_delta().
+Output:         1 if a background rebuild runs, 0 if it could not start, the
+ *              caller then rebuilds on its own thread.
 ==========================================================*/
+int kd_tree_start_background_rebuild(kdtree_t* tree)
+{
+    kdtree_internals* internals = tree->_internals;
+    kdtree_t* shadow = kd_tree_get_processing_space(tree);
+    kdtree_internals* shadow_internals = shadow->_internals;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    int rows = kd_tree_get_rows_size(tree);
 
-/*mutator*/
-void
-kd_tree_add_record(kd_tree_node** root, const float key [], int depth,
-        const int k_dimensions,
-        const int copying, const float rebuild_threshold) {
-    /*DONT check/block this function using  kd_tree_allow_update flag, because
-    this function is used by kd_tree_rebuild, that will also block the rebuild!*/
-    int current_number_of_kd_tree_nodes_val = 
-    kd_tree_get_current_number_of_kd_tree_nodes();
-    int kd_tree_get_previous_tree_size_val = kd_tree_get_previous_tree_size();
-    int rebuild_threshold_val = kd_tree_get_rebuild_threshold();
-    float current_ratio = 0.0f;
-    float median = 0.0;
-    size_t cd = 0;
-    /*if we are in the middle of rebuilding dont trigger the rebuild logic again
-    that will cause a unexpected behavior*/
-    if (kd_tree_get_kd_tree()->_internals->kd_tree_allow_update != 0) {
-        //guarding against division by 0 
-        if (kd_tree_get_previous_tree_size_val != 0) {
-            current_ratio = current_number_of_kd_tree_nodes_val /
-                    kd_tree_get_previous_tree_size_val;
-            /*rebuild thresh hold has been reached?*/
-            if (current_ratio > rebuild_threshold_val) {
-                /*call rebuild procedure & send a copy of root for the rebuild*/
-                kd_tree_init_node_processing_space_heap(&node_processing_space, 
-                        kd_tree_get_k_dimensions());
-                /*kd_tree_rebuild will 1st lock all write operations*/
-                kd_tree_rebuild(kd_tree_get_root(), k_dimensions);
-                kd_tree_set_previous_tree_size(kd_tree_get_current_number_of_kd_tree_nodes());
-
-            }
-        } else {
-            kd_tree_set_previous_tree_size(kd_tree_get_current_number_of_kd_tree_nodes());
-        }
+    if (internals->background_running)
+    {
+        return 1;
     }
-    /*start recursive insert*/
-     if (is_empty_node(*root, k_dimensions)) {
-        *root = kd_tree_new_node(key, k_dimensions, copying);
-        /*was the root set before*/
-        if (is_empty_node(kd_tree_get_root(), k_dimensions)) {
-            kd_tree_set_root(*root);
-        }
+    if (NULL == shadow_internals->node_space)
+    {
+        kd_tree_set_rows_size(shadow, rows);
+        kd_tree_alloc_node_space_heap(shadow, rows, k_dimensions);
     }
-    else {
-        /* Calculate current dimension (cd) of comparison */
-        cd = depth % k_dimensions;
-        /*determine current dimension/*/
-        /*by using modula operator we can cycle through all dimensions */
-        /* and decide the left or right subtree*/
-        median = kd_tree_get_column_median(cd);
-
-        if (key[cd] < median) {
-
-           kd_tree_add_record( &(*root)->left, key, depth + 1,
-                    k_dimensions,
-                    copying, rebuild_threshold);
-        } else {
+    if (NULL == shadow_internals->node_space ||
+            NULL == shadow_internals->coordinate_space ||
+            NULL == shadow_internals->node_free_slots)
+    {
+        printf("kd_tree_start_background_rebuild(), Error could not allocate"
+                " the second node heap.\n");
+        kd_tree_free_node_space(shadow);
+        return 0;
+    }
+    shadow_internals->k_dimensions = k_dimensions;
+    shadow_internals->leaf_size = internals->leaf_size;
+    shadow_internals->split_policy = internals->split_policy;
+    shadow_internals->balance_factor = 0.0f;
+    shadow_internals->forest = 0;
+    /*replaying the log must not rebuild processing_space*/
+    shadow_internals->kd_tree_allow_update = 0;
+    internals->delta_count = 0;
+    internals->background_copied = 0;
+    internals->background_done = 0;
+    internals->background_running = 1;
+    if (0 != pthread_create(&internals->background_thread, NULL,
+            kd_tree_background_rebuild_main, tree))
+    {
+        printf("kd_tree_start_background_rebuild(), Error could not start "
+                "the thread.\n");
+        internals->background_running = 0;
+        return 0;
+    }
+    internals->rebuild_counter++;
+    kd_tree_set_previous_tree_size(tree,
+            kdtree_get_current_number_of_kd_tree_nodes(tree));
+    return 1;
+}
 
+/*background_thread, copies the points of the tree to rows [0, n) of the heap
+of processing_space (like kd_tree_gather_points()) & bulk builds them there.
+Writes wait until background_copied, the thread writes to nothing else*/
+void* kd_tree_background_rebuild_main(void* arg)
+{
+    kdtree_t* tree = (kdtree_t*) arg;
+    kdtree_internals* internals = tree->_internals;
+    kdtree_t* shadow = kd_tree_get_processing_space(tree);
+    kd_tree_node* nodes = internals->node_space;
+    kd_tree_node* copies = shadow->_internals->node_space;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    int n = 0;
+    int i = 0;
 
-            kd_tree_add_record(&(*root)->right, key, depth + 1,
-                    k_dimensions,
-                    copying, rebuild_threshold);
+    for (; i < internals->node_bump_index; i++)
+    {
+        if (nodes[i].dataset[0] != FLT_MAX)
+        {
+            memcpy(copies[n].dataset, nodes[i].dataset,
+                    sizeof (float)*k_dimensions);
+            copies[n].id = nodes[i].id;
+            n++;
         }
-    }//end else
-    /*end recursive insert*/
-
+    }
+    pthread_mutex_lock(&internals->background_lock);
+    internals->background_copied = 1;
+    pthread_cond_broadcast(&internals->background_copy_done);
+    pthread_mutex_unlock(&internals->background_lock);
+    kd_tree_bulk_build(shadow, n);
+    pthread_mutex_lock(&internals->background_lock);
+    internals->background_done = 1;
+    pthread_mutex_unlock(&internals->background_lock);
+    return NULL;
 }
 
 /*=============================================================================
-Function        kd_tree_update_point 
-Description:    User friendly wrapper for internal kd_tree_update_record 
- *              function  
- *              which builds a kd-tree.    
-Inputs:         tree * root - The  pointer to the root of the kd-tree
- *              float target_data [] - data to be found and updated 
- *              float new_data [] - that will replace target_data []
-Output:         Returns a int flag acting as boolean 0 if update failed or 1 
- *              if operation was successful.      
+Function        kd_tree_finish_background_rebuild
+Description:    ends a running background rebuild. With apply the delta log 
+ *              is replayed on processing_space in order, then the two node 
+ *              heaps are swapped: node_space, coordinate_space, the pool & 
+ *              the root of processing_space become the tree's, O(1) besides
+ *              the replay. The old heap is the one of the next rebuild. 
+ *              Without apply the new tree is dropped.
+Inputs:         wait - 1 blocks until the thread is done, 0 returns at once 
+ *              while it still runs.
+Output:         1 if the new tree was swapped in.
 ==========================================================*/
-/*mutator*/
-int
-kd_tree_update_point(kd_tree_node* root, const float target_data [],  
-        const float new_data [])
+int kd_tree_finish_background_rebuild(kdtree_t* tree, int wait, int apply)
 {
- return kd_tree_update_record(root, target_data,  
-        new_data,kd_tree_get_k_dimensions());
+    kdtree_internals* internals = tree->_internals;
+    kdtree_t* shadow = kd_tree_get_processing_space(tree);
+    kdtree_internals* shadow_internals = NULL;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    kd_tree_node* nodes = NULL;
+    float* coordinates = NULL;
+    int* free_slots = NULL;
+    int slot_count = 0;
+    int done = 0;
+    int i = 0;
+
+    if (!internals->background_running)
+    {
+        return 0;
+    }
+    if (!wait)
+    {
+        pthread_mutex_lock(&internals->background_lock);
+        done = internals->background_done;
+        pthread_mutex_unlock(&internals->background_lock);
+        if (!done)
+        {
+            return 0;
+        }
+    }
+    pthread_join(internals->background_thread, NULL);
+    internals->background_running = 0;
+    if (!apply)
+    {
+        internals->delta_count = 0;
+        return 0;
+    }
+    shadow_internals = shadow->_internals;
+    for (; i < internals->delta_count; i++)
+    {
+        const float* point = internals->delta_points +
+                (size_t) i * k_dimensions;
+        if (internals->delta_ids[i] >= 0)
+        {
+            kd_tree_add_record(shadow, &shadow->_root, point, 0,
+                    k_dimensions, 0, 0.0f, internals->delta_ids[i]);
+        }
+        else
+        {
+            kd_tree_delete_data_point_helper(shadow, shadow->_root, point, 0,
+                    k_dimensions);
+        }
+    }
+    internals->delta_count = 0;
+    /*swap, slot i still owns row i of its heap's coordinates*/
+    nodes = internals->node_space;
+    internals->node_space = shadow_internals->node_space;
+    shadow_internals->node_space = nodes;
+    coordinates = internals->coordinate_space;
+    internals->coordinate_space = shadow_internals->coordinate_space;
+    shadow_internals->coordinate_space = coordinates;
+    free_slots = internals->node_free_slots;
+    internals->node_free_slots = shadow_internals->node_free_slots;
+    shadow_internals->node_free_slots = free_slots;
+    slot_count = internals->node_free_count;
+    internals->node_free_count = shadow_internals->node_free_count;
+    shadow_internals->node_free_count = slot_count;
+    slot_count = internals->node_bump_index;
+    internals->node_bump_index = shadow_internals->node_bump_index;
+    shadow_internals->node_bump_index = slot_count;
+    set_current_number_of_kd_tree_nodes(tree,
+            kdtree_get_current_number_of_kd_tree_nodes(shadow));
+    kd_tree_set_root(tree, shadow->_root);
+    shadow->_root = NULL;
+    /*the legacy heap variables alias the heaps of the default tree*/
+    if (kd_tree_get_kd_tree() == tree)
+    {
+        kd_tree_set_kd_tree(tree);
+    }
+    kd_tree_drop_compact(tree);
+    return 1;
 }
 
 /*=============================================================================
-Function        kd_tree_update_record
-Description:    Internal API called by friendly kd_tree_update_record. 
- *              which builds a kd-tree. This utilized     
-Inputs:         tree * root - The  pointer to the root of the kd-tree
- *              float target_data [] - data to be found and updated 
- *              float new_data [] - that will replace target_data []
-Output:         Returns a int flag acting as boolean 0 if update failed or 1 
- *              if operation was successful.     
+Function        kd_tree_log_delta
+Description:    appends a write to the delta log of the running background 
+ *              rebuild, id -1 for a delete. The log grows by doubling. If it
+ *              cannot grow the rebuild is dropped, the tree stays as it is.
 ==========================================================*/
-/*mutator*/
-int kd_tree_update_record(kd_tree_node* root, const float target_data [],  
-        const float new_data [],const int k_dimensions)
+void kd_tree_log_delta(kdtree_t* tree, const float point[], int id)
 {
-   int flag = 0;  
-   flag = kd_tree_delete_data_point_helper(root, target_data,0, k_dimensions);
-   if (flag)
-   {
-         kd_tree_add_record(&root,
-                    new_data,
-                    0,
-                     k_dimensions,
-                    0,
-                    kd_tree_get_rebuild_threshold());
-   }
-   return flag; 
+    kdtree_internals* internals = tree->_internals;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    int capacity = 2 * internals->delta_capacity;
+    float* points = NULL;
+    int* ids = NULL;
+
+    if (internals->delta_count == internals->delta_capacity)
+    {
+        if (capacity < 64)
+        {
+            capacity = 64;
+        }
+        points = (float*) realloc(internals->delta_points,
+                sizeof (float)*capacity * k_dimensions);
+        if (NULL != points)
+        {
+            internals->delta_points = points;
+            ids = (int*) realloc(internals->delta_ids,
+                    sizeof (int)*capacity);
+        }
+        if (NULL == ids)
+        {
+            printf("kd_tree_log_delta(), Error no memory, the background "
+                    "rebuild is dropped.\n");
+            kd_tree_finish_background_rebuild(tree, 1, 0);
+            return;
+        }
+        internals->delta_ids = ids;
+        internals->delta_capacity = capacity;
+    }
+    memcpy(internals->delta_points +
+            (size_t) internals->delta_count * k_dimensions, point,
+            sizeof (float)*k_dimensions);
+    internals->delta_ids[internals->delta_count] = id;
+    internals->delta_count++;
 }
 
-/*===========================================================================
-Function:       in_order_stack_traversal
-Description:    Returns number of  tree nodes that were traversed and set in 
- *              output parameter output_flatten_kd_tree.  
-Inputs:         kd_tree_node *root. 
- *              int number_dimensions.
-Outputs:        In order array representing all kdtree nodes & returns number               
- *              nodes in the flatten_kd_tree.
-References: 
- 1) https://tutorialspoint.dev/data-structure/
- 2) https://prismoskills.appspot.com/lessons/
- Binary_Trees/Traversal_without_recursion.jsp
- 3) MIT Algorithms cormen
- 4) Algorithms in C Robert Sedgewick 
+/*=============================================================================
+Function        kd_tree_sync_background
+Description:    called by every insert, delete & update before it touches the
+ *              tree: waits until the thread has copied the points, then 
+ *              swaps in a background rebuild that is done, see 
+ *              kd_tree_finish_background_rebuild().
+Output:         root, or the new root if root was the root of the tree.
 ==========================================================*/
-int
-kd_tree_in_order_traversal (kd_tree_node *root, int number_dimensions)
+kd_tree_node* kd_tree_sync_background(kdtree_t* tree, kd_tree_node* root)
 {
- 
-    /* set current to root*/
-    kd_tree_node* curr = root; 
-    int heap_index= 0; 
-    
-    if (!is_empty_node(curr,number_dimensions))
+    kd_tree_node* old_root = NULL;
+
+    if (NULL == tree || !tree->_internals->background_running)
     {
-          kd_tree_init_node_knn_result_heap(&node_knn_result_space,
-          kd_tree_get_k_dimensions());
-     
-    while (!is_empty_node(curr,number_dimensions))
+        return root;
+    }
+    /*the thread reads node_space until it has copied the points*/
+    pthread_mutex_lock(&tree->_internals->background_lock);
+    while (!tree->_internals->background_copied)
     {
-        if (!is_empty_node(curr->left,number_dimensions)) 
-        {
-            /*find inorder predecessor of left subtree*/
-            kd_tree_node* pre = curr->left;
-            while (!is_empty_node(pre->right,number_dimensions) && 
-                  !kd_tree_points_equal(pre->right->dataset,
-                  curr->dataset,number_dimensions))
-            {
-                pre = pre->right;
-            }
-            if (is_empty_node(pre->right,number_dimensions)) 
-            {
-                /*Threaded property for this node was not set. Set it now*/
-                pre->right = curr;
-                curr = curr->left; // Thread created. Switch to this subtree now
-            } else 
-            {
-                /* This means pre.right = curr
-                 Which implies that thread for this was set already, 
-                So we do not need to traverse this subtree again*/
-                pre->right = NULL; // reset the thread we created earlier
-                 if (!is_empty_node(curr,number_dimensions)) 
-                 {
-                    memcpy(node_knn_result_space[heap_index].dataset, 
-                            curr->dataset,
-                            sizeof (float)*k_dimensions);
-                    heap_index++; 
-                 }
-                curr = curr->right;
-            }
-        } else 
-        {
-               if (!is_empty_node(curr,number_dimensions)) 
-                 {                  
-                    memcpy(node_knn_result_space[heap_index].dataset, 
-                            curr->dataset,
-                            sizeof (float)*k_dimensions);
-            heap_index++; 
-               }
-            curr = curr->right; 
-        }
+        pthread_cond_wait(&tree->_internals->background_copy_done,
+                &tree->_internals->background_lock);
     }
-    
+    pthread_mutex_unlock(&tree->_internals->background_lock);
+    old_root = kdtree_get_root(tree);
+    if (kd_tree_finish_background_rebuild(tree, 0, 1) && root == old_root)
+    {
+        return kdtree_get_root(tree);
     }
-       return heap_index; 
+    return root;
 }
 
-
 /*=============================================================================
-Function:       kd_tree_search_data_point
-Description:    User friendly wrapper.  
-                Traverses the tree for the existence of a single node.
- *              This not a KNN search for KNN search call the function 
- *              kd_tree_knn.
- *              The search is done by either going left if the key is larger 
- *              than current node's info or going left if the key is smaller 
- *              than current nodes value. Ultimately reaching the key if it exists. 
- *              This traversal is O(log n) and considered optimal. 
- *              Wrapper around search(0 function which  is an internal API 
- *              function. User API.
-Notes:          User friendly wrapper around search. This is a recursive
- *              function. 
-Inputs:         tree * root - tree root which is traversed n order to 
- *              attempt to find the data[].
- *              float data[] - query point used as search parameter. 
-Output:         Returns  0 (false) with NOT found. Returns 1 (true) if found. 
-=============================================================================*/
-int kd_tree_search_data_point(kd_tree_node* root, const float data[])
+Function        kd_tree_buffer_add
+Description:    appends data to the insert buffer & merges the buffer into the
+ *              tree once it is full, see kdtree_set_buffer_size().
+Inputs:         int id - id of the new point, -1 picks the next free id.
+Output:         1 if the buffer took the insert, 0 if it is off or the tree &
+ *              buffer are full. A full buffer is merged first, so the caller
+ *              inserts into the tree & reports the full heap.
+==========================================================*/
+int kd_tree_buffer_add(kdtree_t* tree, const float data[], int id)
 {
-  return kd_tree_search_helper (root, data, 0,kd_tree_get_k_dimensions() );
+    kdtree_internals* internals = tree->_internals;
+    kd_tree_node* node = NULL;
+
+    if (0 == internals->buffer_capacity)
+    {
+        return 0;
+    }
+    if (kdtree_get_current_number_of_kd_tree_nodes(tree) +
+            internals->buffer_count >= kd_tree_get_rows_size(tree))
+    {
+        kd_tree_flush_buffer(tree);
+        return 0;
+    }
+    node = internals->buffer_nodes + internals->buffer_count++;
+    memcpy(node->dataset, data,
+            sizeof (float)*kdtree_get_k_dimensions(tree));
+    /*automatic ids never collide with ids given by the caller*/
+    node->id = id >= 0 ? id : internals->next_id;
+    if (node->id >= internals->next_id)
+    {
+        internals->next_id = node->id + 1;
+    }
+    if (internals->buffer_count == internals->buffer_capacity)
+    {
+        kd_tree_flush_buffer(tree);
+    }
+    return 1;
 }
-/*=============================================================================
-Function:       search_tree
-Description:    traverses the tree by either going left if the key is larger
- * than current node's info or going left if the key is smaller than current 
- * nodes value. Ultimately reaching the key if it exists. This traversal is 
- * O(log n) and considered optimal. 
-Input:          tree * root - root of of the kd-tree used to start traversal
- *              float data[] - query point used as search parameter.
- *              int depth - Current dimension used for building the kd-tree
- *              int k_dimensions - number of columns in the dataset              
-Output:         Returns  0 (false) with NOT found. Returns 1 (true) if found.
-=============================================================================*/
-int
-kd_tree_search_helper(kd_tree_node* root, const float data[], int depth, 
-        const int k_dimensions) {
-    /*flag false*/
-    int flag = 0;
-    size_t cd = 0;
-    float median = 0.0f;
-    if (!is_empty_node(root,k_dimensions)) {
-        kd_tree_node* current = root;
-        //while loop to find target node for deletion. 
-        while (NULL != current) {
-            //if found then break;  
-            if (kd_tree_points_equal(current->dataset, data, k_dimensions)) {
-                /*flag true*/
-                flag = 1;
-                break;
-            }
-            else
 
-             /* Calculate current dimension (cd) of comparison */
-             cd = depth % k_dimensions;
-            /*determine current dimension/*/
-            /*by using modula operator we can cycle through all dimensions */
-            /* and decide the left or right subtree*/
-            median = kd_tree_get_column_median(cd);
-            /*printf("kd_tree_search_helper(), median=%f\n",median);*/
+/*row of the insert buffer holding data, -1 if none. O(buffer_count)*/
+int kd_tree_buffer_find(kdtree_t* tree, const float data[])
+{
+    kdtree_internals* internals = tree->_internals;
+    int i = 0;
 
-            if (data[cd] < median) {
-                current = current->left;
-            } else {
-                current = current->right;
-            }
-            
-            depth++;
+    for (; i < internals->buffer_count; i++)
+    {
+        if (kd_tree_points_equal(internals->buffer_nodes[i].dataset, data,
+                kdtree_get_k_dimensions(tree)))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
 
-        }//end traverse while 
+/*removes data from the insert buffer, the last row fills the hole. 1 if 
+ it was buffered*/
+int kd_tree_buffer_delete(kdtree_t* tree, const float data[])
+{
+    kdtree_internals* internals = tree->_internals;
+    int row = kd_tree_buffer_find(tree, data);
+    int last = internals->buffer_count - 1;
 
-    }//end if root is NOT 
-    return  flag; 
+    if (row < 0)
+    {
+        return 0;
+    }
+    memcpy(internals->buffer_nodes[row].dataset,
+            internals->buffer_nodes[last].dataset,
+            sizeof (float)*kdtree_get_k_dimensions(tree));
+    internals->buffer_nodes[row].id = internals->buffer_nodes[last].id;
+    internals->buffer_count--;
+    return 1;
 }
 
-/*=============================================================================
-Function:       kd_tree_points_equal
-Description:    A utility function to determine equality                
- *              in multidimensional space. Returns 1 if                 
- *              true & 0 if false.  
-TODO:          change signature to use pointers  
-=============================================================================*/
-int kd_tree_points_equal(const float point1[],const  float point2[], 
-        int k_dimensions)
+/*moves a buffered point to new_data, it keeps its id. 1 if it was buffered*/
+int kd_tree_buffer_update(kdtree_t* tree, const float target_data[],
+        const float new_data[])
 {
-    int flag = 1;
-    if (NULL == point1 || NULL == point2)
+    int row = kd_tree_buffer_find(tree, target_data);
+
+    if (row < 0)
     {
-        flag = 0; 
+        return 0;
     }
-    else
+    memcpy(tree->_internals->buffer_nodes[row].dataset, new_data,
+            sizeof (float)*kdtree_get_k_dimensions(tree));
+    return 1;
+}
+
+/*=============================================================================
+Function        kd_tree_flush_buffer
+Description:    merges the insert buffer into the tree: every buffered point 
+ *              is inserted with its id by kd_tree_add_record(), so the tree
+ *              keeps its own policy, the rebuild threshold, partial rebuilds
+ *              with a balance factor or the level merges of a forest. 
+ *              O(buffer_count * depth) amortized, the tree is not rebuilt 
+ *              for every flush & a running background rebuild logs the 
+ *              points like any other insert.
+Output:         number of points merged.
+==========================================================*/
+int kd_tree_flush_buffer(kdtree_t* tree)
+{
+    kdtree_internals* internals = tree->_internals;
+    int n = internals->buffer_count;
+    int i = 0;
+
+    if (0 == n)
+    {
+        return 0;
+    }
+    internals->buffer_count = 0;
+    for (; i < n; i++)
+    {
+        /*an insert of the loop may start a background rebuild*/
+        kd_tree_sync_background(tree, NULL);
+        kd_tree_add_record(tree, &tree->_root,
+                internals->buffer_nodes[i].dataset, 0,
+                kdtree_get_k_dimensions(tree), 0,
+                kdtree_get_rebuild_threshold(tree),
+                internals->buffer_nodes[i].id);
+    }
+    return n;
+}
+
+/*releases the insert buffer, it is off afterwards*/
+void kd_tree_free_buffer(kdtree_t* tree)
+{
+    kdtree_internals* internals = tree->_internals;
+
+    free(internals->buffer_nodes);
+    free(internals->buffer_coordinates);
+    internals->buffer_nodes = NULL;
+    internals->buffer_coordinates = NULL;
+    internals->buffer_count = 0;
+    internals->buffer_capacity = 0;
+}
+
+/*===========================================================================
+Function        kd_tree_buffer_distances
+Description:    squared distances of data_point to rows [first, first + rows)
+ *              of the insert buffer, rows <= KD_TREE_MAX_LEAF_SIZE. One block
+ *              kernel call like for a leaf bucket, see 
+ *              kd_tree_compact_distances().
+==========================================================*/
+void kd_tree_buffer_distances(kdtree_t* tree, int first, int rows,
+        const float data_point[], const int k_dimensions, float* out)
+{
+    const float* block = tree->_internals->buffer_coordinates +
+            (size_t) first * k_dimensions;
+
+    kd_tree_squared_euclidean_block_kernel(data_point, block, rows,
+            k_dimensions, out);
+}
+
+/*===========================================================================
+Function        kd_tree_buffer_knn_search, kd_tree_buffer_radius_search
+Description:    brute force kNN & radius search of the insert buffer into the
+ *              heap or found list of a search of the tree, so both are 
+ *              merged. Candidates reference buffer_nodes. O(buffer_count).
+==========================================================*/
+void kd_tree_buffer_knn_search(kdtree_t* tree, const float data_point[],
+        const int k_dimensions, int capacity, kd_tree_knn_candidate* heap,
+        int* size)
+{
+    kdtree_internals* internals = tree->_internals;
+    float distances[KD_TREE_MAX_LEAF_SIZE];
+    int first = 0;
+    int i = 0;
+
+    for (; first < internals->buffer_count; first += KD_TREE_MAX_LEAF_SIZE) {
+        int rows = internals->buffer_count - first;
+        if (rows > KD_TREE_MAX_LEAF_SIZE) {
+            rows = KD_TREE_MAX_LEAF_SIZE;
+        }
+        kd_tree_buffer_distances(tree, first, rows, data_point, k_dimensions,
+                distances);
+        for (i = 0; i < rows; i++) {
+            kd_tree_knn_heap_push(heap, size, capacity,
+                    internals->buffer_nodes + first + i, distances[i]);
+        }
+    }
+}
+
+void kd_tree_buffer_radius_search(kdtree_t* tree, const float data_point[],
+        const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size)
+{
+    kdtree_internals* internals = tree->_internals;
+    float distances[KD_TREE_MAX_LEAF_SIZE];
+    int first = 0;
+    int i = 0;
+
+    for (; first < internals->buffer_count; first += KD_TREE_MAX_LEAF_SIZE) {
+        int rows = internals->buffer_count - first;
+        if (rows > KD_TREE_MAX_LEAF_SIZE) {
+            rows = KD_TREE_MAX_LEAF_SIZE;
+        }
+        kd_tree_buffer_distances(tree, first, rows, data_point, k_dimensions,
+                distances);
+        for (i = 0; i < rows; i++) {
+            if (distances[i] <= squared_range) {
+                found[*size].node = internals->buffer_nodes + first + i;
+                found[*size].distance = distances[i];
+                (*size)++;
+            }
+        }
+    }
+}
+
+/*=============================================================================
+Function        kd_tree_bulk_build
+Description:    Builds a balanced kd-tree over the points stored in rows 
+ *              [0, rows) of node_space, replacing the current tree. 
+ *              rows may be 0, which empties the tree.
+ *              1) reset the nodes & release the slots >= rows. 
+ *              2) kd_tree_build_subtree() over all rows, or 
+ *              kd_tree_build_forest() for a forest.
+ *              O(n log n), the depth is at most ceil(log2 n) + 1 unless 
+ *              many points share a coordinate or the split policy is 
+ *              KD_TREE_SPLIT_SLIDING_MIDPOINT.
+Output:         root of the new tree.
+==========================================================*/
+kd_tree_node* kd_tree_bulk_build(kdtree_t* tree, int rows)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    int used = tree->_internals->node_bump_index;
+    kd_tree_node* root = NULL;
+    int i = 0;
+    int c = 0;
+
+    /*the points of a running background rebuild are outdated*/
+    kd_tree_finish_background_rebuild(tree, 1, 0);
+    kd_tree_drop_compact(tree);
+    /*1) only slots below the bump index were ever handed out*/
+    if (used < rows)
+    {
+        used = rows;
+    }
+    #pragma omp parallel for private(c) \
+            if (used >= KD_TREE_PARALLEL_BUILD_MIN_ROWS)
+    for (i = 0; i < used; i++)
+    {
+        if (i >= rows)
+        {
+            for (c = 0; c < k_dimensions; c++)
+            {
+                nodes[i].dataset[c] = FLT_MAX;
+            }
+            nodes[i].id = -1;
+        }
+        nodes[i].distance_to_neighbor = FLT_MAX;
+        nodes[i].left = NULL;
+        nodes[i].right = NULL;
+        nodes[i].parent = NULL;
+        nodes[i].bucket_size = 1;
+        nodes[i].subtree_size = 0;
+    }
+    tree->_internals->node_bump_index = rows;
+    tree->_internals->node_free_count = 0;
+    /*2) build, the top of the tree forks into tasks*/
+    #pragma omp parallel if (rows >= KD_TREE_PARALLEL_BUILD_MIN_ROWS)
+    {
+        #pragma omp single
+        root = tree->_internals->forest ? kd_tree_build_forest(tree, rows) :
+                kd_tree_build_subtree(tree, 0, rows, 0);
+    }
+    kd_tree_set_root(tree, root);
+    set_current_number_of_kd_tree_nodes(tree, rows);
+    return root;
+}
+
+/*=============================================================================
+Function        kd_tree_build_subtree
+Description:    Builds the subtree of the points in rows [lo, hi) of 
+ *              node_space. The rows are partitioned around the median of the
+ *              split dimension (kd_tree_select_row()) or at its sliding 
+ *              midpoint (kd_tree_sliding_midpoint_row()), the point at the 
+ *              split becomes the node of its own slot & the rows on either 
+ *              side become the left & right subtrees. Therefore the subtree of
+ *              rows [lo, hi) uses exactly the slots [lo, hi) & subtrees can be
+ *              built concurrently (OpenMP tasks) without locking. Must run
+ *              inside an OpenMP parallel region to use more than one thread.
+ *              Up to leaf_size rows become a single leaf bucket at slot lo,
+ *              their coordinates are contiguous rows of the arena.
+Inputs:         depth - depth of the subtree root, see 
+ *              kd_tree_choose_split_dimension().
+Output:         root of the subtree or NULL if the range is empty.
+==========================================================*/
+kd_tree_node* kd_tree_build_subtree(kdtree_t* tree, int lo, int hi,
+        int depth)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    kd_tree_node* node = NULL;
+    int dimension = 0;
+    int middle = 0;
+    int less = 0;
+    int i = 0;
+    float split = 0.0f;
+
+    if (lo >= hi)
+    {
+        return NULL;
+    }
+    dimension = kd_tree_choose_split_dimension(tree, NULL, lo, hi, depth);
+    if (hi - lo > 1 && hi - lo <= tree->_internals->leaf_size)
+    {
+        /*points inserted later below the bucket are routed like below a 
+         node made by insert*/
+        node = nodes + lo;
+        node->split_dimension = dimension;
+        node->split_value = node->dataset[dimension];
+        node->bucket_size = hi - lo;
+        node->subtree_size = hi - lo;
+        return node;
+    }
+    if (tree->_internals->split_policy == KD_TREE_SPLIT_SLIDING_MIDPOINT)
+    {
+        middle = kd_tree_sliding_midpoint_row(tree, lo, hi, dimension);
+        split = nodes[middle].dataset[dimension];
+    }
+    else
+    {
+        middle = lo + (hi - lo) / 2;
+        kd_tree_select_row(tree, lo, hi, middle, dimension);
+        split = nodes[middle].dataset[dimension];
+        /*left subtree must be strictly smaller than split, move points 
+         equal to split next to the median & make the first of them the 
+         node*/
+        less = lo;
+        for (i = lo; i < middle; i++)
+        {
+            if (nodes[i].dataset[dimension] < split)
+            {
+                kd_tree_swap_rows(tree, i, less);
+                less++;
+            }
+        }
+        kd_tree_swap_rows(tree, less, middle);
+        middle = less;
+    }
+
+    node = nodes + middle;
+    node->split_dimension = dimension;
+    node->split_value = split;
+    node->subtree_size = hi - lo;
+    /*the two subtrees own disjoint rows, build large ones concurrently*/
+    if (depth < KD_TREE_PARALLEL_BUILD_DEPTH &&
+            middle - lo >= KD_TREE_PARALLEL_BUILD_MIN_ROWS)
+    {
+        #pragma omp task firstprivate(node, lo, middle, depth)
+        node->left = kd_tree_build_subtree(tree, lo, middle, depth + 1);
+        node->right = kd_tree_build_subtree(tree, middle + 1, hi, depth + 1);
+        #pragma omp taskwait
+    }
+    else
+    {
+        node->left = kd_tree_build_subtree(tree, lo, middle, depth + 1);
+        node->right = kd_tree_build_subtree(tree, middle + 1, hi, depth + 1);
+    }
+    if (NULL != node->left)
+    {
+        node->left->parent = node;
+    }
+    if (NULL != node->right)
+    {
+        node->right->parent = node;
+    }
+    return node;
+}
+
+/*=============================================================================
+Function        kd_tree_select_row
+Description:    Partial sort of rows [lo, hi) of node_space by column 
+ *              dimension, such that row k holds the value it would have in 
+ *              sorted order, rows before it are <= & rows after it are >=.
+ *              Wirth's selection like kth_smallest(), average O(hi - lo).
+References:     N. Wirth, Algorithms + Data Structures = Programs, 1976.
+==========================================================*/
+void kd_tree_select_row(kdtree_t* tree, int lo, int hi, int k, int dimension)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    int i, j, l, m;
+    float x;
+
+    l = lo; m = hi - 1;
+    while (l < m) {
+        x = nodes[k].dataset[dimension];
+        i = l;
+        j = m;
+        do {
+            while (nodes[i].dataset[dimension] < x) i++;
+            while (x < nodes[j].dataset[dimension]) j--;
+            if (i <= j) {
+                kd_tree_swap_rows(tree, i, j);
+                i++; j--;
+            }
+        } while (i <= j);
+        if (j < k) l = i;
+        if (k < i) m = j;
+    }
+}
+
+/*swap the points of slots i & j of node_space*/
+void kd_tree_swap_rows(kdtree_t* tree, int i, int j)
+{
+    float* row_i = tree->_internals->node_space[i].dataset;
+    float* row_j = tree->_internals->node_space[j].dataset;
+    float swap = 0.0f;
+    int id = 0;
+    int c = 0;
+
+    if (i == j)
+    {
+        return;
+    }
+    if (NULL != tree->_internals->index_dataset)
+    {
+        /*the rows belong to the caller, swap the references only*/
+        tree->_internals->node_space[i].dataset = row_j;
+        tree->_internals->node_space[j].dataset = row_i;
+    }
+    else
+    {
+        for (; c < kdtree_get_k_dimensions(tree); c++)
+        {
+            swap = row_i[c];
+            row_i[c] = row_j[c];
+            row_j[c] = swap;
+        }
+    }
+    id = tree->_internals->node_space[i].id;
+    tree->_internals->node_space[i].id = tree->_internals->node_space[j].id;
+    tree->_internals->node_space[j].id = id;
+}
+
+/*=============================================================================
+Function        kdtree_build
+Description:    Replaces the content of the tree by rows points & builds a 
+ *              balanced kd-tree over them in one pass, see 
+ *              kd_tree_bulk_build(). Faster than calling kdtree_add_points()
+ *              per point & the result does not depend on the insert order. 
+Inputs:         float* data - rows x k_dimensions values, row major.
+ *              int rows - number of points, at most max_rows of kdtree_alloc()
+Output:         number of points in the tree, 0 if the build was rejected.
+==========================================================*/
+/*mutator*/
+int kdtree_build(kdtree_t* self, const float* data, int rows)
+{
+    int k_dimensions = 0;
+    int i = 0;
+
+    if (NULL == self || NULL == data || rows < 0 || 
+            rows > kd_tree_get_rows_size(self))
+    {
+        printf("kdtree_build(), Error invalid tree, data or rows.\n");
+        return 0;
+    }
+    if (!self->_internals->kd_tree_allow_update)
+    {
+        printf("kdtree_build(), kd_tree is locked for rebuild or a read "
+                "only index!");
+        return 0;
+    }
+    k_dimensions = kdtree_get_k_dimensions(self);
+    self->_internals->kd_tree_allow_update = 0;
+    for (; i < rows; i++)
+    {
+        memcpy(self->_internals->node_space[i].dataset,
+                data + (size_t) i * k_dimensions,
+                sizeof (float)*k_dimensions);
+        self->_internals->node_space[i].id = i;
+    }
+    self->_internals->next_id = rows;
+    /*the build replaces the buffered points too*/
+    self->_internals->buffer_count = 0;
+    kd_tree_bulk_build(self, rows);
+    kd_tree_set_previous_tree_size(self, rows);
+    self->_internals->kd_tree_allow_update = 1;
+    return rows;
+}
+
+/*=============================================================================
+Function        kdtree_add_points_batch
+Description:    Adds n points & rebalances once: the points of the tree are 
+ *              gathered into the first rows of node_space 
+ *              (kd_tree_gather_points()), the new points are copied behind 
+ *              them & one kd_tree_bulk_build() runs over all of them. An 
+ *              empty tree is simply bulk built. Adding the points one by 
+ *              one instead runs a full rebuild every time the tree doubles.
+ *              The new points get the next ids, in order.
+Inputs:         float* points - n x k_dimensions values, row major.
+Output:         number of points in the tree, 0 if the batch was rejected, 
+ *              e.g. the tree can not hold n more points.
+==========================================================*/
+/*mutator*/
+int kdtree_add_points_batch(kdtree_t* self, const float* points, int n)
+{
+    kd_tree_node* nodes = NULL;
+    int k_dimensions = 0;
+    int size = 0;
+    int i = 0;
+
+    if (NULL == self || NULL == points || n < 0 ||
+            kdtree_get_current_number_of_kd_tree_nodes(self) +
+            self->_internals->buffer_count + n > kd_tree_get_rows_size(self))
+    {
+        printf("kdtree_add_points_batch(), Error invalid tree, points or "
+                "n.\n");
+        return 0;
+    }
+    if (!self->_internals->kd_tree_allow_update)
+    {
+        printf("kdtree_add_points_batch(), kd_tree is locked for rebuild or "
+                "a read only index!");
+        return 0;
+    }
+    nodes = self->_internals->node_space;
+    k_dimensions = kdtree_get_k_dimensions(self);
+    self->_internals->kd_tree_allow_update = 0;
+    size = kd_tree_gather_points(self);
+    for (; i < n; i++)
+    {
+        memcpy(nodes[size + i].dataset, points + (size_t) i * k_dimensions,
+                sizeof (float)*k_dimensions);
+        nodes[size + i].id = self->_internals->next_id++;
+    }
+    kd_tree_bulk_build(self, size + n);
+    kd_tree_set_previous_tree_size(self, size + n);
+    self->_internals->kd_tree_allow_update = 1;
+    return size + n;
+}
+
+/*mutator*/
+int kd_tree_add_points_batch(const float* points, int n)
+{
+    return kdtree_add_points_batch(kd_tree_get_kd_tree(), points, n);
+}
+
+/*=============================================================================
+Function        kdtree_build_index
+Description:    Builds a balanced kd-tree over rows points of the caller's 
+ *              buffer without copying them, see kd_tree_bulk_build(). The 
+ *              coordinate arena of node_space is released, every node 
+ *              references its row of dataset & the id of a point is its row.
+ *              The build reorders the references, dataset is not modified. 
+ *              The tree is read only until kdtree_free_index(), mutators 
+ *              fail. The caller must keep dataset alive until then.
+Inputs:         float* dataset - rows x cols values, row major.
+ *              int cols - must be the k_dimensions of the tree.
+Output:         number of nodes in the tree, 0 on error.
+==========================================================*/
+int kdtree_build_index(kdtree_t* self, float* dataset, int rows, int cols)
+{
+    kd_tree_node* nodes = NULL;
+    int i = 0;
+
+    if (NULL == self || NULL == dataset || rows < 0 ||
+            rows > kd_tree_get_rows_size(self) ||
+            cols != kdtree_get_k_dimensions(self))
+    {
+        printf("kdtree_build_index(), Error invalid tree, dataset, rows or "
+                "cols.\n");
+        return 0;
+    }
+    if (!self->_internals->kd_tree_allow_update &&
+            NULL == self->_internals->index_dataset)
+    {
+        printf("kdtree_build_index(), kd_tree is locked for rebuild!");
+        return 0;
+    }
+    nodes = self->_internals->node_space;
+    free(self->_internals->coordinate_space);
+    self->_internals->coordinate_space = NULL;
+    self->_internals->index_dataset = dataset;
+    for (; i < kd_tree_get_rows_size(self); i++)
+    {
+        nodes[i].dataset = i < rows ? dataset + (size_t) i * cols : NULL;
+        nodes[i].id = i < rows ? i : -1;
+        nodes[i].left = NULL;
+        nodes[i].right = NULL;
+        nodes[i].parent = NULL;
+    }
+    /*slots >= rows have no coordinates, never hand them out*/
+    self->_internals->node_bump_index = rows;
+    self->_internals->next_id = rows;
+    /*the build replaces the buffered points too*/
+    self->_internals->buffer_count = 0;
+    kd_tree_bulk_build(self, rows);
+    kd_tree_set_previous_tree_size(self, rows);
+    self->_internals->kd_tree_allow_update = 0;
+    return rows;
+}
+
+/*=============================================================================
+Function        kdtree_free_index
+Description:    Ends an index built by kdtree_build_index(): the coordinate 
+ *              arena of node_space is allocated again & the tree is empty 
+ *              & writable. Does nothing if the tree is not an index.
+==========================================================*/
+void kdtree_free_index(kdtree_t* self)
+{
+    float* coordinates = NULL;
+    int k_dimensions = 0;
+    int i = 0;
+
+    if (NULL == self || NULL == self->_internals->index_dataset)
+    {
+        return;
+    }
+    k_dimensions = kdtree_get_k_dimensions(self);
+    coordinates = kd_tree_alloc_coordinate_arena(kd_tree_get_rows_size(self),
+            k_dimensions);
+    if (NULL == coordinates)
+    {
+        printf("kdtree_free_index(), Error could not allocate the "
+                "coordinates.\n");
+        return;
+    }
+    for (; i < kd_tree_get_rows_size(self); i++)
+    {
+        self->_internals->node_space[i].dataset = coordinates +
+                (size_t) i * k_dimensions;
+    }
+    self->_internals->coordinate_space = coordinates;
+    self->_internals->index_dataset = NULL;
+    kd_tree_set_root(self, NULL);
+    kd_tree_init_node_heap(self);
+}
+
+/*=============================================================================
+Function        kdtree_compact
+Description:    Copies the links & splits of every node handed out by the 
+ *              pool into compact_nodes, entry i for slot i, so the bucket 
+ *              members keep following their bucket node. A pass over the 
+ *              slots, O(n), no traversal. compact_nodes is allocated by the 
+ *              first call & kept until kdtree_free().
+Output:         number of nodes in the tree, 0 if it is empty or on error.
+==========================================================*/
+int kdtree_compact(kdtree_t* self)
+{
+    kdtree_internals* internals = NULL;
+    kd_tree_node* nodes = NULL;
+    kd_tree_compact_node* compact = NULL;
+    int i = 0;
+
+    if (NULL == self || kdtree_get_k_dimensions(self) > USHRT_MAX)
+    {
+        printf("kdtree_compact(), Error invalid tree or too many "
+                "dimensions.\n");
+        return 0;
+    }
+    internals = self->_internals;
+    if (NULL == internals->compact_nodes)
+    {
+        internals->compact_nodes = (kd_tree_compact_node*) malloc(
+                sizeof (kd_tree_compact_node)*kd_tree_get_rows_size(self));
+        if (NULL == internals->compact_nodes)
+        {
+            printf("kdtree_compact(), Error could not allocate the compact "
+                    "nodes.\n");
+            return 0;
+        }
+    }
+    nodes = internals->node_space;
+    compact = internals->compact_nodes;
+    for (; i < internals->node_bump_index; i++)
+    {
+        compact[i].left = NULL != nodes[i].left ?
+                (int) (nodes[i].left - nodes) : -1;
+        compact[i].right = NULL != nodes[i].right ?
+                (int) (nodes[i].right - nodes) : -1;
+        compact[i].split_value = nodes[i].split_value;
+        compact[i].split_dimension = (unsigned short) nodes[i].split_dimension;
+        compact[i].bucket_size = (unsigned short) nodes[i].bucket_size;
+    }
+    internals->compact_root = is_empty_node(kdtree_get_root(self),
+            kdtree_get_k_dimensions(self)) ? -1 :
+            (int) (kdtree_get_root(self) - nodes);
+    internals->compact_valid = 1;
+    return kdtree_get_current_number_of_kd_tree_nodes(self);
+}
+
+int kdtree_is_compact(kdtree_t* self)
+{
+    return NULL != self && self->_internals->compact_valid;
+}
+
+/*=============================================================================
+Function        kdtree_freeze
+Description:    Builds the breadth first snapshot of the points of the tree. 
+ *              The live slots are gathered in slots & split like 
+ *              kd_tree_bulk_build(), except that every subtree takes the 
+ *              size of a complete binary tree, see 
+ *              kd_tree_left_balanced_size(). Therefore the snapshot is a 
+ *              complete tree & the children of a position need not be 
+ *              stored. The buffers are allocated by the first call & kept 
+ *              until kdtree_free(), unless kdtree_publish() gave them to a 
+ *              version.
+Output:         number of points in the snapshot, 0 if it is empty or on 
+ *              error.
+References:     H. W. Jensen, "Realistic Image Synthesis Using Photon 
+ *              Mapping", 2001, the left balanced kd-tree.
+==========================================================*/
+int kdtree_freeze(kdtree_t* self)
+{
+    kdtree_internals* internals = NULL;
+    int* slots = NULL;
+    int rows = 0;
+    int k_dimensions = 0;
+    int size = 0;
+    int i = 0;
+
+    if (NULL == self || kdtree_get_k_dimensions(self) > USHRT_MAX)
+    {
+        printf("kdtree_freeze(), Error invalid tree or too many "
+                "dimensions.\n");
+        return 0;
+    }
+    internals = self->_internals;
+    rows = kd_tree_get_rows_size(self);
+    k_dimensions = kdtree_get_k_dimensions(self);
+    internals->snapshot_valid = 0;
+    if (internals->snapshot_shared)
+    {
+        internals->snapshot_coordinates = NULL;
+        internals->snapshot_split_dimensions = NULL;
+        internals->snapshot_shared = 0;
+    }
+    if (NULL == internals->snapshot_coordinates)
+    {
+        internals->snapshot_coordinates =
+                kd_tree_alloc_coordinate_arena(rows, k_dimensions);
+        internals->snapshot_split_dimensions = (unsigned short*) malloc(
+                sizeof (unsigned short)*rows);
+    }
+    if (NULL == internals->snapshot_slots)
+    {
+        internals->snapshot_slots = (int*) malloc(sizeof (int)*rows);
+    }
+    slots = (int*) malloc(sizeof (int)*rows);
+    if (NULL == internals->snapshot_coordinates || NULL == slots ||
+            NULL == internals->snapshot_split_dimensions ||
+            NULL == internals->snapshot_slots)
+    {
+        printf("kdtree_freeze(), Error could not allocate the snapshot.\n");
+        free(slots);
+        return 0;
+    }
+    /*live slots, released slots are empty (FLT_MAX)*/
+    for (; i < internals->node_bump_index; i++)
+    {
+        if (!is_empty_node(internals->node_space + i, k_dimensions))
+        {
+            slots[size++] = i;
+        }
+    }
+    kd_tree_build_snapshot(self, slots, 0, size, 0, 0);
+    free(slots);
+    internals->snapshot_size = size;
+    internals->snapshot_valid = 1;
+    return size;
+}
+
+int kdtree_is_frozen(kdtree_t* self)
+{
+    return NULL != self && self->_internals->snapshot_valid;
+}
+
+/*=============================================================================
+Function        kd_tree_left_balanced_size
+Description:    size of the left subtree of a complete binary tree of count
+ *              nodes: the full levels are split evenly & the last level is 
+ *              filled from the left.
+==========================================================*/
+int kd_tree_left_balanced_size(int count)
+{
+    int half = 1;
+    int last = 0;
+
+    if (count <= 1)
+    {
+        return 0;
+    }
+    /*half = 2^(h-1), h the depth of the last level*/
+    while (4 * half <= count)
+    {
+        half *= 2;
+    }
+    last = count - (2 * half - 1);
+    return half - 1 + (last < half ? last : half);
+}
+
+/*=============================================================================
+Function        kd_tree_sliding_midpoint_row
+Description:    Partitions rows [lo, hi) at the middle of the range of their
+ *              values in dimension: rows below the cut first, then the row 
+ *              with the smallest value at or above the cut, which becomes 
+ *              the node, then the rest. If every value is at or above the 
+ *              cut, i.e. all are equal, the left side is empty & the node is
+ *              the lowest point, the cut slides to it. Either way the node 
+ *              consumes a point, O(hi - lo).
+Output:         row of the node, the left subtree is [lo, row).
+References:     S. Maneewongvatana, D. M. Mount, "It's okay to be skinny, if 
+ *              your friends are fat", 1999 (ANN's sliding midpoint).
+==========================================================*/
+int kd_tree_sliding_midpoint_row(kdtree_t* tree, int lo, int hi,
+        int dimension)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    float low = FLT_MAX;
+    float high = -FLT_MAX;
+    float cut = 0.0f;
+    int less = lo;
+    int lowest = 0;
+    int i = lo;
+
+    for (; i < hi; i++)
+    {
+        low = nodes[i].dataset[dimension] < low ?
+                nodes[i].dataset[dimension] : low;
+        high = nodes[i].dataset[dimension] > high ?
+                nodes[i].dataset[dimension] : high;
+    }
+    cut = low + (high - low) / 2;
+    for (i = lo; i < hi; i++)
+    {
+        if (nodes[i].dataset[dimension] < cut)
+        {
+            kd_tree_swap_rows(tree, i, less);
+            less++;
+        }
+    }
+    lowest = less;
+    for (i = less + 1; i < hi; i++)
+    {
+        if (nodes[i].dataset[dimension] < nodes[lowest].dataset[dimension])
+        {
+            lowest = i;
+        }
+    }
+    kd_tree_swap_rows(tree, less, lowest);
+    return less;
+}
+
+/*=============================================================================
+Function        kd_tree_build_snapshot
+Description:    Puts the median of slots [lo, hi) in the dimension of 
+ *              kd_tree_choose_split_dimension() at position & recurses 
+ *              into the rows on either side at 2 * position + 1 & 
+ *              2 * position + 2. Points equal to the median 
+ *              may end up on either side, search handles it.
+==========================================================*/
+void kd_tree_build_snapshot(kdtree_t* tree, int* slots, int lo, int hi,
+        int position, int depth)
+{
+    kdtree_internals* internals = tree->_internals;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    int dimension = 0;
+    int median = 0;
+
+    if (hi <= lo)
+    {
+        return;
+    }
+    dimension = kd_tree_choose_split_dimension(tree, slots, lo, hi, depth);
+    median = lo + kd_tree_left_balanced_size(hi - lo);
+    kd_tree_select_slot(tree, slots, lo, hi, median, dimension);
+    memcpy(internals->snapshot_coordinates + (size_t) position * k_dimensions,
+            internals->node_space[slots[median]].dataset,
+            sizeof (float)*k_dimensions);
+    internals->snapshot_split_dimensions[position] =
+            (unsigned short) dimension;
+    internals->snapshot_slots[position] = slots[median];
+    kd_tree_build_snapshot(tree, slots, lo, median, 2 * position + 1,
+            depth + 1);
+    kd_tree_build_snapshot(tree, slots, median + 1, hi, 2 * position + 2,
+            depth + 1);
+}
+
+/*=============================================================================
+Function        kd_tree_select_slot
+Description:    kd_tree_select_row() over an array of slots of node_space,
+ *              the rows themselves do not move.
+==========================================================*/
+void kd_tree_select_slot(kdtree_t* tree, int* slots, int lo, int hi, int k,
+        int dimension)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    int i, j, l, m, swap;
+    float x;
+
+    l = lo; m = hi - 1;
+    while (l < m) {
+        x = nodes[slots[k]].dataset[dimension];
+        i = l;
+        j = m;
+        do {
+            while (nodes[slots[i]].dataset[dimension] < x) i++;
+            while (x < nodes[slots[j]].dataset[dimension]) j--;
+            if (i <= j) {
+                swap = slots[i];
+                slots[i] = slots[j];
+                slots[j] = swap;
+                i++; j--;
+            }
+        } while (i <= j);
+        if (j < k) l = i;
+        if (k < i) m = j;
+    }
+}
+
+/*=============================================================================
+Function        kd_tree_drop_compact
+Description:    the compact nodes & the snapshot no longer match node_space,
+ *              searches go back to the nodes. Called whenever a node is 
+ *              acquired or released & by builds.
+==========================================================*/
+void kd_tree_drop_compact(kdtree_t* tree)
+{
+    tree->_internals->compact_valid = 0;
+    tree->_internals->snapshot_valid = 0;
+    tree->_internals->published_current = 0;
+}
+
+/*searches from root use the compact nodes*/
+int kd_tree_uses_compact(kdtree_t* tree, kd_tree_node* root)
+{
+    return tree->_internals->compact_valid && root == kdtree_get_root(tree);
+}
+
+/*mutator*/
+int
+kdtree_rebuild(kdtree_t* self)
+{
+    int result_size = 0;
+    if (NULL != self && self->_internals->kd_tree_allow_update)
+    {
+        /*processing_space is the heap of a running background rebuild*/
+        kd_tree_finish_background_rebuild(self, 1, 1);
+        result_size = kd_tree_rebuild(self, kdtree_get_root(self),
+                kdtree_get_k_dimensions(self));
+        kd_tree_set_previous_tree_size(self,
+                kdtree_get_current_number_of_kd_tree_nodes(self));
+    }
+    return result_size;
+}
+/*=============================================================================
+Function        kd_tree_add_record
+Description:    build a kd tree
+References:     1) https://www.sanfoundry.com/java-program-find-nearest-
+ *                neighbour-using-k-d-tree-search/
+                2) https://www.cs.cmu.edu/~ckingsf/bioinfo-lectures/kdtrees.pdf
+                3) https://www.geeksforgeeks.org/k-dimensional-tree/
+                4) https://github.com/jtsiomb/kdtree 
+                5) https://www.tutorialspoint.com/data_structures_algorithms/
+ *                 tree_traversal_in_c.htm
+Inputs:         kdtree_t* tree - tree that owns the nodes
+ *              tree * root - The  pointer to the root of the kd-tree
+ *              float data [] - use data with k_dimensions.
+ *              int depth - depth of *root, 0 for the root of the tree. 
+ *              int k_dimensions - number of columns in the dataset 
+ *              (number  of  features).
+ *              int copying - Either 0(false) or 1(true). By default 0 is used 
+ *              to insert a new record. This function is also used to return
+ *              internally new kd-tree used for traversal operations. 
+ *              int id - id of the new point, -1 picks the next free id.
+Output:         Returns a pointer to new created or updated kd-tree type tree. 
+Notes:          Iterative, the rebuild policy is checked once, then the loop 
+ *              descends to the empty child the key belongs to & links the 
+ *              new node there. No recursion, so degenerate trees thousands 
+ *              of levels deep do not grow the stack. With a balance_factor 
+ *              the whole tree is never rebuilt, kd_tree_count_insert() 
+ *              rebuilds a subtree instead. A forest inserts by 
+ *              kd_tree_forest_insert().
+==========================================================*/
+
+/*mutator*/
+void
+kd_tree_add_record(kdtree_t* tree, kd_tree_node** root, const float key [],
+        int depth,
+        const int k_dimensions,
+        const int copying, const float rebuild_threshold, const int id) {
+    /*DONT check/block this function using  kd_tree_allow_update flag, because
+    this function is used by kd_tree_rebuild, that will also block the rebuild!*/
+    int current_number_of_kd_tree_nodes_val = 
+    kdtree_get_current_number_of_kd_tree_nodes(tree);
+    int kd_tree_get_previous_tree_size_val =
+    kd_tree_get_previous_tree_size(tree);
+    int rebuild_threshold_val = kdtree_get_rebuild_threshold(tree);
+    float current_ratio = 0.0f;
+    size_t cd = 0;
+    kd_tree_node** link = NULL;
+    kd_tree_node* parent = NULL;
+    kd_tree_node* new_node = NULL;
+    int background = 0;
+    /*a forest merges levels instead of rebuilding*/
+    if (tree->_internals->forest && !copying) {
+        kd_tree_forest_insert(tree, key, k_dimensions, id);
+        *root = kdtree_get_root(tree);
+        return;
+    }
+    /*if we are in the middle of rebuilding dont trigger the rebuild logic again
+    that will cause a unexpected behavior. Only checked once per insert, at
+    the root*/
+    if (tree->_internals->kd_tree_allow_update != 0 && depth == 0 &&
+            tree->_internals->balance_factor == 0.0f) {
+        //guarding against division by 0 
+        if (kd_tree_get_previous_tree_size_val != 0) {
+            current_ratio = current_number_of_kd_tree_nodes_val /
+                    kd_tree_get_previous_tree_size_val;
+            /*rebuild thresh hold has been reached? in the background if
+             possible*/
+            if (current_ratio > rebuild_threshold_val &&
+                    tree->_internals->background_rebuild) {
+                /*started once the new node is linked, see below*/
+                background = !tree->_internals->background_running;
+            } else if (current_ratio > rebuild_threshold_val) {
+                kd_tree_rebuild_on_insert(tree, root, k_dimensions);
+            }
+        } else {
+            kd_tree_set_previous_tree_size(tree,
+                    kdtree_get_current_number_of_kd_tree_nodes(tree));
+        }
+    }
+    /*descend to the empty child, decide the left or right subtree using
+     the split of each node*/
+    link = root;
+    while (!is_empty_node(*link, k_dimensions)) {
+        parent = *link;
+        if (key[(*link)->split_dimension] < (*link)->split_value) {
+            link = &(*link)->left;
+        } else {
+            link = &(*link)->right;
+        }
+        depth++;
+    }
+    new_node = kd_tree_new_node(tree, key, k_dimensions, copying);
+    /*a new node splits at its own point, cycling through dimensions*/
+    if (NULL != new_node) {
+        cd = depth % k_dimensions;
+        new_node->split_dimension = cd;
+        new_node->split_value = key[cd];
+        new_node->bucket_size = 1;
+        new_node->subtree_size = 1;
+        new_node->parent = parent;
+        /*automatic ids never collide with ids given by the caller*/
+        new_node->id = id >= 0 ? id : tree->_internals->next_id;
+        if (new_node->id >= tree->_internals->next_id) {
+            tree->_internals->next_id = new_node->id + 1;
+        }
+    }
+    *link = new_node;
+    /*was the root set before*/
+    if (is_empty_node(kdtree_get_root(tree), k_dimensions)) {
+        kd_tree_set_root(tree, *link);
+    }
+    if (NULL != new_node && !copying) {
+        if (tree->_internals->background_running) {
+            kd_tree_log_delta(tree, key, new_node->id);
+        }
+        kd_tree_count_insert(tree, root, new_node, depth);
+    }
+    /*the thread copies the tree with the new node, if it cannot start the
+     tree is rebuilt here*/
+    if (background && !kd_tree_start_background_rebuild(tree)) {
+        kd_tree_rebuild_on_insert(tree, root, k_dimensions);
+    }
+}
+
+/*=============================================================================
+Function        kd_tree_rebuild_on_insert
+Description:    whole tree rebuild of the rebuild_threshold policy on the 
+ *              inserting thread, see kd_tree_rebuild(). 
+Inputs:         root - root pointer of the caller, it follows the new root if
+ *              it pointed to the root of the tree.
+==========================================================*/
+void kd_tree_rebuild_on_insert(kdtree_t* tree, kd_tree_node** root,
+        const int k_dimensions)
+{
+    int at_root = (*root == kdtree_get_root(tree));
+
+    kd_tree_init_node_processing_space_heap(tree);
+    /*kd_tree_rebuild will 1st lock all write operations*/
+    kd_tree_rebuild(tree, kdtree_get_root(tree), k_dimensions);
+    /*the rebuild moved the nodes, continue from the new root*/
+    if (at_root)
+    {
+        *root = kdtree_get_root(tree);
+    }
+    kd_tree_set_previous_tree_size(tree,
+            kdtree_get_current_number_of_kd_tree_nodes(tree));
+}
+
+/*=============================================================================
+Function        kd_tree_count_insert
+Description:    adds the new leaf node to the subtree_size of its ancestors.
+ *              With a balance_factor alpha it then rebuilds the highest 
+ *              ancestor with a child holding more than alpha of its points, 
+ *              see kd_tree_rebuild_partial(). Only the path of the insert 
+ *              grew, so afterwards every node is alpha balanced again. 
+ *              Rebuilding the lowest unbalanced ancestor would leave the ones
+ *              above it unbalanced. O(depth).
+Inputs:         root - root pointer of the caller, see kd_tree_add_record().
+ *              depth - depth of node.
+References:     I. Galperin, R. L. Rivest, 1993, Scapegoat trees.
+==========================================================*/
+void kd_tree_count_insert(kdtree_t* tree, kd_tree_node** root,
+        kd_tree_node* node, int depth)
+{
+    float alpha = tree->_internals->balance_factor;
+    kd_tree_node* child = node;
+    kd_tree_node* ancestor = node->parent;
+    kd_tree_node* scapegoat = NULL;
+    int scapegoat_depth = 0;
+
+    while (NULL != ancestor)
+    {
+        ancestor->subtree_size++;
+        depth--;
+        if (alpha > 0.0f &&
+                child->subtree_size > alpha * ancestor->subtree_size)
+        {
+            scapegoat = ancestor;
+            scapegoat_depth = depth;
+        }
+        child = ancestor;
+        ancestor = ancestor->parent;
+    }
+    if (NULL != scapegoat)
+    {
+        kd_tree_rebuild_partial(tree, root, scapegoat, scapegoat_depth);
+    }
+}
+
+/*node lost a point of its subtree, so did its ancestors*/
+void kd_tree_count_delete(kd_tree_node* node)
+{
+    for (; NULL != node; node = node->parent)
+    {
+        node->subtree_size--;
+    }
+}
+
+/*=============================================================================
+Function        kd_tree_rebuild_partial
+Description:    rebuilds the subtree of node in place: collects the slots of 
+ *              its nodes & bucket members breadth first, then links them into
+ *              a balanced subtree, see kd_tree_build_slots(). No point moves,
+ *              the rest of the tree is not touched. O(m log m) for a subtree 
+ *              of m points, plus a scratch array of m slots.
+Inputs:         root - root pointer of the caller, updated if node is the 
+ *              root of the tree.
+ *              depth - depth of node.
+==========================================================*/
+void kd_tree_rebuild_partial(kdtree_t* tree, kd_tree_node** root,
+        kd_tree_node* node, int depth)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    kd_tree_node* parent = node->parent;
+    kd_tree_node* subtree = NULL;
+    int size = node->subtree_size;
+    int* slots = (int*) malloc(sizeof (int)*size);
+    int count = 1;
+    int i = 0;
+    int b = 0;
+
+    if (NULL == slots)
+    {
+        printf("kd_tree_rebuild_partial(), Error no memory, subtree is not"
+                " rebuilt.\n");
+        return;
+    }
+    /*slots doubles as the queue of the breadth first walk*/
+    slots[0] = (int) (node - nodes);
+    for (i = 0; i < count; i++)
+    {
+        kd_tree_node* member = nodes + slots[i];
+        for (b = 1; b < member->bucket_size; b++)
+        {
+            slots[count++] = slots[i] + b;
+        }
+        if (NULL != member->left)
+        {
+            slots[count++] = (int) (member->left - nodes);
+        }
+        if (NULL != member->right)
+        {
+            slots[count++] = (int) (member->right - nodes);
+        }
+    }
+    for (i = 0; i < size; i++)
+    {
+        nodes[slots[i]].left = NULL;
+        nodes[slots[i]].right = NULL;
+        nodes[slots[i]].parent = NULL;
+        nodes[slots[i]].bucket_size = 1;
+    }
+    subtree = kd_tree_build_slots(tree, slots, 0, size, depth);
+    subtree->parent = parent;
+    if (NULL == parent)
+    {
+        kd_tree_set_root(tree, subtree);
+        if (*root == node)
+        {
+            *root = subtree;
+        }
+    }
+    else if (parent->left == node)
+    {
+        parent->left = subtree;
+    }
+    else
+    {
+        parent->right = subtree;
+    }
+    tree->_internals->partial_rebuild_counter++;
+    free(slots);
+}
+
+/*=============================================================================
+Function        kd_tree_build_slots
+Description:    kd_tree_build_subtree() over an array of slots of node_space:
+ *              the point at the median of slots [lo, hi) becomes the node of
+ *              its own slot, the slots on either side its subtrees. The rows 
+ *              do not move, so the slots need not be contiguous. Always 
+ *              splits at the median & makes no leaf buckets.
+Output:         root of the subtree or NULL if the range is empty.
+==========================================================*/
+kd_tree_node* kd_tree_build_slots(kdtree_t* tree, int* slots, int lo, int hi,
+        int depth)
+{
+    kd_tree_node* nodes = tree->_internals->node_space;
+    kd_tree_node* node = NULL;
+    int dimension = 0;
+    int middle = 0;
+    int less = 0;
+    int swap = 0;
+    int i = 0;
+    float split = 0.0f;
+
+    if (lo >= hi)
+    {
+        return NULL;
+    }
+    dimension = kd_tree_choose_split_dimension(tree, slots, lo, hi, depth);
+    middle = lo + (hi - lo) / 2;
+    kd_tree_select_slot(tree, slots, lo, hi, middle, dimension);
+    split = nodes[slots[middle]].dataset[dimension];
+    /*left subtree must be strictly smaller than split, see 
+     kd_tree_build_subtree()*/
+    less = lo;
+    for (i = lo; i < middle; i++)
+    {
+        if (nodes[slots[i]].dataset[dimension] < split)
+        {
+            swap = slots[i];
+            slots[i] = slots[less];
+            slots[less] = swap;
+            less++;
+        }
+    }
+    swap = slots[less];
+    slots[less] = slots[middle];
+    slots[middle] = swap;
+    middle = less;
+
+    node = nodes + slots[middle];
+    node->split_dimension = dimension;
+    node->split_value = split;
+    node->subtree_size = hi - lo;
+    node->left = kd_tree_build_slots(tree, slots, lo, middle, depth + 1);
+    node->right = kd_tree_build_slots(tree, slots, middle + 1, hi, depth + 1);
+    if (NULL != node->left)
+    {
+        node->left->parent = node;
+    }
+    if (NULL != node->right)
+    {
+        node->right->parent = node;
+    }
+    return node;
+}
+
+/*=============================================================================
+Function        kd_tree_build_forest
+Description:    builds the levels of a forest over rows [0, rows) of 
+ *              node_space: for every bit i set in rows, largest first, the 
+ *              next 2^i rows become the tree of level i, see 
+ *              kd_tree_build_subtree(). The rows must be reset like in 
+ *              kd_tree_bulk_build(). Must run inside an OpenMP parallel 
+ *              region to use more than one thread.
+Output:         root of the largest level, NULL if rows is 0.
+==========================================================*/
+kd_tree_node* kd_tree_build_forest(kdtree_t* tree, int rows)
+{
+    kd_tree_node** roots = tree->_internals->forest_roots;
+    int level = KD_TREE_FOREST_LEVELS - 1;
+    int lo = 0;
+
+    for (; level >= 0; level--)
+    {
+        roots[level] = NULL;
+        if ((rows >> level) & 1)
+        {
+            roots[level] = kd_tree_build_subtree(tree, lo, lo + (1 << level),
+                    0);
+            lo += 1 << level;
+        }
+    }
+    return kd_tree_forest_top(tree);
+}
+
+/*=============================================================================
+Function        kd_tree_forest_insert
+Description:    adds key to a forest of n points. The levels 0..j-1 below the
+ *              lowest empty level j are full & stored last, in rows 
+ *              [n - 2^j + 1, n). Together with key at row n they are the 2^j
+ *              points of level j, which is built over those rows while the 
+ *              levels 0..j-1 become empty. The larger levels do not move.
+ *              O(2^j log 2^j), every point is merged at most log n times.
+==========================================================*/
+void kd_tree_forest_insert(kdtree_t* tree, const float key[],
+        const int k_dimensions, int id)
+{
+    kdtree_internals* internals = tree->_internals;
+    kd_tree_node* nodes = internals->node_space;
+    int n = kdtree_get_current_number_of_kd_tree_nodes(tree);
+    int level = 0;
+    int lo = 0;
+    int i = 0;
+
+    if (n >= kd_tree_get_rows_size(tree))
+    {
+        printf("kd_tree_forest_insert(), Error no more heap!\n");
+        return;
+    }
+    kd_tree_drop_compact(tree);
+    memcpy(nodes[n].dataset, key, sizeof (float)*k_dimensions);
+    /*automatic ids never collide with ids given by the caller*/
+    nodes[n].id = id >= 0 ? id : internals->next_id;
+    if (nodes[n].id >= internals->next_id) {
+        internals->next_id = nodes[n].id + 1;
+    }
+    while ((n >> level) & 1)
+    {
+        level++;
+    }
+    lo = n + 1 - (1 << level);
+    for (i = lo; i <= n; i++)
+    {
+        nodes[i].left = NULL;
+        nodes[i].right = NULL;
+        nodes[i].parent = NULL;
+        nodes[i].bucket_size = 1;
+    }
+    #pragma omp parallel if (n + 1 - lo >= KD_TREE_PARALLEL_BUILD_MIN_ROWS)
+    {
+        #pragma omp single
+        internals->forest_roots[level] = kd_tree_build_subtree(tree, lo,
+                n + 1, 0);
+    }
+    for (i = 0; i < level; i++)
+    {
+        internals->forest_roots[i] = NULL;
+    }
+    internals->node_bump_index = n + 1;
+    set_current_number_of_kd_tree_nodes(tree, n + 1);
+    kd_tree_set_root(tree, kd_tree_forest_top(tree));
+}
+
+/*root of the largest level of the forest, NULL if it is empty*/
+kd_tree_node* kd_tree_forest_top(kdtree_t* tree)
+{
+    int level = KD_TREE_FOREST_LEVELS - 1;
+
+    for (; level >= 0; level--)
+    {
+        if (NULL != tree->_internals->forest_roots[level])
+        {
+            return tree->_internals->forest_roots[level];
+        }
+    }
+    return NULL;
+}
+
+/*=============================================================================
+Function        kd_tree_update_point 
+Description:    User friendly wrapper for internal kd_tree_update_record 
+ *              function  
+ *              which builds a kd-tree.    
+Inputs:         tree * root - The  pointer to the root of the kd-tree
+ *              float target_data [] - data to be found and updated 
+ *              float new_data [] - that will replace target_data []
+Output:         Returns a int flag acting as boolean 0 if update failed or 1 
+ *              if operation was successful.      
+==========================================================*/
+/*mutator*/
+int
+kd_tree_update_point(kd_tree_node* root, const float target_data [],  
+        const float new_data [])
+{
+ root = kd_tree_sync_background(kd_tree_get_kd_tree(), root);
+ if (root == kdtree_get_root(kd_tree_get_kd_tree()) &&
+         kd_tree_buffer_update(kd_tree_get_kd_tree(), target_data, new_data))
+ {
+ return 1;
+ }
+ return kd_tree_update_record(kd_tree_get_kd_tree(), root, target_data,  
+        new_data,kd_tree_get_k_dimensions());
+}
+
+/*mutator*/
+int
+kdtree_update_point(kdtree_t* self, const float target_data [],  
+        const float new_data [])
+{
+ int flag = 0;
+ if (NULL != self && self->_internals->kd_tree_allow_update)
+ {
+ kd_tree_sync_background(self, NULL);
+ flag = kd_tree_buffer_update(self, target_data, new_data) ||
+        kd_tree_update_record(self, kdtree_get_root(self), target_data,  
+        new_data,kdtree_get_k_dimensions(self));
+ }
+ return flag;
+}
+
+/*=============================================================================
+Function        kd_tree_update_record
+Description:    Internal API called by friendly kd_tree_update_record. 
+ *              which builds a kd-tree. This utilized     
+Inputs:         kdtree_t* tree - tree that owns the nodes
+ *              tree * root - The  pointer to the root of the kd-tree
+ *              float target_data [] - data to be found and updated 
+ *              float new_data [] - that will replace target_data []
+Output:         Returns a int flag acting as boolean 0 if update failed or 1 
+ *              if operation was successful.     
+==========================================================*/
+/*mutator*/
+int kd_tree_update_record(kdtree_t* tree, kd_tree_node* root,
+        const float target_data [],  
+        const float new_data [],const int k_dimensions)
+{
+   int flag = 0;  
+   int id = -1;
+   /*the updated point keeps its id*/
+   kd_tree_node* target = kd_tree_find_node(root, target_data, k_dimensions);
+   if (NULL != target)
+   {
+       id = target->id;
+   }
+   flag = kd_tree_delete_data_point_helper(tree, root, target_data,0,
+           k_dimensions);
+   if (flag)
+   {
+         kd_tree_add_record(tree, &root,
+                    new_data,
+                    0,
+                     k_dimensions,
+                    0,
+                    kdtree_get_rebuild_threshold(tree), id);
+   }
+   return flag; 
+}
+
+/*===========================================================================
+Function:       in_order_stack_traversal
+Description:    Returns number of  tree nodes that were traversed and set in 
+ *              output parameter output_flatten_kd_tree.  
+Inputs:         kd_tree_node *root. 
+ *              int number_dimensions.
+Outputs:        In order array representing all kdtree nodes & returns number               
+ *              nodes in the flatten_kd_tree.
+Notes:          Iterative with an explicit stack of the current path, so 
+ *              chains thousands of levels deep do not grow the call stack. 
+ *              Read only, unlike threading the tree (Morris), which rewires
+ *              right pointers while it runs.
+References: 
+ 1) https://tutorialspoint.dev/data-structure/
+ 2) https://prismoskills.appspot.com/lessons/
+ Binary_Trees/Traversal_without_recursion.jsp
+ 3) MIT Algorithms cormen
+ 4) Algorithms in C Robert Sedgewick 
+==========================================================*/
+int
+kd_tree_in_order_traversal (kd_tree_node *root, int number_dimensions)
+{
+    return kd_tree_in_order_traversal_helper(kd_tree_get_kd_tree(), root,
+            number_dimensions);
+}
+
+int
+kdtree_in_order_traversal (kdtree_t* self)
+{
+    return kd_tree_in_order_traversal_helper(self, kdtree_get_root(self),
+            kdtree_get_k_dimensions(self));
+}
+
+int
+kd_tree_in_order_traversal_helper (kdtree_t* tree, kd_tree_node *root,
+        int number_dimensions)
+{
+ 
+    /* set current to root*/
+    kd_tree_node* curr = root; 
+    kd_tree_node* node_knn_result_space =
+            tree->_internals->node_knn_result_space;
+    kd_tree_node** stack = NULL;
+    int stack_size = 0;
+    int heap_index= 0; 
+    int j = 0;
+    
+    if (tree->_internals->forest)
+    {
+        printf("kd_tree_in_order_traversal_helper(), Error not available "
+                "for a forest.\n");
+        return 0;
+    }
+    if (is_empty_node(curr,number_dimensions))
+    {
+        return 0;
+    }
+    /*the path from root to curr, at most one entry per node*/
+    stack = (kd_tree_node**) malloc(sizeof (kd_tree_node*)*
+            kd_tree_get_rows_size(tree));
+    if (NULL == stack)
+    {
+        printf("kd_tree_in_order_traversal_helper(), Error could not "
+                "allocate the stack.\n");
+        return 0;
+    }
+    kd_tree_init_node_knn_result_heap(tree);
+    while (stack_size > 0 || !is_empty_node(curr,number_dimensions))
+    {
+        /*down to the leftmost node, its ancestors wait on the stack*/
+        while (!is_empty_node(curr,number_dimensions))
+        {
+            stack[stack_size++] = curr;
+            curr = curr->left;
+        }
+        curr = stack[--stack_size];
+        /*the node & the rest of its bucket*/
+        for (j = 0; j < curr->bucket_size; j++)
+        {
+            memcpy(node_knn_result_space[heap_index].dataset, 
+                    curr[j].dataset,
+                    sizeof (float)*number_dimensions);
+            node_knn_result_space[heap_index].id = curr[j].id;
+            heap_index++; 
+        }
+        curr = curr->right;
+    }
+    free(stack);
+    return heap_index; 
+}
+
+
+/*=============================================================================
+Function:       kd_tree_search_data_point
+Description:    User friendly wrapper.  
+                Traverses the tree for the existence of a single node.
+ *              This not a KNN search for KNN search call the function 
+ *              kd_tree_knn.
+ *              The search is done by either going left if the key is larger 
+ *              than current node's info or going left if the key is smaller 
+ *              than current nodes value. Ultimately reaching the key if it exists. 
+ *              This traversal is O(log n) and considered optimal. 
+ *              Wrapper around search(0 function which  is an internal API 
+ *              function. User API.
+Notes:          User friendly wrapper around search. This is a recursive
+ *              function. 
+Inputs:         tree * root - tree root which is traversed n order to 
+ *              attempt to find the data[].
+ *              float data[] - query point used as search parameter. 
+Output:         Returns  0 (false) with NOT found. Returns 1 (true) if found. 
+=============================================================================*/
+int kd_tree_search_data_point(kd_tree_node* root, const float data[])
+{
+  return kd_tree_search_from(kd_tree_get_kd_tree(), root, data,
+          kd_tree_get_k_dimensions());
+}
+
+int kdtree_search_data_point(kdtree_t* self, const float data[])
+{
+  return kd_tree_search_from(self, kdtree_get_root(self), data,
+          kdtree_get_k_dimensions(self));
+}
+
+/*search of root, every level for the whole of a forest*/
+int kd_tree_search_from(kdtree_t* tree, kd_tree_node* root,
+        const float data[], const int k_dimensions)
+{
+  int level = 0;
+
+  if (NULL != tree && root == kdtree_get_root(tree) &&
+          kd_tree_buffer_find(tree, data) >= 0)
+  {
+      return 1;
+  }
+  if (NULL == tree || !tree->_internals->forest ||
+          root != kdtree_get_root(tree))
+  {
+      return kd_tree_search_helper(root, data, k_dimensions);
+  }
+  for (; level < KD_TREE_FOREST_LEVELS; level++)
+  {
+      if (NULL != tree->_internals->forest_roots[level] &&
+              kd_tree_search_helper(tree->_internals->forest_roots[level],
+              data, k_dimensions))
+      {
+          return 1;
+      }
+  }
+  return 0;
+}
+/*=============================================================================
+Function:       search_tree
+Description:    traverses the tree by either going left if the key is larger
+ * than current node's info or going left if the key is smaller than current 
+ * nodes value. Ultimately reaching the key if it exists. This traversal is 
+ * O(log n) and considered optimal. 
+Input:          tree * root - root of of the kd-tree used to start traversal
+ *              float data[] - query point used as search parameter.
+ *              int k_dimensions - number of columns in the dataset              
+Output:         Returns  0 (false) with NOT found. Returns 1 (true) if found.
+=============================================================================*/
+int
+kd_tree_search_helper(kd_tree_node* root, const float data[],
+        const int k_dimensions) {
+    return NULL != kd_tree_find_node(root, data, k_dimensions);
+}
+
+/*=============================================================================
+Function:       kd_tree_find_node
+Description:    same traversal as kd_tree_search_helper(). 
+Output:         the node holding data[] or NULL if NOT found.
+=============================================================================*/
+kd_tree_node*
+kd_tree_find_node(kd_tree_node* root, const float data[],
+        const int k_dimensions) {
+    kd_tree_node* found = NULL;
+    if (!is_empty_node(root,k_dimensions)) {
+        kd_tree_node* current = root;
+        //while loop to find target node for deletion. 
+        while (NULL != current) {
+            //if found then break;  
+            int index = kd_tree_bucket_index(current, data, k_dimensions);
+            if (index >= 0) {
+                found = current + index;
+                break;
+            }
+            /*decide the left or right subtree using the split of current*/
+            if (data[current->split_dimension] < current->split_value) {
+                current = current->left;
+            } else {
+                current = current->right;
+            }
+
+        }//end traverse while 
+
+    }//end if root is NOT 
+    return  found; 
+}
+
+/*=============================================================================
+Function:       kd_tree_points_equal
+Description:    A utility function to determine equality                
+ *              in multidimensional space. Returns 1 if                 
+ *              true & 0 if false.  
+TODO:          change signature to use pointers  
+=============================================================================*/
+int kd_tree_points_equal(const float point1[],const  float point2[], 
+        int k_dimensions)
+{
+    int flag = 1;
+    if (NULL == point1 || NULL == point2)
+    {
+        flag = 0; 
+    }
+    else
+    {
+        float size = k_dimensions;
+        /*compare each index*/
+        int i = 0;
+        for (; i < size; i++)
+        {
+            if (point1[i] != point2[i])
+            {
+                /*false*/
+                flag = 0;
+                break;
+            }
+        }
+    }
+    return flag;
+}
+
+
+ /*=============================================================================
+Function        n_dimensional_euclidean
+Description:    calculate the Euclidean distance in n dimensional space.
+Input:          float values_1 [] - float array with k dimensions
+  *             float values_2 [] - float array with k dimensions
+Output:         Returns distance. 
+References:     https://en.wikipedia.org/wiki/Euclidean_distance 
+==========================================================*/
+float
+kd_tree_n_dimensional_euclidean (const float values_1 [],
+                                 const float values_2 [],
+                                 const int k_dimensions)
+{
+    return sqrt (kd_tree_n_dimensional_squared_euclidean(values_1, values_2,
+            k_dimensions));
+}
+
+/*=============================================================================
+Function        n_dimensional_squared_euclidean
+Description:    calculate the squared Euclidean distance in n dimensional 
+ *              space. Orders points the same way as the Euclidean distance
+ *              without the sqrt(), therefore kNN & radius search compare 
+ *              squared distances & only take the sqrt() of the results.
+ *              From KD_TREE_SIMD_MIN_DIMENSIONS on the SIMD kernel selected
+ *              at load time is used, below that the call costs more than the
+ *              loop.
+Input:          float values_1 [] - float array with k dimensions
+  *             float values_2 [] - float array with k dimensions
+Output:         Returns squared distance. 
+==========================================================*/
+float
+kd_tree_n_dimensional_squared_euclidean (const float values_1 [],
+                                 const float values_2 [],
+                                 const int k_dimensions)
+{
+    if (k_dimensions >= KD_TREE_SIMD_MIN_DIMENSIONS)
+    {
+        return kd_tree_squared_euclidean_kernel(values_1, values_2,
+                k_dimensions);
+    }
+    float total_distance = 0;
+    float distance = 0;
+    int i = 0;
+    int size = k_dimensions;
+    for (; i < size; i++)
+    {
+        distance = values_1[i] - values_2[i];
+        total_distance = total_distance + (distance * distance);
+    }
+
+    return total_distance;
+}
+
+/*=============================================================================
+Distance kernels. Squared Euclidean distance of two points & of one query
+against a block of rows x k_dimensions points (row major). Every kernel 
+returns the same result as the scalar loop up to float rounding.
+==============================================================================*/
+float kd_tree_squared_euclidean_scalar(const float* a, const float* b, int n)
+{
+    float total = 0.0f;
+    float d = 0.0f;
+    int i = 0;
+    for (; i < n; i++)
+    {
+        d = a[i] - b[i];
+        total += d * d;
+    }
+    return total;
+}
+
+void kd_tree_squared_euclidean_block_scalar(const float* query,
+        const float* points, int rows, int n, float* out)
+{
+    int r = 0;
+    for (; r < rows; r++)
+    {
+        out[r] = kd_tree_squared_euclidean_scalar(query, points + 
+                (size_t) r * n, n);
+    }
+}
+
+#ifdef KD_TREE_X86_KERNELS
+/*Block kernels. Below the vector width every lane is a row: the query is 
+broadcast once, the rows are gathered per dimension & summed in dimension
+order, the result of the scalar loop, no horizontal reduction. From the 
+vector width on four rows share every load of the query & one transpose 
+reduces their accumulators, the result of the point kernel. Remaining rows
+use the point kernel.*/
+#define KD_TREE_BLOCK_ROWS 4
+
+__attribute__((target("sse2")))
+float kd_tree_squared_euclidean_sse2(const float* a, const float* b, int n)
+{
+    __m128 sum = _mm_setzero_ps();
+    __m128 d;
+    float lanes[4];
+    float total = 0.0f;
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+    }
+    _mm_storeu_ps(lanes, sum);
+    total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++)
+    {
+        total += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return total;
+}
+
+/*lane j of the result is the sum of the lanes of s[j], (l0 + l1) + (l2 + l3)
+like the point kernels*/
+static inline __attribute__((target("sse2")))
+__m128 kd_tree_reduce_rows_sse2(__m128 s0, __m128 s1, __m128 s2, __m128 s3)
+{
+    _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+    return _mm_add_ps(_mm_add_ps(s0, s1), _mm_add_ps(s2, s3));
+}
+
+/*adds the coordinates [i, n) of KD_TREE_BLOCK_ROWS rows to out, the tail
+of the point kernels*/
+static inline void kd_tree_block_tail(const float* query, const float* p,
+        int i, int n, float* out)
+{
+    int j = 0;
+    int c = 0;
+    for (; j < KD_TREE_BLOCK_ROWS; j++)
+    {
+        for (c = i; c < n; c++)
+        {
+            out[j] += (query[c] - p[(size_t) j * n + c]) *
+                    (query[c] - p[(size_t) j * n + c]);
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+void kd_tree_squared_euclidean_block_sse2(const float* query,
+        const float* points, int rows, int n, float* out)
+{
+    __m128 q[4];
+    __m128 s0, s1, s2, s3, d, v;
+    const float* p = NULL;
+    int r = 0;
+    int i = 0;
+    int c = 0;
+
+    if (n < 4)
+    {
+        for (c = 0; c < n; c++)
+        {
+            q[c] = _mm_set1_ps(query[c]);
+        }
+        for (; r + 4 <= rows; r += 4)
+        {
+            p = points + (size_t) r * n;
+            s0 = _mm_setzero_ps();
+            for (c = 0; c < n; c++)
+            {
+                d = _mm_sub_ps(q[c], _mm_set_ps(p[3 * n + c], p[2 * n + c],
+                        p[n + c], p[c]));
+                s0 = _mm_add_ps(s0, _mm_mul_ps(d, d));
+            }
+            _mm_storeu_ps(out + r, s0);
+        }
+    }
+    else
+    {
+        for (; r + KD_TREE_BLOCK_ROWS <= rows; r += KD_TREE_BLOCK_ROWS)
+        {
+            p = points + (size_t) r * n;
+            s0 = s1 = s2 = s3 = _mm_setzero_ps();
+            for (i = 0; i + 4 <= n; i += 4)
+            {
+                v = _mm_loadu_ps(query + i);
+                d = _mm_sub_ps(v, _mm_loadu_ps(p + i));
+                s0 = _mm_add_ps(s0, _mm_mul_ps(d, d));
+                d = _mm_sub_ps(v, _mm_loadu_ps(p + n + i));
+                s1 = _mm_add_ps(s1, _mm_mul_ps(d, d));
+                d = _mm_sub_ps(v, _mm_loadu_ps(p + 2 * n + i));
+                s2 = _mm_add_ps(s2, _mm_mul_ps(d, d));
+                d = _mm_sub_ps(v, _mm_loadu_ps(p + 3 * n + i));
+                s3 = _mm_add_ps(s3, _mm_mul_ps(d, d));
+            }
+            _mm_storeu_ps(out + r, kd_tree_reduce_rows_sse2(s0, s1, s2, s3));
+            kd_tree_block_tail(query, p, i, n, out + r);
+        }
+    }
+    for (; r < rows; r++)
+    {
+        out[r] = kd_tree_squared_euclidean_sse2(query, points + 
+                (size_t) r * n, n);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+float kd_tree_squared_euclidean_avx2(const float* a, const float* b, int n)
+{
+    __m256 sum = _mm256_setzero_ps();
+    __m256 d;
+    __m128 half;
+    float lanes[4];
+    float total = 0.0f;
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        sum = _mm256_fmadd_ps(d, d, sum);
+    }
+    half = _mm_add_ps(_mm256_castps256_ps128(sum),
+            _mm256_extractf128_ps(sum, 1));
+    _mm_storeu_ps(lanes, half);
+    total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++)
+    {
+        total += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return total;
+}
+
+/*the upper & lower half of an accumulator added, the first step of the 
+reduction of kd_tree_squared_euclidean_avx2()*/
+static inline __attribute__((target("avx2")))
+__m128 kd_tree_half_avx2(__m256 sum)
+{
+    return _mm_add_ps(_mm256_castps256_ps128(sum),
+            _mm256_extractf128_ps(sum, 1));
+}
+
+/*kd_tree_reduce_rows_sse2() in VEX encoding, no SSE/AVX transitions*/
+static inline __attribute__((target("avx2")))
+__m128 kd_tree_reduce_rows_avx2(__m128 s0, __m128 s1, __m128 s2, __m128 s3)
+{
+    _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+    return _mm_add_ps(_mm_add_ps(s0, s1), _mm_add_ps(s2, s3));
+}
+
+__attribute__((target("avx2,fma")))
+void kd_tree_squared_euclidean_block_avx2(const float* query,
+        const float* points, int rows, int n, float* out)
+{
+    __m256 q[8];
+    __m256 s0, s1, s2, s3, d, v;
+    __m256i offsets;
+    const float* p = NULL;
+    int r = 0;
+    int i = 0;
+    int c = 0;
+
+    if (n < 8)
+    {
+        for (c = 0; c < n; c++)
+        {
+            q[c] = _mm256_set1_ps(query[c]);
+        }
+        offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6,
+                7), _mm256_set1_epi32(n));
+        for (; r + 8 <= rows; r += 8)
+        {
+            p = points + (size_t) r * n;
+            s0 = _mm256_setzero_ps();
+            for (c = 0; c < n; c++)
+            {
+                d = _mm256_sub_ps(q[c],
+                        _mm256_i32gather_ps(p + c, offsets, 4));
+                s0 = _mm256_add_ps(s0, _mm256_mul_ps(d, d));
+            }
+            _mm256_storeu_ps(out + r, s0);
+        }
+    }
+    else
+    {
+        for (; r + KD_TREE_BLOCK_ROWS <= rows; r += KD_TREE_BLOCK_ROWS)
+        {
+            p = points + (size_t) r * n;
+            s0 = s1 = s2 = s3 = _mm256_setzero_ps();
+            for (i = 0; i + 8 <= n; i += 8)
+            {
+                v = _mm256_loadu_ps(query + i);
+                d = _mm256_sub_ps(v, _mm256_loadu_ps(p + i));
+                s0 = _mm256_fmadd_ps(d, d, s0);
+                d = _mm256_sub_ps(v, _mm256_loadu_ps(p + n + i));
+                s1 = _mm256_fmadd_ps(d, d, s1);
+                d = _mm256_sub_ps(v, _mm256_loadu_ps(p + 2 * n + i));
+                s2 = _mm256_fmadd_ps(d, d, s2);
+                d = _mm256_sub_ps(v, _mm256_loadu_ps(p + 3 * n + i));
+                s3 = _mm256_fmadd_ps(d, d, s3);
+            }
+            _mm_storeu_ps(out + r, kd_tree_reduce_rows_avx2(
+                    kd_tree_half_avx2(s0), kd_tree_half_avx2(s1),
+                    kd_tree_half_avx2(s2), kd_tree_half_avx2(s3)));
+            kd_tree_block_tail(query, p, i, n, out + r);
+        }
+    }
+    for (; r < rows; r++)
+    {
+        out[r] = kd_tree_squared_euclidean_avx2(query, points + 
+                (size_t) r * n, n);
+    }
+}
+
+/*an accumulator folded to 4 lanes, 512 -> 256 -> 128 bits, the first steps
+of the reduction of kd_tree_squared_euclidean_avx512()*/
+static inline __attribute__((target("avx512f")))
+__m128 kd_tree_quarter_avx512(__m512 sum)
+{
+    __m256 half = _mm256_add_ps(_mm512_castps512_ps256(sum),
+            _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(sum),
+            1)));
+    return _mm_add_ps(_mm256_castps256_ps128(half),
+            _mm256_extractf128_ps(half, 1));
+}
+
+__attribute__((target("avx512f")))
+float kd_tree_squared_euclidean_avx512(const float* a, const float* b, int n)
+{
+    __m512 sum = _mm512_setzero_ps();
+    __m512 d;
+    __mmask16 tail;
+    float lanes[4];
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        sum = _mm512_fmadd_ps(d, d, sum);
+    }
+    /*remainder with a masked load, lanes past n are 0*/
+    if (i < n)
+    {
+        tail = (__mmask16) ((1u << (n - i)) - 1);
+        d = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, a + i),
+                _mm512_maskz_loadu_ps(tail, b + i));
+        sum = _mm512_fmadd_ps(d, d, sum);
+    }
+    _mm_storeu_ps(lanes, kd_tree_quarter_avx512(sum));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx512f")))
+void kd_tree_squared_euclidean_block_avx512(const float* query,
+        const float* points, int rows, int n, float* out)
+{
+    __m512 q[16];
+    __m512 s0, s1, s2, s3, d, v;
+    __m512i offsets;
+    __mmask16 tail = 0;
+    const float* p = NULL;
+    int r = 0;
+    int i = 0;
+    int c = 0;
+
+    if (n < 16)
+    {
+        for (c = 0; c < n; c++)
+        {
+            q[c] = _mm512_set1_ps(query[c]);
+        }
+        offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6,
+                7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(n));
+        for (; r + 16 <= rows; r += 16)
+        {
+            p = points + (size_t) r * n;
+            s0 = _mm512_setzero_ps();
+            for (c = 0; c < n; c++)
+            {
+                d = _mm512_sub_ps(q[c],
+                        _mm512_i32gather_ps(offsets, p + c, 4));
+                s0 = _mm512_add_ps(s0, _mm512_mul_ps(d, d));
+            }
+            _mm512_storeu_ps(out + r, s0);
+        }
+    }
+    else
+    {
+        tail = (__mmask16) ((1u << (n % 16)) - 1);
+        for (; r + KD_TREE_BLOCK_ROWS <= rows; r += KD_TREE_BLOCK_ROWS)
+        {
+            p = points + (size_t) r * n;
+            s0 = s1 = s2 = s3 = _mm512_setzero_ps();
+            for (i = 0; i < n; i += 16)
+            {
+                /*the last step loads only the remainder, lanes past n are 0*/
+                __mmask16 lanes = i + 16 <= n ? (__mmask16) 0xFFFF : tail;
+                v = _mm512_maskz_loadu_ps(lanes, query + i);
+                d = _mm512_sub_ps(v, _mm512_maskz_loadu_ps(lanes, p + i));
+                s0 = _mm512_fmadd_ps(d, d, s0);
+                d = _mm512_sub_ps(v, _mm512_maskz_loadu_ps(lanes, p + n + i));
+                s1 = _mm512_fmadd_ps(d, d, s1);
+                d = _mm512_sub_ps(v,
+                        _mm512_maskz_loadu_ps(lanes, p + 2 * n + i));
+                s2 = _mm512_fmadd_ps(d, d, s2);
+                d = _mm512_sub_ps(v,
+                        _mm512_maskz_loadu_ps(lanes, p + 3 * n + i));
+                s3 = _mm512_fmadd_ps(d, d, s3);
+            }
+            _mm_storeu_ps(out + r, kd_tree_reduce_rows_avx2(
+                    kd_tree_quarter_avx512(s0), kd_tree_quarter_avx512(s1),
+                    kd_tree_quarter_avx512(s2), kd_tree_quarter_avx512(s3)));
+        }
+    }
+    for (; r < rows; r++)
+    {
+        out[r] = kd_tree_squared_euclidean_avx512(query, points + 
+                (size_t) r * n, n);
+    }
+}
+#endif
+
+/*=============================================================================
+Function        kdtree_set_distance_kernel
+Description:    Selects the distance kernel. Returns 1 on success, 0 if the 
+ *              CPU (or the compiler) does not support it, in that case the 
+ *              kernel is not changed. Not thread safe, call it before 
+ *              running queries.
+==========================================================*/
+int kdtree_set_distance_kernel(int kernel)
+{
+    switch (kernel)
+    {
+        case KD_TREE_KERNEL_SCALAR:
+            kd_tree_squared_euclidean_kernel = kd_tree_squared_euclidean_scalar;
+            kd_tree_squared_euclidean_block_kernel = 
+                    kd_tree_squared_euclidean_block_scalar;
+            break;
+#ifdef KD_TREE_X86_KERNELS
+        case KD_TREE_KERNEL_SSE2:
+            if (!__builtin_cpu_supports("sse2"))
+            {
+                return 0;
+            }
+            kd_tree_squared_euclidean_kernel = kd_tree_squared_euclidean_sse2;
+            kd_tree_squared_euclidean_block_kernel = 
+                    kd_tree_squared_euclidean_block_sse2;
+            break;
+        case KD_TREE_KERNEL_AVX2:
+            if (!__builtin_cpu_supports("avx2") || 
+                    !__builtin_cpu_supports("fma"))
+            {
+                return 0;
+            }
+            kd_tree_squared_euclidean_kernel = kd_tree_squared_euclidean_avx2;
+            kd_tree_squared_euclidean_block_kernel = 
+                    kd_tree_squared_euclidean_block_avx2;
+            break;
+        case KD_TREE_KERNEL_AVX512:
+            if (!__builtin_cpu_supports("avx512f"))
+            {
+                return 0;
+            }
+            kd_tree_squared_euclidean_kernel = kd_tree_squared_euclidean_avx512;
+            kd_tree_squared_euclidean_block_kernel = 
+                    kd_tree_squared_euclidean_block_avx512;
+            break;
+#endif
+        default:
+            return 0;
+    }
+    distance_kernel = kernel;
+    return 1;
+}
+
+int kdtree_get_distance_kernel(void)
+{
+    return distance_kernel;
+}
+
+/*=============================================================================
+Function        kd_tree_select_distance_kernel
+Description:    Runs once when the library is loaded, picks the widest kernel
+ *              the CPU supports (cpuid) with the scalar loop as fallback.
+==========================================================*/
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+void kd_tree_select_distance_kernel(void)
+{
+    if (!kdtree_set_distance_kernel(KD_TREE_KERNEL_AVX512) &&
+            !kdtree_set_distance_kernel(KD_TREE_KERNEL_AVX2) &&
+            !kdtree_set_distance_kernel(KD_TREE_KERNEL_SSE2))
+    {
+        kdtree_set_distance_kernel(KD_TREE_KERNEL_SCALAR);
+    }
+}
+
+float kdtree_squared_distance(const float* a, const float* b, int n)
+{
+    return kd_tree_squared_euclidean_kernel(a, b, n);
+}
+
+void kdtree_squared_distance_block(const float* query, const float* points,
+        int rows, int n, float* out)
+{
+    kd_tree_squared_euclidean_block_kernel(query, points, rows, n, out);
+}
+
+/*===========================================================================
+Function        kd_tree_knn_heap_push, kd_tree_knn_heap_offer
+Description:    Offers a candidate to a bounded max-heap of capacity entries,
+ *              heap[0] is the worst (farthest) of the best candidates. When
+ *              the heap is full the candidate replaces heap[0] only if it is
+ *              closer. O(log capacity).
+==========================================================*/
+void kd_tree_knn_heap_push(kd_tree_knn_candidate* heap, int* size,
+        int capacity, kd_tree_node* node, float distance)
+{
+    kd_tree_knn_candidate candidate;
+
+    candidate.node = node;
+    candidate.distance = distance;
+    candidate.position = -1;
+    kd_tree_knn_heap_offer(heap, size, capacity, &candidate);
+}
+
+void kd_tree_knn_heap_offer(kd_tree_knn_candidate* heap, int* size,
+        int capacity, const kd_tree_knn_candidate* candidate)
+{
+    int i = 0;
+    int child = 0;
+    float distance = candidate->distance;
+    kd_tree_knn_candidate swap;
+
+    if (*size < capacity) {
+        /*sift up*/
+        i = *size;
+        (*size)++;
+        while (i > 0 && heap[(i - 1) / 2].distance < distance) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = *candidate;
+    } else if (distance < heap[0].distance) {
+        /*replace the worst & sift down*/
+        heap[0] = *candidate;
+        while ((child = 2 * i + 1) < *size) {
+            if (child + 1 < *size &&
+                    heap[child + 1].distance > heap[child].distance) {
+                child++;
+            }
+            if (heap[child].distance <= heap[i].distance) {
+                break;
+            }
+            swap = heap[i];
+            heap[i] = heap[child];
+            heap[child] = swap;
+            i = child;
+        }
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_knn_heap_sort
+Description:    In place heap sort of a max-heap built by kd_tree_knn_heap_push
+ *              into ascending distance. O(size log size).
+==========================================================*/
+void kd_tree_knn_heap_sort(kd_tree_knn_candidate* heap, int size)
+{
+    kd_tree_knn_candidate swap;
+    int i = 0;
+    int child = 0;
+
+    for (; size > 1; size--) {
+        /*move the farthest to the end & restore the heap in [0,size-1)*/
+        swap = heap[0];
+        heap[0] = heap[size - 1];
+        heap[size - 1] = swap;
+        i = 0;
+        while ((child = 2 * i + 1) < size - 1) {
+            if (child + 1 < size - 1 &&
+                    heap[child + 1].distance > heap[child].distance) {
+                child++;
+            }
+            if (heap[child].distance <= heap[i].distance) {
+                break;
+            }
+            swap = heap[i];
+            heap[i] = heap[child];
+            heap[child] = swap;
+            i = child;
+        }
+    }
+}
+
+/*qsort() comparator, ascending distance*/
+int kd_tree_knn_candidate_compare(const void* a, const void* b)
+{
+    float d1 = ((const kd_tree_knn_candidate*) a)->distance;
+    float d2 = ((const kd_tree_knn_candidate*) b)->distance;
+    return (d1 > d2) - (d1 < d2);
+}
+
+/*===========================================================================
+Function        kd_tree_knn_search
+Description:    Depth first branch & bound search. Visits the side of the split
+ *              that contains the data point first, then the far side only if
+ *              the heap is not full yet or the splitting plane is closer than 
+ *              the current k-th neighbor (heap[0]).
+Inputs:         node - subtree root.
+ *              capacity - number of neighbors wanted. 
+Outputs:        heap, size - the best candidates as a max-heap, distances are
+ *              squared.
+References:     J. H. Friedman, J. L. Bentley, R. A. Finkel, "An Algorithm for
+ *              Finding Best Matches in Logarithmic Expected Time", 1977.
+==========================================================*/
+void kd_tree_knn_search(kdtree_t* tree, kd_tree_node* node,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size)
+{
+    float plane_distance = 0.0f;
+    float distances[KD_TREE_MAX_LEAF_SIZE];
+    kd_tree_node* near_side = NULL;
+    kd_tree_node* far_side = NULL;
+    int i = 0;
+
+    if (is_empty_node(node, k_dimensions)) {
+        return;
+    }
+    if (node->bucket_size > 1) {
+        kd_tree_bucket_distances(tree, node, data_point, k_dimensions,
+                distances);
+        for (; i < node->bucket_size; i++) {
+            kd_tree_knn_heap_push(heap, size, capacity, node + i,
+                    distances[i]);
+        }
+    } else {
+        kd_tree_knn_heap_push(heap, size, capacity, node,
+                kd_tree_n_dimensional_squared_euclidean(data_point,
+                node->dataset, k_dimensions));
+    }
+    /*same routing as kd_tree_add_record()*/
+    plane_distance = data_point[node->split_dimension] - node->split_value;
+    if (plane_distance < 0) {
+        near_side = node->left;
+        far_side = node->right;
+    } else {
+        near_side = node->right;
+        far_side = node->left;
+    }
+    kd_tree_knn_search(tree, near_side, data_point, k_dimensions, capacity,
+            heap, size);
+    if (*size < capacity ||
+            plane_distance * plane_distance < heap[0].distance) {
+        kd_tree_knn_search(tree, far_side, data_point, k_dimensions, capacity,
+                heap, size);
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_bucket_distances
+Description:    squared distances of data_point to the bucket_size points of
+ *              node into out. The coordinates of a bucket made by a bulk 
+ *              build are contiguous rows of the arena, so they are scanned 
+ *              by the block kernel. The rows of an index 
+ *              (kdtree_build_index()) are scattered in the caller's buffer.
+==========================================================*/
+void kd_tree_bucket_distances(kdtree_t* tree, kd_tree_node* node,
+        const float data_point[], const int k_dimensions, float* out)
+{
+    int i = 0;
+
+    if (NULL != tree->_internals->index_dataset) {
+        for (; i < node->bucket_size; i++) {
+            out[i] = kd_tree_n_dimensional_squared_euclidean(data_point,
+                    node[i].dataset, k_dimensions);
+        }
+    } else {
+        kd_tree_squared_euclidean_block_kernel(data_point, node->dataset,
+                node->bucket_size, k_dimensions, out);
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_bucket_index
+Description:    position of data in the bucket of node, 0 is the node itself.
+Output:         int - index or -1 if data is NOT one of the node's points.
+==========================================================*/
+int kd_tree_bucket_index(kd_tree_node* node, const float data[],
+        const int k_dimensions)
+{
+    int i = 0;
+    for (; i < node->bucket_size; i++) {
+        if (kd_tree_points_equal(node[i].dataset, data, k_dimensions)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*===========================================================================
+Function        kd_tree_bucket_remove
+Description:    deletes point index of a bucket of 2 or more points. The last
+ *              point of the bucket moves into its slot, so the bucket stays 
+ *              contiguous, & the last slot is released.
+==========================================================*/
+void kd_tree_bucket_remove(kdtree_t* tree, kd_tree_node* node, int index)
+{
+    kd_tree_node* last = node + node->bucket_size - 1;
+
+    if (node + index != last) {
+        memcpy(node[index].dataset, last->dataset,
+                sizeof (float)*kdtree_get_k_dimensions(tree));
+        node[index].id = last->id;
+    }
+    node->bucket_size--;
+    kd_tree_release_node(tree, last);
+}
+
+/*===========================================================================
+Function        kd_tree_radius_search
+Description:    Collects every node within range of data_point. Like 
+ *              kd_tree_knn_search() the far side of a split is skipped when
+ *              the splitting plane is farther than range.
+Inputs:         squared_range - range * range, range >= 0.
+Outputs:        found, size - the nodes found with squared distances, unsorted.
+==========================================================*/
+void kd_tree_radius_search(kdtree_t* tree, kd_tree_node* node,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size)
+{
+    float distances[KD_TREE_MAX_LEAF_SIZE];
+    float plane_distance = 0.0f;
+    int i = 0;
+
+    if (is_empty_node(node, k_dimensions)) {
+        return;
+    }
+    if (node->bucket_size > 1) {
+        kd_tree_bucket_distances(tree, node, data_point, k_dimensions,
+                distances);
+    } else {
+        distances[0] = kd_tree_n_dimensional_squared_euclidean(data_point,
+                node->dataset, k_dimensions);
+    }
+    for (; i < node->bucket_size; i++) {
+        if (distances[i] <= squared_range) {
+            found[*size].node = node + i;
+            found[*size].distance = distances[i];
+            (*size)++;
+        }
+    }
+    plane_distance = data_point[node->split_dimension] - node->split_value;
+    if (plane_distance < 0 ||
+            plane_distance * plane_distance <= squared_range) {
+        kd_tree_radius_search(tree, node->left, data_point, k_dimensions,
+                squared_range, found, size);
+    }
+    if (plane_distance >= 0 ||
+            plane_distance * plane_distance <= squared_range) {
+        kd_tree_radius_search(tree, node->right, data_point, k_dimensions,
+                squared_range, found, size);
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_compact_distances
+Description:    kd_tree_bucket_distances() of the compact node of slot. The 
+ *              coordinates of slot are row slot of coordinate_space, only an
+ *              index (kdtree_build_index()) reads the rows from node_space.
+==========================================================*/
+void kd_tree_compact_distances(kdtree_t* tree, int slot,
+        const float data_point[], const int k_dimensions, float* out)
+{
+    kdtree_internals* internals = tree->_internals;
+    int bucket_size = internals->compact_nodes[slot].bucket_size;
+    const float* rows = NULL;
+    int i = 0;
+
+    if (NULL != internals->index_dataset) {
+        for (; i < bucket_size; i++) {
+            out[i] = kd_tree_n_dimensional_squared_euclidean(data_point,
+                    internals->node_space[slot + i].dataset, k_dimensions);
+        }
+        return;
+    }
+    rows = internals->coordinate_space + (size_t) slot * k_dimensions;
+    if (bucket_size == 1) {
+        out[0] = kd_tree_n_dimensional_squared_euclidean(data_point, rows,
+                k_dimensions);
+    } else {
+        kd_tree_squared_euclidean_block_kernel(data_point, rows, bucket_size,
+                k_dimensions, out);
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_compact_knn_search
+Description:    kd_tree_knn_search() over the compact nodes, same order of 
+ *              visits & the same results. Candidates reference node_space.
+Inputs:         slot - compact node of the subtree root, -1 for none.
+==========================================================*/
+void kd_tree_compact_knn_search(kdtree_t* tree, int slot,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size)
+{
+    kd_tree_compact_node* node = NULL;
+    float distances[KD_TREE_MAX_LEAF_SIZE];
+    float plane_distance = 0.0f;
+    int near_side = -1;
+    int far_side = -1;
+    int i = 0;
+
+    if (slot < 0) {
+        return;
+    }
+    node = tree->_internals->compact_nodes + slot;
+    kd_tree_compact_distances(tree, slot, data_point, k_dimensions,
+            distances);
+    for (; i < node->bucket_size; i++) {
+        kd_tree_knn_heap_push(heap, size, capacity,
+                tree->_internals->node_space + slot + i, distances[i]);
+    }
+    plane_distance = data_point[node->split_dimension] - node->split_value;
+    if (plane_distance < 0) {
+        near_side = node->left;
+        far_side = node->right;
+    } else {
+        near_side = node->right;
+        far_side = node->left;
+    }
+    kd_tree_compact_knn_search(tree, near_side, data_point, k_dimensions,
+            capacity, heap, size);
+    if (*size < capacity ||
+            plane_distance * plane_distance < heap[0].distance) {
+        kd_tree_compact_knn_search(tree, far_side, data_point, k_dimensions,
+                capacity, heap, size);
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_compact_radius_search
+Description:    kd_tree_radius_search() over the compact nodes.
+Inputs:         slot - compact node of the subtree root, -1 for none.
+==========================================================*/
+void kd_tree_compact_radius_search(kdtree_t* tree, int slot,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size)
+{
+    kd_tree_compact_node* node = NULL;
+    float distances[KD_TREE_MAX_LEAF_SIZE];
+    float plane_distance = 0.0f;
+    int i = 0;
+
+    if (slot < 0) {
+        return;
+    }
+    node = tree->_internals->compact_nodes + slot;
+    kd_tree_compact_distances(tree, slot, data_point, k_dimensions,
+            distances);
+    for (; i < node->bucket_size; i++) {
+        if (distances[i] <= squared_range) {
+            found[*size].node = tree->_internals->node_space + slot + i;
+            found[*size].distance = distances[i];
+            (*size)++;
+        }
+    }
+    plane_distance = data_point[node->split_dimension] - node->split_value;
+    if (plane_distance < 0 ||
+            plane_distance * plane_distance <= squared_range) {
+        kd_tree_compact_radius_search(tree, node->left, data_point,
+                k_dimensions, squared_range, found, size);
+    }
+    if (plane_distance >= 0 ||
+            plane_distance * plane_distance <= squared_range) {
+        kd_tree_compact_radius_search(tree, node->right, data_point,
+                k_dimensions, squared_range, found, size);
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_snapshot_knn_search
+Description:    kd_tree_knn_search() over the snapshot of kdtree_freeze(). 
+ *              The split value of a position is its own coordinate.
+Inputs:         position - subtree root, none if >= snapshot_size.
+==========================================================*/
+void kd_tree_snapshot_knn_search(kdtree_t* tree, int position,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size)
+{
+    kdtree_internals* internals = tree->_internals;
+    const float* row = NULL;
+    float plane_distance = 0.0f;
+    int dimension = 0;
+
+    if (position >= internals->snapshot_size) {
+        return;
+    }
+    row = internals->snapshot_coordinates + (size_t) position * k_dimensions;
+    kd_tree_knn_heap_push(heap, size, capacity,
+            internals->node_space + internals->snapshot_slots[position],
+            kd_tree_n_dimensional_squared_euclidean(data_point, row,
+            k_dimensions));
+    dimension = internals->snapshot_split_dimensions[position];
+    plane_distance = data_point[dimension] - row[dimension];
+    kd_tree_snapshot_knn_search(tree,
+            2 * position + (plane_distance < 0 ? 1 : 2), data_point,
+            k_dimensions, capacity, heap, size);
+    if (*size < capacity ||
+            plane_distance * plane_distance < heap[0].distance) {
+        kd_tree_snapshot_knn_search(tree,
+                2 * position + (plane_distance < 0 ? 2 : 1), data_point,
+                k_dimensions, capacity, heap, size);
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_snapshot_radius_search
+Description:    kd_tree_radius_search() over the snapshot of kdtree_freeze().
+Inputs:         position - subtree root, none if >= snapshot_size.
+==========================================================*/
+void kd_tree_snapshot_radius_search(kdtree_t* tree, int position,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size)
+{
+    kdtree_internals* internals = tree->_internals;
+    const float* row = NULL;
+    float distance = 0.0f;
+    float plane_distance = 0.0f;
+    int dimension = 0;
+
+    if (position >= internals->snapshot_size) {
+        return;
+    }
+    row = internals->snapshot_coordinates + (size_t) position * k_dimensions;
+    distance = kd_tree_n_dimensional_squared_euclidean(data_point, row,
+            k_dimensions);
+    if (distance <= squared_range) {
+        found[*size].node = internals->node_space +
+                internals->snapshot_slots[position];
+        found[*size].distance = distance;
+        (*size)++;
+    }
+    dimension = internals->snapshot_split_dimensions[position];
+    plane_distance = data_point[dimension] - row[dimension];
+    if (plane_distance < 0 ||
+            plane_distance * plane_distance <= squared_range) {
+        kd_tree_snapshot_radius_search(tree, 2 * position + 1, data_point,
+                k_dimensions, squared_range, found, size);
+    }
+    if (plane_distance >= 0 ||
+            plane_distance * plane_distance <= squared_range) {
+        kd_tree_snapshot_radius_search(tree, 2 * position + 2, data_point,
+                k_dimensions, squared_range, found, size);
+    }
+}
+
+/*===========================================================================
+Function        kd_tree_knn_search_from, kd_tree_radius_search_from
+Description:    kNN & radius search of the subtree root. A search of the 
+ *              whole tree uses the snapshot (kdtree_freeze()) or else the 
+ *              compact nodes (kdtree_compact()) when they are valid. A search
+ *              of a whole forest searches every level into the same heap, 
+ *              so the results are merged as they are found. So are the 
+ *              points of the insert buffer for a search of the whole tree.
+==========================================================*/
+void kd_tree_knn_search_from(kdtree_t* tree, kd_tree_node* root,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size)
+{
+    kdtree_internals* internals = tree->_internals;
+    int level = 0;
+
+    if (root == kdtree_get_root(tree)) {
+        kd_tree_buffer_knn_search(tree, data_point, k_dimensions, capacity,
+                heap, size);
+    }
+    if (internals->snapshot_valid && root == kdtree_get_root(tree)) {
+        kd_tree_snapshot_knn_search(tree, 0, data_point, k_dimensions,
+                capacity, heap, size);
+    } else if (internals->forest && root == kdtree_get_root(tree)) {
+        for (; level < KD_TREE_FOREST_LEVELS; level++) {
+            root = internals->forest_roots[level];
+            if (NULL != root && internals->compact_valid) {
+                kd_tree_compact_knn_search(tree,
+                        (int) (root - internals->node_space), data_point,
+                        k_dimensions, capacity, heap, size);
+            } else if (NULL != root) {
+                kd_tree_knn_search(tree, root, data_point, k_dimensions,
+                        capacity, heap, size);
+            }
+        }
+    } else if (kd_tree_uses_compact(tree, root)) {
+        kd_tree_compact_knn_search(tree, tree->_internals->compact_root,
+                data_point, k_dimensions, capacity, heap, size);
+    } else if (!is_empty_node(root, k_dimensions)) {
+        kd_tree_knn_search(tree, root, data_point, k_dimensions, capacity,
+                heap, size);
+    }
+}
+
+void kd_tree_radius_search_from(kdtree_t* tree, kd_tree_node* root,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size)
+{
+    kdtree_internals* internals = tree->_internals;
+    int level = 0;
+
+    if (root == kdtree_get_root(tree)) {
+        kd_tree_buffer_radius_search(tree, data_point, k_dimensions,
+                squared_range, found, size);
+    }
+    if (internals->snapshot_valid && root == kdtree_get_root(tree)) {
+        kd_tree_snapshot_radius_search(tree, 0, data_point, k_dimensions,
+                squared_range, found, size);
+    } else if (internals->forest && root == kdtree_get_root(tree)) {
+        for (; level < KD_TREE_FOREST_LEVELS; level++) {
+            root = internals->forest_roots[level];
+            if (NULL != root && internals->compact_valid) {
+                kd_tree_compact_radius_search(tree,
+                        (int) (root - internals->node_space), data_point,
+                        k_dimensions, squared_range, found, size);
+            } else if (NULL != root) {
+                kd_tree_radius_search(tree, root, data_point, k_dimensions,
+                        squared_range, found, size);
+            }
+        }
+    } else if (kd_tree_uses_compact(tree, root)) {
+        kd_tree_compact_radius_search(tree, tree->_internals->compact_root,
+                data_point, k_dimensions, squared_range, found, size);
+    } else if (!is_empty_node(root, k_dimensions)) {
+        kd_tree_radius_search(tree, root, data_point, k_dimensions,
+                squared_range, found, size);
+    }
+}
+
+/*===========================================================================
+Function        knn algorithm to find N nearest  neighbors. 
+Description:    Given a root to traverse and a data point, this function 
+ *              attempts to find nearest neighbors to that data point
+ *              within a specific Euclidean distance or radius.
+Inputs:         tree * root - tree root which is traversed n order to 
+ *              attempt to find the data[].
+ *              float data_point[] - query point is as search parameter. 
+ *              int depth - current dimension used for comparison. Should be 0. 
+ *              int k_dimensions - number of  features 
+                int number_of_nearest_neighbors - desired number of results
+ *              int sort_result - should results be sorted. 0  is false any
+ *              other number is true.  
+Outputs:        int - number of neighbors found. 
+ *              tree** n_nearests - pointer to array of points of type
+ *              tree that represent the nearest neighbors.
+References:     Foundations of Multidimensional and Metric Data Structures
+ *              By Hanan Samet Chapter 4 
+Notes:          Exact search, the result matches a brute force scan. Subtrees
+ *              on the far side of a split are only visited when the
+ *              splitting plane is closer than the current k-th neighbor.
+ *              Use friendly wrapper to knn().
+==========================================================*/
+int
+kd_tree_knn(kd_tree_node* const root, const float data_point[],
+            int number_of_nearest_neighbors)
+{
+    return kd_tree_knn_helper(kd_tree_get_kd_tree(), root, data_point,
+               kd_tree_get_k_dimensions(),
+               number_of_nearest_neighbors);
+}
+
+int
+kdtree_knn(kdtree_t* self, const float data_point[],
+            int number_of_nearest_neighbors)
+{
+    return kd_tree_knn_helper(self, kdtree_get_root(self), data_point,
+               kdtree_get_k_dimensions(self),
+               number_of_nearest_neighbors);
+}
+
+/*===========================================================================
+Function        kdtree_knn_batch
+Description:    Exact kNN of nq queries, see kd_tree_knn_search(). The queries
+ *              are independent, so they are spread over OpenMP threads & 
+ *              every thread keeps its own candidate heap of k entries. The 
+ *              search only reads the tree & the results go straight to the 
+ *              caller's arrays, node_knn_result_space is not used.
+Inputs:         const float* queries - nq x k_dimensions values, row major.
+ *              int k - number of neighbors per query.
+Outputs:        int* out_indices, float* out_dists - nq x k ids & distances,
+ *              sorted by ascending distance, unused entries -1 & FLT_MAX.
+ *              int - number of queries answered, 0 on error.
+==========================================================*/
+int kdtree_knn_batch(kdtree_t* self, const float* queries, int nq, int k,
+        int* out_indices, float* out_dists)
+{
+    kd_tree_node* root = NULL;
+    int k_dimensions = 0;
+    int capacity = k;
+    int failed = 0;
+    int q = 0;
+
+    if (NULL == self || NULL == queries || nq < 0 || k <= 0 ||
+            NULL == out_indices || NULL == out_dists)
     {
-        float size = k_dimensions;
-        /*compare each index*/
-        int i = 0;
-        for (; i < size; i++)
+        printf("kdtree_knn_batch(), Error invalid tree, queries or "
+                "outputs.\n");
+        return 0;
+    }
+    root = kdtree_get_root(self);
+    k_dimensions = kdtree_get_k_dimensions(self);
+    if (capacity > kd_tree_get_rows_size(self))
+    {
+        capacity = kd_tree_get_rows_size(self);
+    }
+    #pragma omp parallel private(q) if (nq > 1)
+    {
+        kd_tree_knn_candidate* candidates = (kd_tree_knn_candidate*)
+                malloc(sizeof (kd_tree_knn_candidate)*capacity);
+        if (NULL == candidates)
         {
-            if (point1[i] != point2[i])
+            #pragma omp atomic write
+            failed = 1;
+        }
+        #pragma omp for schedule(dynamic, 16)
+        for (q = 0; q < nq; q++)
+        {
+            int* indices = out_indices + (size_t) q * k;
+            float* dists = out_dists + (size_t) q * k;
+            int size = 0;
+            int i = 0;
+            if (NULL != candidates)
             {
-                /*false*/
-                flag = 0;
-                break;
+                kd_tree_knn_search_from(self, root,
+                        queries + (size_t) q * k_dimensions, k_dimensions,
+                        capacity, candidates, &size);
+                kd_tree_knn_heap_sort(candidates, size);
+            }
+            for (; i < size; i++)
+            {
+                indices[i] = candidates[i].node->id;
+                dists[i] = sqrt(candidates[i].distance);
+            }
+            for (; i < k; i++)
+            {
+                indices[i] = -1;
+                dists[i] = FLT_MAX;
             }
         }
+        free(candidates);
     }
-    return flag;
+    if (failed)
+    {
+        printf("kdtree_knn_batch(), Error could not allocate the candidate "
+                "heap.\n");
+        return 0;
+    }
+    return nq;
 }
 
+/*===========================================================================
+Function        knn, knn algorithm  using kd-tree.
+Description:    Given a root to traverse and a data point, this function 
+ *              finds the exact nearest neighbors to that data point
+ *              using Euclidean distance, see kd_tree_knn_search(). 
+Inputs:         
+Outputs:        int - number of neighbors found, the neighbors are copied to
+ *              node_knn_result_space sorted by ascending distance.
+References:     Foundations of Multidimensional and Metric Data Structures
+ *              By Hanan Samet Chapter 4 
+Notes:          O(log N + k log k) expected on a balanced tree. The best k are
+ *              kept in a bounded max-heap, O(log k) per candidate.
+==========================================================*/
+int kd_tree_knn_helper(kdtree_t* tree, kd_tree_node* const root,
+        const float data_point[],
+        const int k_dimensions,
+        int number_of_nearest_neighbors) {
+    kd_tree_node* node_knn_result_space =
+            tree->_internals->node_knn_result_space;
+    kd_tree_knn_candidate* candidates = tree->_internals->knn_candidate_space;
+    int nearest_counter = kd_tree_knn_candidates(tree, root, data_point,
+            k_dimensions, number_of_nearest_neighbors, candidates);
+    int i = 0;
 
- /*=============================================================================
-Function        n_dimensional_euclidean
-Description:    calculate the Euclidean distance in n dimensional space.
-Input:          float values_1 [] - float array with k dimensions
-  *             float values_2 [] - float array with k dimensions
-Output:         Returns distance. 
-References:     https://en.wikipedia.org/wiki/Euclidean_distance 
+    /*copy out the k results*/
+    for (; i < nearest_counter; i++) {
+        memcpy(node_knn_result_space[i].dataset,
+                candidates[i].node->dataset,
+                sizeof (float)*k_dimensions);
+        node_knn_result_space[i].id = candidates[i].node->id;
+        /*sqrt only for the results returned*/
+        node_knn_result_space[i].distance_to_neighbor =
+                sqrt(candidates[i].distance);
+    }
+
+    return nearest_counter;
+
+}
+
+/*===========================================================================
+Function        kd_tree_knn_candidates
+Description:    exact kNN of data_point, see kd_tree_knn_search(). 
+Inputs:         candidates - max_rows entries, knn_candidate_space or the 
+ *              scratch of a kdtree_context_t.
+Outputs:        int - number of neighbors found, the neighbors are in 
+ *              candidates sorted by ascending squared distance.
 ==========================================================*/
-float
-kd_tree_n_dimensional_euclidean (const float values_1 [],
-                                 const float values_2 [],
-                                 const int k_dimensions)
+int kd_tree_knn_candidates(kdtree_t* tree, kd_tree_node* const root,
+        const float data_point[],
+        const int k_dimensions,
+        int number_of_nearest_neighbors, kd_tree_knn_candidate* candidates) {
+    int nearest_counter = 0;
+
+    if (number_of_nearest_neighbors > kd_tree_get_rows_size(tree)) {
+        number_of_nearest_neighbors = kd_tree_get_rows_size(tree);
+    }
+    if (number_of_nearest_neighbors > 0) {
+        kd_tree_knn_search_from(tree, root, data_point, k_dimensions,
+                number_of_nearest_neighbors, candidates, &nearest_counter);
+        /*max-heap to ascending distance*/
+        kd_tree_knn_heap_sort(candidates, nearest_counter);
+    }/*end if inputs are valid */
+    return nearest_counter;
+}
+
+/*===========================================================================
+Function        kdtree_knn_ids
+Description:    kdtree_knn() without copying the neighbors. The ids & 
+ *              distances of the neighbors go to the caller's arrays.
+Outputs:        int* out_ids, float* out_dists - number_of_nearest_neighbors
+ *              entries, sorted by ascending distance.
+ *              int - number of neighbors found.
+==========================================================*/
+int kdtree_knn_ids(kdtree_t* self, const float data_point[],
+        int number_of_nearest_neighbors, int* out_ids, float* out_dists) {
+    if (NULL == self || NULL == out_ids || NULL == out_dists) {
+        printf("kdtree_knn_ids(), Error invalid tree or outputs.\n");
+        return 0;
+    }
+    return kd_tree_knn_ids_helper(self, self->_internals->knn_candidate_space,
+            data_point, number_of_nearest_neighbors, out_ids, out_dists);
+}
+
+/*kdtree_knn_ids() into the candidate heap of the tree or of a context*/
+int kd_tree_knn_ids_helper(kdtree_t* tree, kd_tree_knn_candidate* candidates,
+        const float data_point[], int number_of_nearest_neighbors,
+        int* out_ids, float* out_dists) {
+    int nearest_counter = kd_tree_knn_candidates(tree, kdtree_get_root(tree),
+            data_point, kdtree_get_k_dimensions(tree),
+            number_of_nearest_neighbors, candidates);
+    int i = 0;
+
+    for (; i < nearest_counter; i++) {
+        out_ids[i] = candidates[i].node->id;
+        out_dists[i] = sqrt(candidates[i].distance);
+    }
+    return nearest_counter;
+}
+/*===========================================================================
+Function        knn, knn algorithm  using kd-tree.
+Description:    Given a root to traverse and a data point, this function 
+ *              finds all neighbors of that data point
+ *              within a  Euclidean distance or radius, see 
+ *              kd_tree_radius_search().
+Inputs:         
+Outputs:        int - number of neighbors found, the neighbors are copied to
+ *              node_knn_result_space sorted by ascending distance.
+References:     Foundations of Multidimensional and Metric Data Structures
+ *              By Hanan Samet Chapter 4 
+==========================================================*/
+int
+kd_tree_knn_based_on_radius_helper(kdtree_t* tree, kd_tree_node* root,
+        const float data_point[],
+        const int k_dimensions,
+        float range_from_data_point) {
+    kd_tree_node* node_knn_result_space =
+            tree->_internals->node_knn_result_space;
+    kd_tree_knn_candidate* candidates = tree->_internals->knn_candidate_space;
+    int nearest_counter = kd_tree_radius_candidates(tree, root, data_point,
+            k_dimensions, range_from_data_point, candidates);
+    int i = 0;
+
+    for (; i < nearest_counter; i++) {
+        memcpy(node_knn_result_space[i].dataset,
+                candidates[i].node->dataset,
+                sizeof (float)*k_dimensions);
+        node_knn_result_space[i].id = candidates[i].node->id;
+        /*sqrt only for the results returned*/
+        node_knn_result_space[i].distance_to_neighbor =
+                sqrt(candidates[i].distance);
+    }
+    return nearest_counter;
+}/*end function */
+
+/*===========================================================================
+Function        kd_tree_radius_candidates
+Description:    all neighbors within range_from_data_point of data_point, see
+ *              kd_tree_radius_search(). 
+Inputs:         candidates - max_rows entries, see kd_tree_knn_candidates().
+Outputs:        int - number of neighbors found, the neighbors are in 
+ *              candidates sorted by ascending squared distance.
+==========================================================*/
+int kd_tree_radius_candidates(kdtree_t* tree, kd_tree_node* root,
+        const float data_point[],
+        const int k_dimensions,
+        float range_from_data_point, kd_tree_knn_candidate* candidates) {
+    int nearest_counter = 0;
+
+    if (range_from_data_point >= 0) {
+        kd_tree_radius_search_from(tree, root, data_point, k_dimensions,
+                range_from_data_point * range_from_data_point, candidates,
+                &nearest_counter);
+        qsort(candidates, nearest_counter, sizeof (kd_tree_knn_candidate),
+                kd_tree_knn_candidate_compare);
+    }/*end if inputs are valid */
+    return nearest_counter;
+}
+
+/*===========================================================================
+Function        kdtree_radius_search
+Description:    kdtree_knn_based_on_radius() without copying the neighbors. 
+ *              The ids & distances of the max_nn nearest neighbors within 
+ *              radius (a distance, not squared) go to the caller's arrays.
+Outputs:        int* indices, float* dists - max_nn entries, sorted by 
+ *              ascending distance.
+ *              int - number of neighbors written, at most max_nn.
+==========================================================*/
+int kdtree_radius_search(kdtree_t* self, const float* query, int* indices,
+        float* dists, int max_nn, float radius) {
+    if (NULL == self || NULL == indices || NULL == dists || max_nn < 0) {
+        printf("kdtree_radius_search(), Error invalid tree or outputs.\n");
+        return 0;
+    }
+    return kd_tree_radius_search_helper(self,
+            self->_internals->knn_candidate_space, query, indices, dists,
+            max_nn, radius);
+}
+
+/*kdtree_radius_search() into the candidate list of the tree or of a 
+ context*/
+int kd_tree_radius_search_helper(kdtree_t* tree,
+        kd_tree_knn_candidate* candidates, const float* query, int* indices,
+        float* dists, int max_nn, float radius) {
+    int nearest_counter = kd_tree_radius_candidates(tree,
+            kdtree_get_root(tree), query, kdtree_get_k_dimensions(tree),
+            radius, candidates);
+    int i = 0;
+
+    if (nearest_counter > max_nn) {
+        nearest_counter = max_nn;
+    }
+    for (; i < nearest_counter; i++) {
+        indices[i] = candidates[i].node->id;
+        dists[i] = sqrt(candidates[i].distance);
+    }
+    return nearest_counter;
+}
+
+/*=============================================================================
+Function        kdtree_context_alloc, kdtree_context_free
+Description:    allocates & frees the query scratch of one thread, see 
+ *              kdtree_knn_context().
+==========================================================*/
+kdtree_context_t* kdtree_context_alloc(kdtree_t* self) {
+    kdtree_context_t* context = NULL;
+
+    if (NULL == self) {
+        printf("kdtree_context_alloc(), Error invalid tree.\n");
+        return NULL;
+    }
+    context = (kdtree_context_t*) calloc(1, sizeof (kdtree_context_t));
+    if (NULL != context) {
+        context->rows = kd_tree_get_rows_size(self);
+        context->candidates = (kd_tree_knn_candidate*) malloc(
+                sizeof (kd_tree_knn_candidate)*context->rows);
+        context->tree = self;
+        context->reader = -1;
+    }
+    if (NULL == context || NULL == context->candidates) {
+        printf("kdtree_context_alloc(), Error could not allocate the "
+                "candidate heap.\n");
+        kdtree_context_free(context);
+        return NULL;
+    }
+    return context;
+}
+
+void kdtree_context_free(kdtree_context_t* context) {
+    if (NULL != context) {
+        if (context->reader >= 0) {
+            __atomic_store_n(
+                    &context->tree->_internals->reader_used[context->reader],
+                    0, __ATOMIC_RELEASE);
+        }
+        free(context->candidates);
+        free(context);
+    }
+}
+
+/*=============================================================================
+Function        kdtree_knn_context, kdtree_radius_search_context
+Description:    kdtree_knn_ids() & kdtree_radius_search() into the scratch of
+ *              context. Nothing is written to the tree.
+==========================================================*/
+int kdtree_knn_context(kdtree_t* self, kdtree_context_t* context,
+        const float data_point[], int number_of_nearest_neighbors,
+        int* out_ids, float* out_dists) {
+    if (NULL == self || NULL == context ||
+            context->rows < kd_tree_get_rows_size(self) ||
+            NULL == out_ids || NULL == out_dists) {
+        printf("kdtree_knn_context(), Error invalid tree, context or "
+                "outputs.\n");
+        return 0;
+    }
+    return kd_tree_knn_ids_helper(self, context->candidates, data_point,
+            number_of_nearest_neighbors, out_ids, out_dists);
+}
+
+int kdtree_radius_search_context(kdtree_t* self, kdtree_context_t* context,
+        const float* query, int* indices, float* dists, int max_nn,
+        float radius) {
+    if (NULL == self || NULL == context ||
+            context->rows < kd_tree_get_rows_size(self) ||
+            NULL == indices || NULL == dists || max_nn < 0) {
+        printf("kdtree_radius_search_context(), Error invalid tree, context "
+                "or outputs.\n");
+        return 0;
+    }
+    return kd_tree_radius_search_helper(self, context->candidates, query,
+            indices, dists, max_nn, radius);
+}
+
+/*=============================================================================
+Function        kdtree_publish
+Description:    the snapshot of kdtree_freeze() becomes the new version: it 
+ *              takes the snapshot arrays, no copy, & gathers the ids. Then 
+ *              an atomic exchange of published, the epoch advances & the 
+ *              replaced version is retired with the epoch it was current in.
+ *              A reader that can still hold it pinned that epoch or an older
+ *              one, see kd_tree_pin_version(). An unchanged tree keeps its 
+ *              version. Single writer, like every mutator.
+Output:         number of the published version, 0 on error.
+References:     K. Fraser, 2004, Practical lock-freedom, epoch based 
+ *              reclamation.
+==========================================================*/
+unsigned long kdtree_publish(kdtree_t* self)
 {
-    float total_distance = 0;
-    float distance = 0;
+    kdtree_internals* internals = NULL;
+    kd_tree_version* version = NULL;
+    kd_tree_version* replaced = NULL;
+    int size = 0;
     int i = 0;
-    int size = k_dimensions;
+
+    if (NULL == self)
+    {
+        printf("kdtree_publish(), Error invalid tree.\n");
+        return 0;
+    }
+    internals = self->_internals;
+    if (internals->kd_tree_allow_update)
+    {
+        kd_tree_flush_buffer(self);
+    }
+    if (NULL != internals->published && internals->published_current)
+    {
+        return internals->published->number;
+    }
+    if (!internals->snapshot_valid)
+    {
+        kdtree_freeze(self);
+    }
+    size = internals->snapshot_size;
+    version = (kd_tree_version*) calloc(1, sizeof (kd_tree_version));
+    if (NULL != version)
+    {
+        /*at least one row, an empty tree is published too*/
+        version->ids = (int*) malloc(sizeof (int)*(size + 1));
+    }
+    if (!internals->snapshot_valid || NULL == version ||
+            NULL == version->ids)
+    {
+        printf("kdtree_publish(), Error could not build the version.\n");
+        kd_tree_free_version(version);
+        return 0;
+    }
     for (; i < size; i++)
     {
-        distance = values_1[i] - values_2[i];
-        total_distance = total_distance + (distance * distance);
-        /*Note: we actually need calculate Euclidean & the "Manhattan
-         * distance/Manhattan norm" will NOT be useful since the 
-         * knn_based_radious() is radius search, therefore actual distance is 
-         needed. 
-         */
+        version->ids[i] =
+                internals->node_space[internals->snapshot_slots[i]].id;
+    }
+    /*the tree keeps searching the arrays until it changes, its next 
+     kdtree_freeze() allocates new ones*/
+    version->coordinates = internals->snapshot_coordinates;
+    version->split_dimensions = internals->snapshot_split_dimensions;
+    internals->snapshot_shared = 1;
+    internals->published_current = 1;
+    version->size = size;
+    version->number = NULL != internals->published ?
+            internals->published->number + 1 : 1;
+    replaced = __atomic_exchange_n(&internals->published, version,
+            __ATOMIC_SEQ_CST);
+    if (NULL != replaced)
+    {
+        replaced->retired = __atomic_fetch_add(&internals->epoch, 1,
+                __ATOMIC_SEQ_CST);
+        replaced->next = internals->retired_versions;
+        internals->retired_versions = replaced;
+    }
+    kd_tree_reclaim_versions(self);
+    return version->number;
+}
+
+/*=============================================================================
+Function        kd_tree_reclaim_versions
+Description:    frees the retired versions that no reader can hold: those 
+ *              retired before the oldest epoch pinned right now. Writer only.
+==========================================================*/
+void kd_tree_reclaim_versions(kdtree_t* tree)
+{
+    kdtree_internals* internals = tree->_internals;
+    kd_tree_version** link = &internals->retired_versions;
+    unsigned long oldest = ULONG_MAX;
+    int r = 0;
+
+    for (; r < KD_TREE_MAX_READERS; r++)
+    {
+        unsigned long pinned = __atomic_load_n(&internals->reader_epochs[r],
+                __ATOMIC_SEQ_CST);
+        if (0 != pinned && pinned < oldest)
+        {
+            oldest = pinned;
+        }
+    }
+    while (NULL != *link)
+    {
+        kd_tree_version* version = *link;
+        if (version->retired < oldest)
+        {
+            *link = version->next;
+            kd_tree_free_version(version);
+        }
+        else
+        {
+            link = &version->next;
+        }
+    }
+}
+
+void kd_tree_free_version(kd_tree_version* version)
+{
+    if (NULL != version)
+    {
+        free(version->coordinates);
+        free(version->split_dimensions);
+        free(version->ids);
+        free(version);
+    }
+}
+
+/*frees the published & the retired versions, no reader may run*/
+void kd_tree_free_versions(kdtree_t* tree)
+{
+    kdtree_internals* internals = tree->_internals;
+
+    while (NULL != internals->retired_versions)
+    {
+        kd_tree_version* next = internals->retired_versions->next;
+        kd_tree_free_version(internals->retired_versions);
+        internals->retired_versions = next;
+    }
+    kd_tree_free_version(internals->published);
+    internals->published = NULL;
+    internals->published_current = 0;
+    /*the arrays of the tree's snapshot were freed with the version*/
+    if (internals->snapshot_shared)
+    {
+        internals->snapshot_coordinates = NULL;
+        internals->snapshot_split_dimensions = NULL;
+        internals->snapshot_shared = 0;
+        internals->snapshot_valid = 0;
+    }
+}
 
-    }
+/*=============================================================================
+Function        kd_tree_pin_version, kd_tree_unpin_version
+Description:    a reader pins the current epoch in its slot before it loads 
+ *              published. If the writer replaced that version since, it 
+ *              retired it with an epoch >= the pinned one, so 
+ *              kd_tree_reclaim_versions() keeps it until the reader unpins.
+ *              Sequentially consistent, the store of the epoch may not pass
+ *              the load of published. Lock free, O(1).
+==========================================================*/
+kd_tree_version* kd_tree_pin_version(kdtree_t* tree, kdtree_context_t* context)
+{
+    kdtree_internals* internals = tree->_internals;
 
-    return sqrt (total_distance);
+    __atomic_store_n(&internals->reader_epochs[context->reader],
+            __atomic_load_n(&internals->epoch, __ATOMIC_SEQ_CST),
+            __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&internals->published, __ATOMIC_SEQ_CST);
 }
 
-/*===========================================================================
-Function        knn algorithm to find N nearest  neighbors. 
-Description:    Given a root to traverse and a data point, this function 
- *              attempts to find nearest neighbors to that data point
- *              within a specific Euclidean distance or radius.
-Inputs:         tree * root - tree root which is traversed n order to 
- *              attempt to find the data[].
- *              float data_point[] - query point is as search parameter. 
- *              int depth - current dimension used for comparison. Should be 0. 
- *              int k_dimensions - number of  features 
-                int number_of_nearest_neighbors - desired number of results
- *              int sort_result - should results be sorted. 0  is false any
- *              other number is true.  
-Outputs:        int - number of neighbors found. 
- *              tree** n_nearests - pointer to array of points of type
- *              tree that represent the nearest neighbors.
-References:     Foundations of Multidimensional and Metric Data Structures
- *              By Hanan Samet Chapter 4 
-Notes:          This implementation is O(N) running time. Although the tree
- *              is traversed  using kd-tree which is O(log N) in complexity
- *              we are going through all tree nodes and not actually search but 
- *              calculating all distances away from our point of interest,
- *              hence it becomes O(N) traversal. Use friendly wrapper to knn().
-==========================================================*/
-int
-kd_tree_knn(kd_tree_node* const root, const float data_point[],
-            int number_of_nearest_neighbors)
+void kd_tree_unpin_version(kdtree_t* tree, kdtree_context_t* context)
 {
-    return kd_tree_knn_helper(root,data_point,kd_tree_get_k_dimensions(),
-               number_of_nearest_neighbors);
+    __atomic_store_n(&tree->_internals->reader_epochs[context->reader], 0,
+            __ATOMIC_RELEASE);
 }
 
-/*===========================================================================
-Function        knn, knn algorithm  using kd-tree.
-Description:    Given a root to traverse and a data point, this function 
- *              attempts to find nearest neighbors to that data point
- *              using Euclidean distance.
-Inputs:         
-Outputs:
-References:     Foundations of Multidimensional and Metric Data Structures
- *              By Hanan Samet Chapter 4 
-Notes:          This implementation is O(log N) running time.The tree
- *              is traversed  using kd-tree which is O(log N) in complexity
- *              we are calculating all distances away from our point of interest.
- TODO:          We can further optimize using IncNearest Algorithm 
-                Hanan Samet Chapter 4  
+/*=============================================================================
+Function        kd_tree_version_knn_search, kd_tree_version_radius_search
+Description:    kd_tree_snapshot_knn_search() & kd_tree_snapshot_radius_search()
+ *              over a published version. Candidates hold the position.
+Inputs:         position - subtree root, none if >= size of the version.
 ==========================================================*/
-int kd_tree_knn_helper(kd_tree_node* const root, const float data_point[],
-        const int k_dimensions,
-        int number_of_nearest_neighbors) {
+void kd_tree_version_knn_search(kd_tree_version* version, int position,
+        const float data_point[], const int k_dimensions, int capacity,
+        kd_tree_knn_candidate* heap, int* size)
+{
+    kd_tree_knn_candidate candidate;
+    const float* row = NULL;
+    int dimension = 0;
+    float plane_distance = 0.0f;
 
-    int nearest_counter = 0;
-    int heap_index = 0;
-    kd_tree_node* current = NULL;
-    size_t cd = 0;
-    int depth = 0;
-    float median = 0.0f;
+    if (position >= version->size) {
+        return;
+    }
+    row = version->coordinates + (size_t) position * k_dimensions;
+    candidate.node = NULL;
+    candidate.distance = kd_tree_n_dimensional_squared_euclidean(data_point,
+            row, k_dimensions);
+    candidate.position = position;
+    kd_tree_knn_heap_offer(heap, size, capacity, &candidate);
+    dimension = version->split_dimensions[position];
+    plane_distance = data_point[dimension] - row[dimension];
+    kd_tree_version_knn_search(version,
+            2 * position + (plane_distance < 0 ? 1 : 2), data_point,
+            k_dimensions, capacity, heap, size);
+    if (*size < capacity ||
+            plane_distance * plane_distance < heap[0].distance) {
+        kd_tree_version_knn_search(version,
+                2 * position + (plane_distance < 0 ? 2 : 1), data_point,
+                k_dimensions, capacity, heap, size);
+    }
+}
+
+void kd_tree_version_radius_search(kd_tree_version* version, int position,
+        const float data_point[], const int k_dimensions, float squared_range,
+        kd_tree_knn_candidate* found, int* size)
+{
+    const float* row = NULL;
+    int dimension = 0;
     float distance = 0.0f;
-    if (root != NULL) {
-        /*init result heap*/
-        kd_tree_init_node_knn_result_heap(&node_knn_result_space,
-                kd_tree_get_k_dimensions());
-        /*set to current pointer*/
-        current = root;
-        /*while current is NOT null*/
-        while (!is_empty_node(current, k_dimensions)) {
-                /*CALCULATE DISTANCE*/
-                distance=kd_tree_n_dimensional_euclidean(data_point,
-                        current->dataset,
-                        k_dimensions);
-                /*we will simulate a priority queue- therefore if array is NOT full*/
-                if (heap_index < kd_tree_get_rows_size()) {
-                    /*insert in queue*/
-                    /*insert data in heap by copying memory*/
-                    memcpy(node_knn_result_space[heap_index].dataset, 
-                            current->dataset,
-                            sizeof (float)*k_dimensions);
-                    node_knn_result_space[heap_index].distance_to_neighbor = 
-                            distance;
-                    heap_index++;
-                } else {
-                    /*sort ascending*/
-                    insertion_sort_based_on_distance2(node_knn_result_space,
-                            nearest_counter);
-                    /*is the smallest distance greater than current distance?*/
-                    if (node_knn_result_space[0].distance_to_neighbor > 
-                            distance) {
-                        /*insert in array at the top, index=0*/
-                        /*insert data in heap by copying memory*/
-                        memcpy(node_knn_result_space[0].dataset, 
-                                current->dataset,
-                                sizeof (float)*k_dimensions);
-                        node_knn_result_space[0].distance_to_neighbor = 
-                                distance;
+    float plane_distance = 0.0f;
 
-                    }
-                }
-            
-            /* Calculate dimension (cd) of comparison */
-            cd = depth % k_dimensions;
-            /*using modula operator cycle through all dimensions */
-            median = kd_tree_get_column_median(cd);
-            //printf("kd_tree_add_record.(), median=%f\n",median);
-            /* left or right subtree*/
-
-            if (data_point[cd] < median) {
-                current = current->left;
+    if (position >= version->size) {
+        return;
+    }
+    row = version->coordinates + (size_t) position * k_dimensions;
+    distance = kd_tree_n_dimensional_squared_euclidean(data_point, row,
+            k_dimensions);
+    if (distance <= squared_range) {
+        found[*size].node = NULL;
+        found[*size].distance = distance;
+        found[*size].position = position;
+        (*size)++;
+    }
+    dimension = version->split_dimensions[position];
+    plane_distance = data_point[dimension] - row[dimension];
+    if (plane_distance < 0 ||
+            plane_distance * plane_distance <= squared_range) {
+        kd_tree_version_radius_search(version, 2 * position + 1, data_point,
+                k_dimensions, squared_range, found, size);
+    }
+    if (plane_distance >= 0 ||
+            plane_distance * plane_distance <= squared_range) {
+        kd_tree_version_radius_search(version, 2 * position + 2, data_point,
+                k_dimensions, squared_range, found, size);
+    }
+}
 
-            } else {
-                current = current->right;
+/*reader slot of context, claimed by its first published query. -1 if all
+KD_TREE_MAX_READERS slots are taken*/
+int kd_tree_claim_reader(kdtree_t* tree, kdtree_context_t* context)
+{
+    int r = 0;
 
-            }
-            depth++;
-        }/*end while*/
-        /*END TRAVERSE */
-        nearest_counter = heap_index;
-     
-        /*if there are enough tree nodes to warrant a sort */
-        if (nearest_counter > 0) {
-            /* sort */
-            insertion_sort_based_on_distance2(node_knn_result_space,
-                    nearest_counter);
+    for (; r < KD_TREE_MAX_READERS && context->reader < 0; r++) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&tree->_internals->reader_used[r],
+                &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            context->reader = r;
         }
-
-    }/*end if inputs are valid */
-
-    /*if actual neighbors was less than requested*/
-    if (nearest_counter < number_of_nearest_neighbors) {
-        number_of_nearest_neighbors = nearest_counter;
     }
-
-    return number_of_nearest_neighbors;
-
+    return context->reader;
 }
-/*===========================================================================
-Function        knn, knn algorithm  using kd-tree.
-Description:    Given a root to traverse and a data point, this function 
- *              attempts to find nearest neighbors to that data point
- *              within a  Euclidean distance or radius.
-Inputs:         
-Outputs:
-References:     Foundations of Multidimensional and Metric Data Structures
- *              By Hanan Samet Chapter 4 
-Notes:          This implementation is O(log N) running time.The tree
- *              is traversed  using kd-tree which is O(log N) in complexity
- *              we are calculating all distances away from our point of interest.
- TODO:          We can further optimize using IncNearest Algorithm 
-                Hanan Samet Chapter 4 
+
+/*=============================================================================
+Function        kdtree_knn_published, kdtree_radius_search_published
+Description:    kdtree_knn_context() & kdtree_radius_search_context() of the 
+ *              published version, pinned for the whole search.
 ==========================================================*/
-int
-kd_tree_knn_based_on_radius_helper(kd_tree_node* root, const float data_point[],
-        const int k_dimensions,
-        float range_from_data_point) {
+int kdtree_knn_published(kdtree_t* self, kdtree_context_t* context,
+        const float data_point[], int number_of_nearest_neighbors,
+        int* out_ids, float* out_dists)
+{
+    kd_tree_version* version = NULL;
+    kd_tree_knn_candidate* candidates = NULL;
     int nearest_counter = 0;
-    int heap_index = 0;
-    kd_tree_node* current = NULL;
-    size_t cd = 0;
-    int depth = 0;
-    float median = 0.0f;
-    float distance = 0.0f;
-    if (root != NULL) {
-        /*init result heap*/
-        kd_tree_init_node_knn_result_heap(&node_knn_result_space,
-                kd_tree_get_k_dimensions());
-        /*set to current pointer*/
-        current = root;
-        /*while current is NOT null*/
-        while (!is_empty_node(current, k_dimensions)) {
-            /*CALCULATE DISTANCE*/
-            distance = kd_tree_n_dimensional_euclidean(data_point,
-                    current->dataset,
-                    k_dimensions);
-            if (distance <= range_from_data_point) {
-                  /*we will simulate a priority queue- therefore if array is NOT full*/
-                if (heap_index < kd_tree_get_rows_size()) {
-                    /*insert in queue*/
-                    /*insert data in heap by copying memory*/
-                    memcpy(node_knn_result_space[heap_index].dataset, 
-                            current->dataset,
-                            sizeof (float)*k_dimensions);
-                    node_knn_result_space[heap_index].distance_to_neighbor = 
-                            distance;
-                    heap_index++;
-                } else {
-                    /*sort ascending*/
-                    insertion_sort_based_on_distance2(node_knn_result_space,
-                            nearest_counter);
-                    /*is the smallest distance greater than current distance?*/
-                    if (node_knn_result_space[0].distance_to_neighbor > 
-                            distance) {
-                        /*insert in array at the top, index=0*/
-                        /*insert data in heap by copying memory*/
-                        memcpy(node_knn_result_space[0].dataset, 
-                               current->dataset,
-                               sizeof (float)*k_dimensions);
-                        node_knn_result_space[0].distance_to_neighbor = 
-                        distance;
-
-                    }
-                }
-            }
-            /* Calculate dimension (cd) of comparison */
-            cd = depth % k_dimensions;
-            /*using modula operator cycle through all dimensions */
-            median = kd_tree_get_column_median(cd);
-            //printf("kd_tree_add_record.(), median=%f\n",median);
-            /* left or right subtree*/
-
-            if (data_point[cd] < median) {
-                current = current->left;
+    int i = 0;
 
-            } else {
-                current = current->right;
+    if (NULL == self || NULL == context || context->tree != self ||
+            NULL == out_ids || NULL == out_dists)
+    {
+        printf("kdtree_knn_published(), Error invalid tree, context or "
+                "outputs.\n");
+        return 0;
+    }
+    if (kd_tree_claim_reader(self, context) < 0)
+    {
+        printf("kdtree_knn_published(), Error KD_TREE_MAX_READERS contexts "
+                "read already.\n");
+        return 0;
+    }
+    candidates = context->candidates;
+    version = kd_tree_pin_version(self, context);
+    if (NULL != version)
+    {
+        if (number_of_nearest_neighbors > version->size)
+        {
+            number_of_nearest_neighbors = version->size;
+        }
+        if (number_of_nearest_neighbors > 0)
+        {
+            kd_tree_version_knn_search(version, 0, data_point,
+                    kdtree_get_k_dimensions(self),
+                    number_of_nearest_neighbors, candidates,
+                    &nearest_counter);
+            kd_tree_knn_heap_sort(candidates, nearest_counter);
+        }
+        for (; i < nearest_counter; i++)
+        {
+            out_ids[i] = version->ids[candidates[i].position];
+            out_dists[i] = sqrt(candidates[i].distance);
+        }
+        context->version = version->number;
+    }
+    kd_tree_unpin_version(self, context);
+    return nearest_counter;
+}
 
-            }
-            depth++;
-        }/*end while*/
-        /*END TRAVERSE */
-        nearest_counter = heap_index;
+int kdtree_radius_search_published(kdtree_t* self, kdtree_context_t* context,
+        const float* query, int* indices, float* dists, int max_nn,
+        float radius)
+{
+    kd_tree_version* version = NULL;
+    kd_tree_knn_candidate* candidates = NULL;
+    int nearest_counter = 0;
+    int i = 0;
 
-        /*if there are enough tree nodes to warrant a sort */
-        if (nearest_counter > 0) {
-            /* sort */
-            insertion_sort_based_on_distance2(node_knn_result_space,
-                    nearest_counter);
+    if (NULL == self || NULL == context || context->tree != self ||
+            NULL == indices || NULL == dists || max_nn < 0)
+    {
+        printf("kdtree_radius_search_published(), Error invalid tree, "
+                "context or outputs.\n");
+        return 0;
+    }
+    if (kd_tree_claim_reader(self, context) < 0)
+    {
+        printf("kdtree_radius_search_published(), Error KD_TREE_MAX_READERS "
+                "contexts read already.\n");
+        return 0;
+    }
+    candidates = context->candidates;
+    version = kd_tree_pin_version(self, context);
+    if (NULL != version && radius >= 0)
+    {
+        kd_tree_version_radius_search(version, 0, query,
+                kdtree_get_k_dimensions(self), radius * radius, candidates,
+                &nearest_counter);
+        qsort(candidates, nearest_counter, sizeof (kd_tree_knn_candidate),
+                kd_tree_knn_candidate_compare);
+        if (nearest_counter > max_nn)
+        {
+            nearest_counter = max_nn;
         }
-
-    }/*end if inputs are valid */
+        for (; i < nearest_counter; i++)
+        {
+            indices[i] = version->ids[candidates[i].position];
+            dists[i] = sqrt(candidates[i].distance);
+        }
+    }
+    if (NULL != version)
+    {
+        context->version = version->number;
+    }
+    kd_tree_unpin_version(self, context);
     return nearest_counter;
-}/*end function */
+}
 
 
 int
@@ -1184,10 +4923,22 @@ kd_tree_knn_based_on_radius (kd_tree_node* root,
                     const float data_point[],
                     float range_from_data_point)
 {
-    return kd_tree_knn_based_on_radius_helper (root,data_point, 
+    return kd_tree_knn_based_on_radius_helper (kd_tree_get_kd_tree(), root,
+                    data_point, 
                     kd_tree_get_k_dimensions(), 
                     range_from_data_point);
 }
+
+int
+kdtree_knn_based_on_radius (kdtree_t* self, 
+                    const float data_point[],
+                    float range_from_data_point)
+{
+    return kd_tree_knn_based_on_radius_helper (self, kdtree_get_root(self),
+                    data_point, 
+                    kdtree_get_k_dimensions(self), 
+                    range_from_data_point);
+}
 /*===========================================================================
 Function        delete_data_point
 Description:    Given a data_point (query point) attempts to delete
@@ -1202,13 +4953,18 @@ References:     https://www.geeksforgeeks.org/k-dimensional-tree-set-3-delete/
 ==========================================================*/
 void
 kd_tree_delete_data_point(kd_tree_node* root, const float data_point []) {
-
-    if (NULL != kd_tree_get_kd_tree()) {
-        if (kd_tree_get_kd_tree()->_internals->kd_tree_allow_update) {
-            kd_tree_delete_data_point_helper(root,
-                    data_point,
-                    0,
-                    kd_tree_get_k_dimensions());
+    kdtree_t* tree = kd_tree_get_kd_tree();
+
+    if (NULL != tree) {
+        if (tree->_internals->kd_tree_allow_update) {
+            root = kd_tree_sync_background(tree, root);
+            if (root != kdtree_get_root(tree) ||
+                    !kd_tree_buffer_delete(tree, data_point)) {
+                kd_tree_delete_data_point_helper(tree, root,
+                        data_point,
+                        0,
+                        kdtree_get_k_dimensions(tree));
+            }
         } else {
             printf("kd_tree_delete_point(),"
                     " kd_tree is locked for rebuild!");
@@ -1217,6 +4973,28 @@ kd_tree_delete_data_point(kd_tree_node* root, const float data_point []) {
 
 }
 
+/*mutator*/
+int
+kdtree_delete_data_point(kdtree_t* self, const float data_point []) {
+    int flag = 0;
+
+    if (NULL != self) {
+        if (self->_internals->kd_tree_allow_update) {
+            kd_tree_sync_background(self, NULL);
+            flag = kd_tree_buffer_delete(self, data_point) ||
+                    kd_tree_delete_data_point_helper(self,
+                    kdtree_get_root(self),
+                    data_point,
+                    0,
+                    kdtree_get_k_dimensions(self));
+        } else {
+            printf("kdtree_delete_data_point(),"
+                    " kd_tree is locked for rebuild or a read only index!");
+        }
+    }
+    return flag;
+}
+
 
 
 
@@ -1236,15 +5014,19 @@ References:     https://www.geeksforgeeks.org/k-dimensional-tree-set-3-delete/
 // is_empty_node(root, k_dimensions))
 // Test : https://www.geeksforgeeks.org/binary-search-tree-set-3-iterative-delete/
 
-int kd_tree_delete_data_point_helper(kd_tree_node* root, float const
-        data_point [], int depth, const int k_dimensions) {
-    /*calculate  current dimension */
-    size_t cd = 0;
-    float median = 0.0;
+int kd_tree_delete_data_point_helper(kdtree_t* tree, kd_tree_node* root,
+        float const data_point [], int depth, const int k_dimensions) {
     kd_tree_node* current = NULL;
     kd_tree_node* parent = NULL;
     int flag =0; 
+    int index = -1;
 
+    /*a forest stores its points packed, see kdtree_set_forest()*/
+    if (tree->_internals->forest) {
+        printf("kd_tree_delete_data_point_helper(), Error a forest cannot "
+                "delete or update points.\n");
+        return 0;
+    }
     if (!is_empty_node(root, k_dimensions)) {
 
         current = root;
@@ -1252,7 +5034,8 @@ int kd_tree_delete_data_point_helper(kd_tree_node* root, float const
        //while loop to find target node for deletion. 
         while (NULL != current) {
            //if found then break;  
-           if (kd_tree_points_equal(current->dataset, data_point, k_dimensions)) \
+           index = kd_tree_bucket_index(current, data_point, k_dimensions);
+           if (index >= 0) 
                 {
                     break; 
                 }
@@ -1260,146 +5043,81 @@ int kd_tree_delete_data_point_helper(kd_tree_node* root, float const
            else
            {
              parent  = current;
-            /* Calculate current dimension (cd) of comparison */
-            cd = depth % k_dimensions;
-            /*determine current dimension/*/
-            /*by using modula operator we can cycle through all dimensions */
-            /* and decide the left or right subtree*/
-            median = kd_tree_get_column_median(cd);
-            /*printf("kd_tree_delete_data_point(), median=%f\n", median);*/
-            
-            if (data_point[cd] < median) {
+            /*decide the left or right subtree using the split of current*/
+            if (data_point[current->split_dimension] < current->split_value) {
                 current = current->left;
             } else {
                 current = current->right;
             }
-            depth++;
             
            }
 
         }//end while current is NOT null
         
-            //if found. attempt to delete based on Hibbard Algorithm 
-            if (!is_empty_node(current, k_dimensions)) {
-                    //If node has no children
-                if (current->left == NULL && current->right == NULL) {
-                    if (parent != NULL) {
-                        if (parent->left == current) {
-                            parent->left = NULL;
-                        } else {
-                            parent->right = NULL;
-                        }
+            //if found. attempt to delete
+            if (!is_empty_node(current, k_dimensions) &&
+                    current->bucket_size > 1) {
+                /*the bucket keeps its other points*/
+                kd_tree_bucket_remove(tree, current, index);
+                kd_tree_count_delete(current);
+                flag = 1;
+                kd_tree_decrement_current_number_of_kd_tree_nodes(tree);
+            }
+            else if (!is_empty_node(current, k_dimensions)) {
+                /*Splicing a child subtree into the place of current (Hibbard)
+                 moves it one level up, which changes the dimension its nodes
+                 were split on. Instead move the point of a leaf of current's
+                 subtree into current & delete that leaf. The leaf's point 
+                 took the same path as current, so search still finds it.*/
+                kd_tree_node* leaf = current;
+                kd_tree_node* leaf_parent = parent;
+                while (leaf->left != NULL || leaf->right != NULL) {
+                    leaf_parent = leaf;
+                    if (leaf->left != NULL) {
+                        leaf = leaf->left;
+                    } else {
+                        leaf = leaf->right;
                     }
-                   
-                    //DELETE START 
-                    /*special case current is root*/
-                    /*start delete*/
-                    if (NULL != current->dataset) {
-                        int i = 0;
-                        for (; i < k_dimensions; i++) {
-                            current ->dataset[i] = FLT_MAX;
-                        }
+                }
+                if (leaf != current && leaf->bucket_size > 1) {
+                    /*a leaf bucket gives its last point & stays*/
+                    kd_tree_node* donor = leaf + leaf->bucket_size - 1;
+                    memcpy(current->dataset, donor->dataset,
+                            sizeof (float)*k_dimensions);
+                    current->id = donor->id;
+                    kd_tree_bucket_remove(tree, leaf, leaf->bucket_size - 1);
+                    kd_tree_count_delete(leaf);
+                } else {
+                    if (leaf != current) {
+                        memcpy(current->dataset, leaf->dataset,
+                                sizeof (float)*k_dimensions);
+                        current->id = leaf->id;
                     }
-                    current->distance_to_neighbor = FLT_MAX;
-                    current->left = NULL;
-                    current->right = NULL;
-                    //DELETE END
-
-                } 
-                //If current has one child
-                else if ((current->left == NULL && current->right != NULL) || 
-                        (current->left != NULL && current->right == NULL)) {
-                    //If node has a right child 
-                    if (current->right != NULL && current->left == NULL) {
-                          if (parent != NULL) {
-                        if (parent->right == current) {
-                            parent->right = current->right;
-                        } else if (parent->left == current) {
-                            parent->left = current->right;
+                    if (leaf_parent != NULL) {
+                        if (leaf_parent->left == leaf) {
+                            leaf_parent->left = NULL;
+                        } else {
+                            leaf_parent->right = NULL;
                         }
-                          }
-                          else
-                          {
-                        //else special case this is the root 
-                        kd_tree_set_root(current->right); 
-                    
-                          }
+                    } else if (kdtree_get_root(tree) == leaf) {
+                        /*special case current is root*/
+                        kd_tree_set_root(tree, NULL);
                     } 
-                    //If node has a left child
-                    if (current->left != NULL && current->right == NULL) {
-                          if (parent != NULL) {
-                        if (parent->right == current) {
-                            parent->right = current->left;
-                        } else if (parent->left == current) {
-                            parent->left = current->left;
-                        }
-                          }
-                          else
-                          {
-                          
-                        //else special case this is the root 
-                        kd_tree_set_root(current->left); 
-                   
-                          
-                          }
-                    }
+                    kd_tree_count_delete(leaf_parent);
                     //DELETE START 
-                    /*special case current is root*/
-                    /*start delete*/
-                    if (NULL != current ->dataset) {
-                        int i = 0;
-                        for (; i < k_dimensions; i++) {
-                            current ->dataset[i] = FLT_MAX;
-                        }
-                    }
-                    current->distance_to_neighbor = FLT_MAX;
-                    current->left = NULL;
-                    current->right = NULL;
-           
-                    /*end delete*/
+                    kd_tree_release_node(tree, leaf);
                     //DELETE END
-                  
-                }
-                    //If current has two children
-                else {
-                    kd_tree_node* swap_this = current->right;
-                    kd_tree_node* swap_this_prev = current;
-
-                    while (swap_this->left != NULL) {
-                        swap_this_prev = swap_this;
-                        swap_this = swap_this->left;
-                    }
-                    memcpy(current->dataset, swap_this->dataset,
-                            sizeof (float)*k_dimensions);
-
-                    if (swap_this_prev->left == swap_this) {
-                        swap_this_prev->left = swap_this->right;
-                    } else if (swap_this_prev->right == swap_this) {
-                        swap_this_prev->right = swap_this->right;
-                    }
-                    
-                    //DELETE START 
-                    /*special case swap_this is root*/
-                    /*start delete*/
-                    if (NULL != swap_this->dataset) {
-                        int i = 0;
-                        for (; i < k_dimensions; i++) {
-                            swap_this ->dataset[i] = FLT_MAX;
-                        }
-                    }
-                    swap_this->distance_to_neighbor = FLT_MAX;
-                    swap_this->left = NULL;
-                    swap_this->right = NULL;
-                    /*end delete*/
-                 
                 }
                 flag = 1;
                 /* decrement total nodes count */
-                kd_tree_decrement_current_number_of_kd_tree_nodes();
+                kd_tree_decrement_current_number_of_kd_tree_nodes(tree);
             }
 
 
     }
+    if (flag && tree->_internals->background_running) {
+        kd_tree_log_delta(tree, data_point, -1);
+    }
     
     return flag; 
 
@@ -1410,63 +5128,71 @@ int kd_tree_delete_data_point_helper(kd_tree_node* root, float const
 Implementations - memory management  
 ==============================================================================*/
 kdtree_t * kdtree_alloc(int max_rows, int max_cols) {
+    kdtree_t* tree = NULL;
 
     if (max_rows>0 && max_cols>0)
     {
     /*tree*/
-    self = kd_tree_alloc_tree_space();
-    kd_tree_processing_space = kd_tree_alloc_tree_processing_space();
+    tree = kd_tree_alloc_tree_space();
     /*tree internals*/
-    if (NULL != self) {
-        kd_tree_get_tree_space()->_internals = kd_tree_alloc_internals();
-        kd_tree_alloc_tree_processing_space()->_internals =
-                kd_tree_alloc_internals();
+    if (NULL != tree) {
+        tree->_internals = kd_tree_alloc_internals();
+        kd_tree_alloc_tree_processing_space(tree);
+        kd_tree_set_rows_size(tree, max_rows);
+        tree->_internals->k_dimensions = max_cols;
     }
     /*nodes*/
-    kd_tree_alloc_node_space_heap(max_rows,max_cols);
-    kd_tree_alloc_node_processing_space_heap(max_rows,max_cols);
-    kd_tree_alloc_node_knn_result_heap();
+    kd_tree_alloc_node_space_heap(tree, max_rows,max_cols);
+    kd_tree_alloc_node_processing_space_heap(tree, max_rows,max_cols);
+    kd_tree_alloc_node_knn_result_heap(tree);
     /*batch processing*/
-    kd_tree_alloc_batch_processing_heap();
+    kd_tree_alloc_batch_processing_heap(tree);
     /*median*/
-    kd_tree_alloc_columns_median_heap(max_cols);
-    kd_tree_alloc_columns_median_processing_space(max_rows);
+    kd_tree_alloc_columns_median_heap(tree, max_cols);
+    kd_tree_alloc_columns_median_processing_space(tree, max_rows);
+    /*the first tree is the default tree of the legacy kd_tree_* API*/
+    if (NULL == kd_tree_get_kd_tree())
+    {
+        kd_tree_set_kd_tree(tree);
+    }
     }
     else
     {
        printf("kdtree_alloc(), Error max_rows and max_columns need to be"
                "greater than 0.\n");
     }
-    return self;
+    return tree;
 }
 
 void kdtree_init(kdtree_t* self) {
     if (NULL!=self)
     {
+    /*init writes to the coordinates, stop referencing the caller's*/
+    if (NULL != self->_internals)
+    {
+        kd_tree_finish_background_rebuild(self, 1, 0);
+        kdtree_free_index(self);
+        kd_tree_free_buffer(self);
+        kd_tree_free_versions(self);
+    }
     /*initially extra debug is off*/
     self->is_debug_run =0;  
     /*tree*/
     kd_tree_init_tree_space(self);
-    kd_tree_init_tree_space(kd_tree_get_processing_space());
+    kd_tree_init_kdtree_processing_space(kd_tree_get_processing_space(self));
     /*tree internals*/
     kd_tree_init_tree_internals(self);
-    kd_tree_init_tree_internals(kd_tree_get_processing_space());
+    kd_tree_init_tree_internals(kd_tree_get_processing_space(self));
     /*nodes*/
-    kd_tree_init_node_heap(&node_space,
-            kd_tree_get_k_dimensions());
-    kd_tree_init_node_processing_space_heap(&node_processing_space,
-            kd_tree_get_k_dimensions());
-    kd_tree_init_node_knn_result_heap(&node_knn_result_space,
-            kd_tree_get_k_dimensions());
+    kd_tree_init_node_heap(self);
+    kd_tree_init_node_processing_space_heap(self);
+    kd_tree_init_node_knn_result_heap(self);
     /*batch processing*/
-    kd_tree_init_batch_processing_heap(&batch_node_processing_space,
-            kd_tree_get_k_dimensions());
+    kd_tree_init_batch_processing_heap(self);
     /*median*/
-    kd_tree_init_columns_median_heap(&columns_median_space,
-            kd_tree_get_k_dimensions());
+    kd_tree_init_columns_median_heap(self);
     
-    kd_tree_init_columns_median_processing_space(&columns_median_processing_space,
-            kd_tree_get_rows_size());
+    kd_tree_init_columns_median_processing_space(self);
     }
     else
     {
@@ -1477,24 +5203,33 @@ void kdtree_init(kdtree_t* self) {
 }
 
 void kdtree_free(kdtree_t* self) {
+    if (NULL == self)
+    {
+        return;
+    }
+    kd_tree_finish_background_rebuild(self, 1, 0);
+    kd_tree_free_buffer(self);
+    kd_tree_free_versions(self);
     /*median*/
-    kd_tree_free_columns_median_processing_space(&columns_median_processing_space);
-    kd_tree_free_columns_median_space(&columns_median_space); 
-//    if (columns_median_space)
-//    {
-//    free (columns_median_space);
-//    }
+    kd_tree_free_columns_median_processing_space(self);
+    kd_tree_free_columns_median_space(self);
     /*nodes*/
-    kd_tree_free_node_space(&node_space);
-    kd_tree_free_node_processing_space_heap(&node_processing_space);
-    kd_tree_free_node_knn_result_heap(&node_knn_result_space);
-    kd_tree_free_batch_processing_heap(&batch_node_processing_space);
-    /*tree internals*/
+    kd_tree_free_node_space(self);
+    kd_tree_free_node_processing_space_heap(self);
+    kd_tree_free_node_knn_result_heap(self);
+    kd_tree_free_batch_processing_heap(self);
+    /*the legacy API must not point to the freed tree*/
+    if (kd_tree_get_kd_tree() == self)
+    {
+        kd_tree_set_kd_tree(NULL);
+    }
+    /*tree internals, the processing tree owns the second node heap of 
+     background rebuilds*/
+    kd_tree_free_node_space(kd_tree_get_processing_space(self));
+    kd_tree_free_kdtree_processing_space(kd_tree_get_processing_space(self));
     kd_tree_free_internals(self);
-    kd_tree_free_internals(kd_tree_get_processing_space());
     /*tree*/
     kd_tree_free_tree_space(self);
-    kd_tree_free_tree_space(kd_tree_get_processing_space());
 }
 
 /*=============================================================================
@@ -1503,7 +5238,14 @@ Description:
 ==========================================================*/
 struct kdtree_internals* kd_tree_alloc_internals(void)
 {
-    kdtree_internals* internals = calloc(1, sizeof (internals));
+    kdtree_internals* internals = calloc(1, sizeof (kdtree_internals));
+    if (NULL != internals)
+    {
+        pthread_mutex_init(&internals->background_lock, NULL);
+        pthread_cond_init(&internals->background_copy_done, NULL);
+        /*epoch 0 marks a reader that does not read*/
+        internals->epoch = 1;
+    }
     return internals;
 }
  
@@ -1516,14 +5258,26 @@ void kd_tree_init_tree_internals(kdtree_t* tree) {
         tree->_internals->kd_tree_allow_update = 1;
         tree->_internals->previous_tree_size = 0;
         tree->_internals->rebuild_threshold = REBUILD_THRESHOLD;
+        tree->_internals->leaf_size = KD_TREE_LEAF_SIZE;
+        tree->_internals->split_policy = KD_TREE_SPLIT_ROUND_ROBIN;
+        tree->_internals->balance_factor = 0.0f;
         tree->_internals->rebuild_counter = 0; 
+        tree->_internals->partial_rebuild_counter = 0;
+        tree->_internals->forest = 0;
+        memset(tree->_internals->forest_roots, 0,
+                sizeof (tree->_internals->forest_roots));
     }
 }
 
 /*free*/
 void kd_tree_free_internals(kdtree_t* tree) {
     if (NULL != tree && NULL != tree->_internals) {
+        pthread_mutex_destroy(&tree->_internals->background_lock);
+        pthread_cond_destroy(&tree->_internals->background_copy_done);
+        free(tree->_internals->delta_points);
+        free(tree->_internals->delta_ids);
         free(tree->_internals);
+        tree->_internals = NULL;
     }
 }
 
@@ -1532,60 +5286,50 @@ void kd_tree_free_internals(kdtree_t* tree) {
 /*alloc*/
 /*=============================================================================
 Function        kd_tree_alloc_tree_space
-Description:    
+Description:    allocates a new tree.
 
 ==========================================================*/
 kdtree_t*
 kd_tree_alloc_tree_space()
 {
-    if (NULL== self)
-    {
-     self = (kdtree_t*) calloc (1, sizeof (kdtree_t));
-    }
-     return self;
+     kdtree_t* tree = (kdtree_t*) calloc (1, sizeof (kdtree_t));
+     return tree;
 }
 
 /*init*/
 void
-kd_tree_init_tree_space(kdtree_t* self)
+kd_tree_init_tree_space(kdtree_t* tree)
 {
-    if (NULL!= self)
+    if (NULL!= tree)
     {
-     self->_internals = kd_tree_alloc_internals();
+     tree->_root = NULL;
     }
    
 }
 
 /*free*/
-void kd_tree_free_tree_space(kdtree_t* self)
+void kd_tree_free_tree_space(kdtree_t* tree)
 {
      /*reset kd_tree*/
-     free(self);
-     self=NULL;
-}
-
-/*get*/
-kdtree_t* kd_tree_get_tree_space()
-{
-return self; 
+     free(tree);
 }
 
 /*Implementations - kdtree_t processing heap*/
 
 /*=============================================================================
 Function        kdtree_t_alloc_tree_processing_space
-Description:    
+Description:    allocates the processing tree of tree.
 
 ==========================================================*/
 /*alloc*/
-kdtree_t* kd_tree_alloc_tree_processing_space()
+kdtree_t* kd_tree_alloc_tree_processing_space(kdtree_t* tree)
 {
-     if (NULL== kd_tree_processing_space)
+     if (NULL== tree->_internals->processing_space)
     {
-    kd_tree_processing_space = (kdtree_t*) calloc (1, sizeof (kdtree_t));
-    
+    tree->_internals->processing_space = kd_tree_alloc_tree_space();
+    tree->_internals->processing_space->_internals = kd_tree_alloc_internals();
     }
-     return kd_tree_processing_space;
+     return tree->_internals->processing_space;
 }
 
 /*init*/
@@ -1593,22 +5337,43 @@ void kd_tree_init_kdtree_processing_space(kdtree_t* tree)
 {
     if (NULL!=tree)
     {
-       tree->_internals =  kd_tree_alloc_internals();
        tree->_root = NULL; 
     }
-
 }
 /*free*/
 void kd_tree_free_kdtree_processing_space(kdtree_t* tree)
 {
+    kd_tree_free_internals(tree);
     free(tree);
-    tree = NULL; 
 }
 
 /*get*/
-kdtree_t*  kd_tree_get_processing_space()
+kdtree_t*  kd_tree_get_processing_space(kdtree_t* tree)
+{
+    return tree->_internals->processing_space;
+}
+
+/*Implementations - coordinate arenas*/
+/*=============================================================================
+Function        kd_tree_alloc_coordinate_arena 
+Description:    allocates one zeroed, KD_TREE_ARENA_ALIGNMENT aligned block of
+ *              rows x cols floats (row major). A single allocation instead of
+ *              one per node keeps the coordinates of neighboring nodes in the
+ *              same cache lines. Release with free().
+Output:         the arena or NULL if the allocation failed.
+==========================================================*/
+float* kd_tree_alloc_coordinate_arena(int rows, int cols)
 {
-    return kd_tree_processing_space;
+    void* arena = NULL;
+    size_t bytes = (size_t) rows * cols * sizeof (float);
+
+    if (0 != posix_memalign(&arena, KD_TREE_ARENA_ALIGNMENT, bytes)) {
+        printf("kd_tree_alloc_coordinate_arena(), Error could not allocate"
+                " %lu bytes.\n", (unsigned long) bytes);
+        return NULL;
+    }
+    memset(arena, 0, bytes);
+    return (float*) arena;
 }
 
 /*Implementations - node_space heap*/
@@ -1617,65 +5382,93 @@ Function        kd_tree_alloc_node_space_heap
 Description:    pre-allocates fixed heap size  KD_TREE_HEAP_SIZE for kd tree  
  *              data structure.  This method MUST be called before using this
  *              library. 
+ *              The coordinates of all nodes live in one contiguous arena, 
+ *              node i uses row i.
 ==========================================================*/
-void kd_tree_alloc_node_space_heap (int rows, int max_dimensions)
+void kd_tree_alloc_node_space_heap (kdtree_t* tree, int rows,
+        int max_dimensions)
 {
-    node_space =(kd_tree_node*) calloc(rows,
+    kd_tree_node* node_space =(kd_tree_node*) calloc(rows,
             sizeof (kd_tree_node));
+    float* coordinates = kd_tree_alloc_coordinate_arena(rows, max_dimensions);
     
-    kd_tree_set_k_dimensions (max_dimensions);
-    kd_tree_set_rows_size(rows);
     int i = 0;
     for (; i < rows; i++)
     {
-        node_space[i].dataset= (float*) calloc (max_dimensions, sizeof(float)); 
+        node_space[i].dataset= coordinates + (size_t) i * max_dimensions; 
         node_space[i].left = NULL; 
         node_space[i].right = NULL; 
         node_space[i].parent = NULL; 
+        node_space[i].id = -1;
+        node_space[i].bucket_size = 1;
+        node_space[i].subtree_size = 0;
     }
+    tree->_internals->node_space = node_space;
+    tree->_internals->coordinate_space = coordinates;
+    /*at most every slot can be released at once*/
+    tree->_internals->node_free_slots = (int*) calloc(rows, sizeof (int));
+    tree->_internals->node_bump_index = 0;
+    tree->_internals->node_free_count = 0;
+    tree->_internals->next_id = 0;
 }
 /*=============================================================================
 Function        get_pre_allocated_kd_heap
 Description:    Returns available static memory to new_node() function. This
  *              memory represents the kd tree. 
- *              The first fit algorithm ensures this function returns next
- *              available block from tree_space.
+ *              Pool allocator, O(1) per call: slots released by delete are
+ *              reused first (LIFO stack), otherwise the bump index hands out
+ *              the next never used slot of node_space.
  *              Must call init_heap() ONLY once before using this 
  *              function. 
 References:     Mastering the FreeRTOS™ Real Time Kernel page page 29 to 32. 
+Output:         free node or NULL if node_space is exhausted.
 ==========================================================*/
 kd_tree_node*
-get_pre_allocated_kd_tree_node_heap() {
+get_pre_allocated_kd_tree_node_heap(kdtree_t* tree) {
+    kdtree_internals* internals = tree->_internals;
+    kd_tree_node* node_space = internals->node_space;
+
+    if (internals->node_free_count > 0) {
+        internals->node_free_count--;
+        return node_space +
+                internals->node_free_slots[internals->node_free_count];
+    }
+    if (internals->node_bump_index < kd_tree_get_rows_size(tree)) {
+        internals->node_bump_index++;
+        return node_space + internals->node_bump_index - 1;
+    }
+    printf("Error, get_pre_allocated_kd_tree_node_heap() No more heap!");
+
+    return NULL;
+
+}
+
+/*=============================================================================
+Function        kd_tree_release_node
+Description:    Returns a node unlinked by delete to the node_space pool. The
+ *              node is reset to empty (FLT_MAX) & its slot is pushed on the
+ *              free stack, O(1).
+==========================================================*/
+void kd_tree_release_node(kdtree_t* tree, kd_tree_node* node) {
+    kdtree_internals* internals = tree->_internals;
     int i = 0;
-    int c = 0;
-    int success = 0;
-    while (i < kd_tree_get_rows_size() && success!=1) {
-        if (NULL != node_space[i].dataset) {
-            c = 0;
-            //inner loop for data_set 
-            for (; c < kd_tree_get_k_dimensions(); c++) {
-                /*Note:empty memory is set to  FLT_MAX not NULL*/
-                if (node_space[i].dataset[c] ==  FLT_MAX) {
-                    success = 1;
-                    break;
-                }
-                else
-                {
-                    i++;
-                }
-            }//end inner 
             
+    kd_tree_drop_compact(tree);
+    if (NULL != node->dataset) {
+        for (; i < kdtree_get_k_dimensions(tree); i++) {
+            node->dataset[i] = FLT_MAX;
         }
-       
-        
-        
-    }//end while 
-    if (!success) {
-        printf("Error, get_pre_allocated_kd_tree_node_heap() No more heap!");
     }
-    
-    return node_space+i;
-
+    node->distance_to_neighbor = FLT_MAX;
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = NULL;
+    node->id = -1;
+    node->bucket_size = 1;
+    node->subtree_size = 0;
+    internals->node_free_slots[internals->node_free_count] =
+            (int) (node - internals->node_space);
+    internals->node_free_count++;
 }
 
 
@@ -1684,61 +5477,66 @@ Function        init_kd_tree_node_heap
 Description:    initializes the values nodes in kd_tree. Clears the kd tree. 
 
 ==========================================================*/
-void kd_tree_init_node_heap(kd_tree_node** nodes, int max_dimensions)
+void kd_tree_init_node_heap(kdtree_t* tree)
 {
-    if (NULL!=nodes && NULL!=(*nodes))
+    kd_tree_node* nodes = tree->_internals->node_space;
+    if (NULL!=nodes)
     {
-    kd_tree_init_tree_internals(kd_tree_alloc_tree_space());
-    kd_tree_set_k_dimensions (max_dimensions);
+    kd_tree_init_tree_internals(tree);
     
     int i = 0;
     int c=0;
-    for (; i <  kd_tree_get_rows_size(); i++)
+    for (; i <  kd_tree_get_rows_size(tree); i++)
     {
          /*reset  values */
        
-        if (NULL!=(*nodes)[i].dataset)
+        if (NULL!=nodes[i].dataset)
         {
             c=0;
-            for (; c<kd_tree_get_k_dimensions(); c++)
+            for (; c<kdtree_get_k_dimensions(tree); c++)
             {
-                (*nodes)[i].dataset[c] =  FLT_MAX;
+                nodes[i].dataset[c] =  FLT_MAX;
             }
         }   
 
-        (*nodes)[i].distance_to_neighbor= FLT_MAX;
-        (*nodes)[i].left = NULL;
-        (*nodes)[i].right = NULL;
-        (*nodes)[i].parent = NULL; 
-        
-        
+        nodes[i].distance_to_neighbor= FLT_MAX;
+        nodes[i].left = NULL;
+        nodes[i].right = NULL;
+        nodes[i].parent = NULL;
+        nodes[i].id = -1;
+        nodes[i].bucket_size = 1;
+        nodes[i].subtree_size = 0;
     }
 
-      set_current_number_of_kd_tree_nodes(0);
-      kd_tree_set_previous_tree_size(0);
+      kd_tree_drop_compact(tree);
+      tree->_internals->node_bump_index = 0;
+      tree->_internals->next_id = 0;
+      tree->_internals->node_free_count = 0;
+      set_current_number_of_kd_tree_nodes(tree, 0);
+      kd_tree_set_previous_tree_size(tree, 0);
     }
   
 }
 
-void kd_tree_init_node_processing_space_heap(kd_tree_node** nodes, 
-        int max_dimensions) {
-    if (NULL != nodes && NULL != (*nodes)) {
+void kd_tree_init_node_processing_space_heap(kdtree_t* tree) {
+    kd_tree_node* nodes = tree->_internals->node_processing_space;
+    if (NULL != nodes) {
 
-        int rows = kd_tree_get_rows_size() * 2;
+        int rows = kd_tree_get_processing_size(tree);
         int i = 0;
         int c = 0;
         for (; i < rows; i++) {
             /*reset  values */
-            if (NULL != (*nodes)[i].dataset) {
+            if (NULL != nodes[i].dataset) {
                 c = 0;
-                for (; c < kd_tree_get_k_dimensions(); c++) {
-                    (*nodes)[i].dataset[c] = FLT_MAX;
+                for (; c < kdtree_get_k_dimensions(tree); c++) {
+                    nodes[i].dataset[c] = FLT_MAX;
                 }
             }
-            (*nodes)[i].distance_to_neighbor= FLT_MAX;
-            (*nodes)[i].left = NULL;
-            (*nodes)[i].right = NULL;
-            (*nodes)[i].parent = NULL; 
+            nodes[i].distance_to_neighbor= FLT_MAX;
+            nodes[i].left = NULL;
+            nodes[i].right = NULL;
+            nodes[i].parent = NULL;
 
 
         }
@@ -1752,22 +5550,41 @@ Description:   frees all kd_tree_node_space memory. After this call init
  *              MUST BE CALLED.  
 Notes:
 ==========================================================*/
-void kd_tree_free_node_space(kd_tree_node** nodes) {
-    if (NULL != nodes && NULL != (*nodes)) {
+void kd_tree_free_node_space(kdtree_t* tree) {
+    kd_tree_node* nodes = tree->_internals->node_space;
+    if (NULL != nodes) {
         int i = 0;
-        for (; i < kd_tree_get_rows_size(); i++) {
+        for (; i < kd_tree_get_rows_size(tree); i++) {
 
-            free((*nodes)[i].dataset);
-            (*nodes)[i].dataset = NULL;
-            (*nodes)[i].left = NULL;
-            (*nodes)[i].right = NULL;
-            (*nodes)[i].parent = NULL; 
+            nodes[i].dataset = NULL;
+            nodes[i].left = NULL;
+            nodes[i].right = NULL;
+            nodes[i].parent = NULL;
 
         }
 
-        free(*nodes);
-        *nodes = NULL;
+        free(nodes);
+        tree->_internals->node_space = NULL;
     }
+    free(tree->_internals->coordinate_space);
+    tree->_internals->coordinate_space = NULL;
+    free(tree->_internals->node_free_slots);
+    tree->_internals->node_free_slots = NULL;
+    free(tree->_internals->compact_nodes);
+    tree->_internals->compact_nodes = NULL;
+    tree->_internals->compact_valid = 0;
+    /*a published version frees shared arrays*/
+    if (!tree->_internals->snapshot_shared)
+    {
+        free(tree->_internals->snapshot_coordinates);
+        free(tree->_internals->snapshot_split_dimensions);
+    }
+    tree->_internals->snapshot_coordinates = NULL;
+    tree->_internals->snapshot_split_dimensions = NULL;
+    tree->_internals->snapshot_shared = 0;
+    free(tree->_internals->snapshot_slots);
+    tree->_internals->snapshot_slots = NULL;
+    tree->_internals->snapshot_valid = 0;
 }
 
 
@@ -1776,24 +5593,25 @@ Function        kd_tree_init_node_knn_result_heap
 Description:    initializes the values nodes in kd_tree. Clears the kd tree. 
 
 ==========================================================*/
-void kd_tree_init_node_knn_result_heap(kd_tree_node** nodes, int max_dimensions)
+void kd_tree_init_node_knn_result_heap(kdtree_t* tree)
 {
-    if (NULL!=nodes && NULL!=(*nodes))
+    kd_tree_node* nodes = tree->_internals->node_knn_result_space;
+    if (NULL!=nodes)
     {
     int i = 0;
     int c=0;
-    for (; i <  kd_tree_get_rows_size(); i++)
+    for (; i <  kd_tree_get_rows_size(tree); i++)
     {
          /*reset  values */
-        if (NULL!=(*nodes)[i].dataset)
+        if (NULL!=nodes[i].dataset)
         {
             c=0;
-            for (; c<kd_tree_get_k_dimensions(); c++)
+            for (; c<kdtree_get_k_dimensions(tree); c++)
             {
-                (*nodes)[i].dataset[c] =  FLT_MAX;
+                nodes[i].dataset[c] =  FLT_MAX;
             }
         }        
-        (*nodes)[i].distance_to_neighbor= FLT_MAX;
+        nodes[i].distance_to_neighbor= FLT_MAX;
         
         
     }
@@ -1807,22 +5625,26 @@ Description:   frees all kd_tree_node_space memory. After this call init
  *              MUST BE CALLED.  
 Notes:
 ==========================================================*/
-void kd_tree_free_node_knn_result_heap(kd_tree_node** nodes) {
-    if (NULL != nodes && NULL != (*nodes)) {
+void kd_tree_free_node_knn_result_heap(kdtree_t* tree) {
+    kd_tree_node* nodes = tree->_internals->node_knn_result_space;
+    if (NULL != nodes) {
         int i = 0;
-        for (; i < kd_tree_get_rows_size(); i++) {
+        for (; i < kd_tree_get_rows_size(tree); i++) {
 
-            free((*nodes)[i].dataset);
-            (*nodes)[i].dataset = NULL;
-            (*nodes)[i].left = NULL;
-            (*nodes)[i].right = NULL;
-            (*nodes)[i].parent = NULL; 
+            nodes[i].dataset = NULL;
+            nodes[i].left = NULL;
+            nodes[i].right = NULL;
+            nodes[i].parent = NULL;
 
         }
 
-        free(*nodes);
-        *nodes = NULL;
+        free(nodes);
+        tree->_internals->node_knn_result_space = NULL;
     }
+    free(tree->_internals->coordinate_knn_result_space);
+    tree->_internals->coordinate_knn_result_space = NULL;
+    free(tree->_internals->knn_candidate_space);
+    tree->_internals->knn_candidate_space = NULL;
 }
 
 
@@ -1836,37 +5658,43 @@ Description:    pre-allocates fixed processing heap size  KD_TREE_HEAP_SIZE for
  *              neighbors. 
 ==========================================================*/
 void
-kd_tree_alloc_node_processing_space_heap(int rows, int max_dimensions) {
+kd_tree_alloc_node_processing_space_heap(kdtree_t* tree, int rows,
+        int max_dimensions) {
     
     //NOTE: processing heap size is rows*2
     rows = rows * 2; 
-    node_processing_space = (kd_tree_node*) calloc(rows,
+    kd_tree_node* node_processing_space = (kd_tree_node*) calloc(rows,
             sizeof (kd_tree_node));
+    float* coordinates = kd_tree_alloc_coordinate_arena(rows, max_dimensions);
     int i = 0;
     for (; i < rows; i++) {
        
-         node_processing_space[i].dataset= (float*) calloc (max_dimensions, 
-                 sizeof(float)); 
+         node_processing_space[i].dataset= coordinates + 
+                 (size_t) i * max_dimensions; 
          node_processing_space[i].left = NULL; 
          node_processing_space[i].right = NULL;
          node_processing_space[i].parent = NULL; 
        
     }
+    tree->_internals->node_processing_space = node_processing_space;
+    tree->_internals->coordinate_processing_space = coordinates;
 
 }
 
 
 kd_tree_node*
-get_pre_allocated_processing_heap()
+get_pre_allocated_processing_heap(kdtree_t* tree)
 {
-    int rows = kd_tree_get_rows_size() *2; 
+    kd_tree_node* node_processing_space =
+            tree->_internals->node_processing_space;
+    int rows = kd_tree_get_processing_size(tree);
     int i = 0;
     int c = 0;
     int success = 0;
     for (; i <  rows && success!=1; i++) {
         if (NULL != node_processing_space[i].dataset) {
             c = 0;
-            for (; c < kd_tree_get_k_dimensions(); c++) {
+            for (; c < kdtree_get_k_dimensions(tree); c++) {
                 /*Note:empty memory is set to  FLT_MAX not NULL*/
                 if (node_processing_space[i].dataset[c] ==  FLT_MAX) {
                     success = 1;
@@ -1887,59 +5715,68 @@ Description:   frees all node_processing_space_heap memory. After this call init
  *              MUST BE CALLED.  
 Notes:
 ==========================================================*/
-void kd_tree_free_node_processing_space_heap(kd_tree_node** nodes) {
-    if (NULL != nodes && NULL != (*nodes)) {
-        int rows = kd_tree_get_rows_size() *2;
+void kd_tree_free_node_processing_space_heap(kdtree_t* tree) {
+    kd_tree_node* nodes = tree->_internals->node_processing_space;
+    if (NULL != nodes) {
+        int rows = kd_tree_get_processing_size(tree);
         int i = 0;
         for (; i < rows; i++) {
 
-            free((*nodes)[i].dataset);
-            (*nodes)[i].dataset = NULL;
-            (*nodes)[i].left = NULL;
-            (*nodes)[i].right = NULL;
-            (*nodes)[i].parent = NULL; 
+            nodes[i].dataset = NULL;
+            nodes[i].left = NULL;
+            nodes[i].right = NULL;
+            nodes[i].parent = NULL;
 
         }
 
-        free(*nodes);
-        *nodes = NULL;
+        free(nodes);
+        tree->_internals->node_processing_space = NULL;
     }
+    free(tree->_internals->coordinate_processing_space);
+    tree->_internals->coordinate_processing_space = NULL;
 }
 
 
 /*knn result space*/
-void kd_tree_alloc_node_knn_result_heap()
+void kd_tree_alloc_node_knn_result_heap(kdtree_t* tree)
 {
    
-    int rows = kd_tree_get_rows_size(); 
-    node_knn_result_space = (kd_tree_node*) calloc(rows,
+    int rows = kd_tree_get_rows_size(tree);
+    int cols = kdtree_get_k_dimensions(tree);
+    kd_tree_node* node_knn_result_space = (kd_tree_node*) calloc(rows,
             sizeof (kd_tree_node));
+    /*a result row is a copy of a node, k_dimensions values not rows*/
+    float* coordinates = kd_tree_alloc_coordinate_arena(rows, cols);
     int i = 0;
     for (; i < rows; i++) {
        
-         node_knn_result_space[i].dataset= (float*) calloc (rows, 
-                 sizeof(float)); 
+         node_knn_result_space[i].dataset= coordinates + (size_t) i * cols; 
          node_knn_result_space[i].left = NULL; 
          node_knn_result_space[i].right = NULL;
          node_knn_result_space[i].parent = NULL; 
        
     }
+    tree->_internals->node_knn_result_space = node_knn_result_space;
+    tree->_internals->coordinate_knn_result_space = coordinates;
+    tree->_internals->knn_candidate_space = (kd_tree_knn_candidate*) calloc(
+            rows, sizeof (kd_tree_knn_candidate));
  
 }
 kd_tree_node*
-get_knn_result_heap()
+get_knn_result_heap(kdtree_t* tree)
 {
-    
+    kd_tree_node* node_knn_result_space =
+            tree->_internals->node_knn_result_space;
     int i = 0;
     int c = 0;
     int success = 0;
-    while (i < kd_tree_get_rows_size() && success!=1) {
+    while (i < kd_tree_get_rows_size(tree) && success!=1) {
         if (NULL != node_knn_result_space[i].dataset) {
             c = 0;
             //inner loop for data_set 
-            for (; c < kd_tree_get_k_dimensions(); c++) {
+            for (; c < kdtree_get_k_dimensions(tree); c++) {
                 /*Note:empty memory is set to  FLT_MAX not NULL*/
-                if (node_space[i].dataset[c] ==  FLT_MAX) {
+                if (node_knn_result_space[i].dataset[c] ==  FLT_MAX) {
                     success = 1;
                     break;
                 }
@@ -1961,35 +5798,42 @@ get_knn_result_heap()
 
 /*Implementations batch processing heap */
 /*alloc*/
-void kd_tree_alloc_batch_processing_heap()
+void kd_tree_alloc_batch_processing_heap(kdtree_t* tree)
 {
    
-    int rows = kd_tree_get_rows_size(); 
-    batch_node_processing_space = (kd_tree_node*) calloc(rows,
+    int rows = kd_tree_get_rows_size(tree);
+    int cols = kdtree_get_k_dimensions(tree);
+    kd_tree_node* batch_node_processing_space = (kd_tree_node*) calloc(rows,
             sizeof (kd_tree_node));
+    /*a batch row is one input point, k_dimensions values not rows*/
+    float* coordinates = kd_tree_alloc_coordinate_arena(rows, cols);
     int i = 0;
     for (; i < rows; i++) {
        
-         batch_node_processing_space[i].dataset= (float*) calloc (rows, 
-                 sizeof(float)); 
+         batch_node_processing_space[i].dataset= coordinates + 
+                 (size_t) i * cols; 
          batch_node_processing_space[i].left = NULL; 
          batch_node_processing_space[i].right = NULL;
          batch_node_processing_space[i].parent = NULL; 
        
     }
+    tree->_internals->batch_node_processing_space = batch_node_processing_space;
+    tree->_internals->coordinate_batch_processing_space = coordinates;
 }
 /*get*/
 kd_tree_node*
-get_kd_tree_batch_processing_heap()
+get_kd_tree_batch_processing_heap(kdtree_t* tree)
 {
-    int rows = kd_tree_get_rows_size();
+    kd_tree_node* batch_node_processing_space =
+            tree->_internals->batch_node_processing_space;
+    int rows = kd_tree_get_rows_size(tree);
     int i = 0;
     int c = 0;
     int success = 0;
     for (; i <  rows && success!=1; i++) {
         if (NULL != batch_node_processing_space[i].dataset) {
             c = 0;
-            for (; c < kd_tree_get_k_dimensions(); c++) {
+            for (; c < kdtree_get_k_dimensions(tree); c++) {
                 /*Note:empty memory is set to  FLT_MAX not NULL*/
                 if (batch_node_processing_space[i].dataset[c] ==  FLT_MAX) {
                     success = 1;
@@ -2005,24 +5849,25 @@ get_kd_tree_batch_processing_heap()
     return &batch_node_processing_space[i];
 }
 /*init*/
-void kd_tree_init_batch_processing_heap(kd_tree_node** nodes, int max_dimensions)
+void kd_tree_init_batch_processing_heap(kdtree_t* tree)
 {
-       if (NULL!=nodes && NULL!=(*nodes))
+    kd_tree_node* nodes = tree->_internals->batch_node_processing_space;
+       if (NULL!=nodes)
     {
     int i = 0;
     int c=0;
-    for (; i <  kd_tree_get_rows_size(); i++)
+    for (; i <  kd_tree_get_rows_size(tree); i++)
     {
          /*reset  values */
-        if (NULL!=(*nodes)[i].dataset)
+        if (NULL!=nodes[i].dataset)
         {
             c=0;
-            for (; c<max_dimensions; c++)
+            for (; c<kdtree_get_k_dimensions(tree); c++)
             {
-                (*nodes)[i].dataset[c] =  FLT_MAX;
+                nodes[i].dataset[c] =  FLT_MAX;
             }
         }        
-        (*nodes)[i].distance_to_neighbor= FLT_MAX;
+        nodes[i].distance_to_neighbor= FLT_MAX;
         
         
     }
@@ -2030,10 +5875,15 @@ void kd_tree_init_batch_processing_heap(kd_tree_node** nodes, int max_dimensions
     }
 }
 /*free*/
-void kd_tree_free_batch_processing_heap(kd_tree_node** nodes)
+void kd_tree_free_batch_processing_heap(kdtree_t* tree)
 {
-    free(*nodes);
-    *nodes = NULL; 
+    kd_tree_node* nodes = tree->_internals->batch_node_processing_space;
+    if (NULL != nodes) {
+        free(nodes);
+        tree->_internals->batch_node_processing_space = NULL;
+    }
+    free(tree->_internals->coordinate_batch_processing_space);
+    tree->_internals->coordinate_batch_processing_space = NULL;
 }
 
 
@@ -2042,10 +5892,10 @@ void kd_tree_free_batch_processing_heap(kd_tree_node** nodes)
 Function        init_column_statistics_heap
 Description:     
 ==========================================================*/
-void kd_tree_alloc_columns_median_heap(int k_dimensions)
+void kd_tree_alloc_columns_median_heap(kdtree_t* tree, int k_dimensions)
 {
     /*the column median heap is the same size as the feature dimensions*/
-    columns_median_space =(float*)calloc( k_dimensions,
+    tree->_internals->columns_median_space =(float*)calloc( k_dimensions,
                                              sizeof(float));
 }
 
@@ -2053,12 +5903,13 @@ void kd_tree_alloc_columns_median_heap(int k_dimensions)
 Function         reset_entire_column_statistics_heap
 Description:     
 ==========================================================*/
-void kd_tree_init_columns_median_heap(float** medians, int k_dimensions) {
-    if (NULL != medians && NULL!=(*medians)) {
+void kd_tree_init_columns_median_heap(kdtree_t* tree) {
+    float* medians = tree->_internals->columns_median_space;
+    if (NULL != medians) {
         int i = 0;
-        for (; i < k_dimensions; i++) {
+        for (; i < kdtree_get_k_dimensions(tree); i++) {
             /*reset*/
-            (*medians)[i] = FLT_MAX;
+            medians[i] = FLT_MAX;
 
         }
     }
@@ -2068,9 +5919,9 @@ void kd_tree_init_columns_median_heap(float** medians, int k_dimensions) {
 Function         kd_tree_get_columns_median_heap
 Description:     
 ==========================================================*/
-float* kd_tree_get_columns_median_heap()
+float* kd_tree_get_columns_median_heap(kdtree_t* tree)
 {
-    return columns_median_space; 
+    return tree->_internals->columns_median_space;
 }
 
 
@@ -2078,23 +5929,38 @@ float* kd_tree_get_columns_median_heap()
 Function        set_column_median
 Description:     
 ==========================================================*/
-void kd_tree_set_column_median(float median, int column_index)
+void kd_tree_set_column_median(kdtree_t* tree, float median, int column_index)
 {
     /*DONT lock this operation with  kd_tree_allow_update
     the column median heap is the same size as the feature dimensions*/
-    if  (column_index<=kd_tree_get_k_dimensions())
+    if  (column_index<kdtree_get_k_dimensions(tree))
     {
-    columns_median_space[column_index] = median;
+    tree->_internals->columns_median_space[column_index] = median;
     }
                                             
 }
 /*=============================================================================
 Function         get_column_median
-Description:     
+Description:     median of column column_index over the points of the tree, 
+ *               computed on demand in O(n), builds do not keep it. 
 ==========================================================*/
-float kd_tree_get_column_median(int column_index) {
-    return columns_median_space[column_index];
-    //return 0; 
+float kd_tree_get_column_median(kdtree_t* tree, int column_index) {
+    kdtree_internals* internals = tree->_internals;
+    float* values = internals->columns_median_processing_space;
+    int k_dimensions = kdtree_get_k_dimensions(tree);
+    int count = 0;
+    int i = 0;
+
+    /*selection reorders its input, gather a copy of the live points*/
+    for (; i < internals->node_bump_index; i++) {
+        if (!is_empty_node(internals->node_space + i, k_dimensions)) {
+            values[count++] = internals->node_space[i].dataset[column_index];
+        }
+    }
+    if (count > 0) {
+        kd_tree_set_column_median(tree, median(values, count), column_index);
+    }
+    return internals->columns_median_space[column_index];
 }
 
 /*=============================================================================
@@ -2103,10 +5969,10 @@ Description:
 
 ==========================================================*/
 /*free*/
-void kd_tree_free_columns_median_space(float** medians)
+void kd_tree_free_columns_median_space(kdtree_t* tree)
 {
-    free (*medians);
-    *medians = NULL; 
+    free (tree->_internals->columns_median_space);
+    tree->_internals->columns_median_space = NULL;
 }
 
 /*Implementations -columns_median_processing_space heap*/
@@ -2115,14 +5981,14 @@ void kd_tree_free_columns_median_space(float** medians)
 Function        kd_tree_alloc_columns_median_processing_space
 Description:     
 ==========================================================*/
-float* kd_tree_alloc_columns_median_processing_space(int rows)
+float* kd_tree_alloc_columns_median_processing_space(kdtree_t* tree, int rows)
 {
-    if (NULL==columns_median_processing_space)
+    if (NULL==tree->_internals->columns_median_processing_space)
     {
-        columns_median_processing_space = (float*) 
+        tree->_internals->columns_median_processing_space = (float*)
                 calloc (rows, sizeof(float));
     }
-    return columns_median_processing_space;
+    return tree->_internals->columns_median_processing_space;
 }
 
 /*get*/
@@ -2130,26 +5996,27 @@ float* kd_tree_alloc_columns_median_processing_space(int rows)
 Function       kd_tree_get_columns_median_processing_space
 Description:     
 ==========================================================*/
-float* kd_tree_get_columns_median_processing_space()
+float* kd_tree_get_columns_median_processing_space(kdtree_t* tree)
 {
-    return columns_median_processing_space; 
+    return tree->_internals->columns_median_processing_space;
 }
 /*init*/
-void kd_tree_init_columns_median_processing_space(float** medians, int rows) {
-    if (NULL != medians && NULL!=(*medians)) {
+void kd_tree_init_columns_median_processing_space(kdtree_t* tree) {
+    float* medians = tree->_internals->columns_median_processing_space;
+    if (NULL != medians) {
         int i = 0;
-        for (; i < rows; i++) {
+        for (; i < kd_tree_get_rows_size(tree); i++) {
             /*reset*/
-            (*medians)[i] = FLT_MAX;
+            medians[i] = FLT_MAX;
 
         }
     }
 }
 /*free*/
-void kd_tree_free_columns_median_processing_space(float** medians)
+void kd_tree_free_columns_median_processing_space(kdtree_t* tree)
 {
-    free(*medians);
-    *medians = NULL; 
+    free(tree->_internals->columns_median_processing_space);
+    tree->_internals->columns_median_processing_space = NULL;
 }
 
 /*Implementations*/
@@ -29,6 +29,7 @@ extern "C"
 #include "stdbool.h"
 #include "float.h"
 #include <sys/time.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -37,7 +38,82 @@ extern "C"
 default every time tre size doubles, hence 2. For tree size n there will be
 about ln(n) rebuilds or about natural log of n.*/
 #define REBUILD_THRESHOLD 2.0f
+/*alignment in bytes of the coordinate arenas (one cache line), see 
+kd_tree_alloc_coordinate_arena()*/
+#define KD_TREE_ARENA_ALIGNMENT 64
+/*bulk build runs on OpenMP tasks, subtrees of at least 
+KD_TREE_PARALLEL_BUILD_MIN_ROWS points down to depth 
+KD_TREE_PARALLEL_BUILD_DEPTH are built by separate tasks, see 
+kd_tree_build_subtree()*/
+#define KD_TREE_PARALLEL_BUILD_MIN_ROWS 8192
+#define KD_TREE_PARALLEL_BUILD_DEPTH 10
+/*distance kernels, see kdtree_set_distance_kernel(). Two points with fewer
+than KD_TREE_SIMD_MIN_DIMENSIONS dimensions always use the scalar loop, 
+blocks of points use the kernel for any dimensions*/
+#define KD_TREE_KERNEL_SCALAR 0
+#define KD_TREE_KERNEL_SSE2 1
+#define KD_TREE_KERNEL_AVX2 2
+#define KD_TREE_KERNEL_AVX512 3
+#define KD_TREE_SIMD_MIN_DIMENSIONS 8
+/*bulk builds store subtrees of at most leaf_size points in one leaf bucket, 
+see kdtree_set_leaf_size(). 1 gives one point per node*/
+#define KD_TREE_LEAF_SIZE 1
+#define KD_TREE_MAX_LEAF_SIZE 64
+/*split dimension of a bulk build node, see kdtree_set_split_policy()*/
+#define KD_TREE_SPLIT_ROUND_ROBIN 0
+#define KD_TREE_SPLIT_MAX_SPREAD 1
+#define KD_TREE_SPLIT_MAX_VARIANCE 2
+#define KD_TREE_SPLIT_SLIDING_MIDPOINT 3
+/*bounds of the weight balance factor of partial rebuilds, see 
+kdtree_set_balance_factor(). 0 keeps the whole tree rebuilds*/
+#define KD_TREE_MIN_BALANCE_FACTOR 0.5f
+#define KD_TREE_MAX_BALANCE_FACTOR 1.0f
+/*levels of a forest, level i holds 2^i points, see kdtree_set_forest()*/
+#define KD_TREE_FOREST_LEVELS 31
+/*contexts that read published versions of one tree at the same time, see 
+kdtree_publish()*/
+#define KD_TREE_MAX_READERS 64
 /*START-Representation of a kd tree-START*/
+/*kd_tree_node is single kdtree_t leaf*/
+    typedef struct kd_tree_node
+    {   
+        struct kd_tree_node* left; 
+        struct kd_tree_node* right; 
+        struct kd_tree_node* parent; 
+        float* dataset;  
+        float distance_to_neighbor;
+        /*points with dataset[split_dimension] < split_value are in the left
+        subtree, all others in the right subtree*/
+        int split_dimension;
+        float split_value;
+        /*id of the point, stays the same while the point is in the tree: the
+        row of the kdtree_build() input, the kdtree_add_points() call number
+        or the id given to kdtree_add_point_with_id(). -1 for empty nodes*/
+        int id;
+        /*number of points of the node: its own & those of the next 
+        bucket_size - 1 slots of node_space, which are not linked into the 
+        tree. Greater than 1 only for leaf buckets made by a bulk build*/
+        int bucket_size;
+        /*number of points in the subtree of the node, bucket members 
+        included, see kdtree_set_balance_factor()*/
+        int subtree_size;
+    } kd_tree_node;
+
+/*read only copy of a kd_tree_node for search, see kdtree_compact(). 16 bytes
+instead of the 56 of kd_tree_node: no parent, no per node query scratch & the
+children are 32-bit slots of node_space instead of pointers. Entry i belongs
+to slot i, so the coordinates of a node are row i of coordinate_space*/
+    typedef struct kd_tree_compact_node
+    {
+        /*slots of the children, -1 for none*/
+        int left;
+        int right;
+        float split_value;
+        /*split_dimension & bucket_size of the node*/
+        unsigned short split_dimension;
+        unsigned short bucket_size;
+    } kd_tree_compact_node;
+
 /*variables internal to kdtree_t*/
 /*private member of kd-tree*/
 typedef struct kdtree_internals
@@ -52,20 +128,116 @@ float rebuild_threshold;
 int previous_tree_size;
 /*the number of times the tree was rebuilt. Used for debugging.*/
 int rebuild_counter;
+/*dimensionality of data (number of features) & max rows of this tree*/
+int k_dimensions;
+int heap_size;
+/*max points per leaf bucket of a bulk build, see kdtree_set_leaf_size()*/
+int leaf_size;
+/*KD_TREE_SPLIT_* policy of bulk builds, see kdtree_set_split_policy()*/
+int split_policy;
+/*alpha of the partial rebuilds of inserts, 0 rebuilds the whole tree once 
+rebuild_threshold is crossed instead, see kdtree_set_balance_factor()*/
+float balance_factor;
+/*the number of subtrees rebuilt by partial rebuilds. Used for debugging.*/
+int partial_rebuild_counter;
+/*1 if the points form a forest instead of one tree, see kdtree_set_forest().
+forest_roots[i] is the root of the tree of level i, NULL if it is empty. The
+levels are stored largest first in rows [0, n) of node_space, _root is the 
+root of the largest level*/
+int forest;
+kd_tree_node* forest_roots[KD_TREE_FOREST_LEVELS];
+/*background rebuild, see kdtree_set_background_rebuild(). While 
+background_running, background_thread copies the points to the node heap of 
+processing_space & builds them there. background_lock guards 
+background_copied & background_done, which the thread sets once the copy & 
+the build are finished. Writes wait on background_copy_done for the copy*/
+int background_rebuild;
+int background_running;
+int background_copied;
+int background_done;
+pthread_t background_thread;
+pthread_mutex_t background_lock;
+pthread_cond_t background_copy_done;
+/*writes made while the background rebuild runs, replayed on the new tree 
+before it is swapped in: delta_count points of k_dimensions values & their 
+ids, -1 for a delete*/
+float* delta_points;
+int* delta_ids;
+int delta_count;
+int delta_capacity;
+/*insert buffer, see kdtree_set_buffer_size(). buffer_count of the 
+buffer_capacity points are added but not merged into the tree yet, 
+buffer_nodes[i] holds the id of row i of buffer_coordinates (aligned, row 
+major) & references it. The nodes are not linked*/
+kd_tree_node* buffer_nodes;
+float* buffer_coordinates;
+int buffer_count;
+int buffer_capacity;
+/*heaps owned by this tree, see kdtree_alloc()*/
+kd_tree_node* node_space;
+kd_tree_node* node_processing_space;
+/*coordinates of the node heaps above. One aligned row major block per heap,
+row i holds the k_dimensions values of node slot i, i.e. a node's dataset
+points at row (node - node_space) of its arena. The members of a leaf bucket
+are consecutive rows, there is no structure of arrays copy per leaf. The
+block kernels put rows in lanes instead. Total O(rows*k_dimensions)*/
+float* coordinate_space;
+float* coordinate_processing_space;
+float* coordinate_knn_result_space;
+float* coordinate_batch_processing_space;
+/*rows kNN candidates, the working heap of kNN & radius search*/
+struct kd_tree_knn_candidate* knn_candidate_space;
+kd_tree_node* node_knn_result_space;
+kd_tree_node* batch_node_processing_space;
+/*node_space pool: slots [0, node_bump_index) were handed out at least once,
+node_free_slots holds the node_free_count slots released by delete. Both give
+O(1) node acquire & release, see get_pre_allocated_kd_tree_node_heap()*/
+int node_bump_index;
+int node_free_count;
+int* node_free_slots;
+/*id of the next point added by kdtree_add_points(), above every id used*/
+int next_id;
+/*caller's rows referenced by node_space instead of coordinate_space, NULL
+unless the tree was built by kdtree_build_index()*/
+float* index_dataset;
+/*rows compact nodes & slot of their root (-1 if empty), built by 
+kdtree_compact(). Searches use them while compact_valid, every node acquire 
+or release clears it, see kd_tree_drop_compact()*/
+struct kd_tree_compact_node* compact_nodes;
+int compact_root;
+int compact_valid;
+/*snapshot of kdtree_freeze(), snapshot_size points in breadth first order:
+the children of position i are at 2i+1 & 2i+2. Per position its coordinates
+(aligned, row major), its split dimension & its slot of node_space. Searches
+use it while snapshot_valid, cleared like compact_valid*/
+float* snapshot_coordinates;
+unsigned short* snapshot_split_dimensions;
+int* snapshot_slots;
+int snapshot_size;
+int snapshot_valid;
+/*1 while the snapshot arrays belong to the published version*/
+int snapshot_shared;
+/*versions of kdtree_publish(), read through kdtree_context_t without locks. 
+published is replaced by __atomic operations, published_current is 1 until 
+the tree changes. reader_epochs[r] is the epoch reader r pinned, 0 while it 
+does not read, reader_used[r] is 1 while a context owns slot r. Replaced 
+versions wait in retired_versions until every pinned epoch is newer than 
+theirs, see kd_tree_reclaim_versions()*/
+struct kd_tree_version* published;
+int published_current;
+struct kd_tree_version* retired_versions;
+unsigned long epoch;
+unsigned long reader_epochs[KD_TREE_MAX_READERS];
+int reader_used[KD_TREE_MAX_READERS];
+/*median calculation heaps*/
+float* columns_median_space;
+float* columns_median_processing_space;
+/*temporary tree used while processing, e.g. rebuild*/
+struct kdtree_t* processing_space;
 } kdtree_internals;
 
-/*kd_tree_node is single kdtree_t leaf*/
-    typedef struct kd_tree_node
-    {   
-        struct kd_tree_node* left; 
-        struct kd_tree_node* right; 
-        struct kd_tree_node* parent; 
-        float* dataset;  
-        float distance_to_neighbor;
-    } kd_tree_node;
-
     /*tree*/
-    typedef struct {
+    typedef struct kdtree_t {
         /*in order to  keep track of the kd-tree root*/
         kd_tree_node* _root;
         /*pointer to internal variables struct*/
@@ -76,7 +248,25 @@ int rebuild_counter;
 
     } kdtree_t; 
 
-/*declare variables*/
+    /*query scratch of one thread, see kdtree_context_alloc()*/
+    typedef struct kdtree_context_t {
+        /*rows kNN candidates, the working heap of one kNN or radius search*/
+        struct kd_tree_knn_candidate* candidates;
+        /*max_rows of the tree the context was allocated for*/
+        int rows;
+        /*the tree & its reader slot, -1 until the first published query 
+        claims one, see kdtree_publish()*/
+        struct kdtree_t* tree;
+        int reader;
+        /*number of the version read by the last published query*/
+        unsigned long version;
+    } kdtree_context_t;
+
+/*declare variables
+ Legacy single tree API: the kd_tree_* functions below operate on a default 
+ tree (self). The variables below alias the heaps of that default tree, 
+ see kd_tree_set_kd_tree(). Use the kdtree_* functions, which take a kdtree_t* 
+ handle, in order to run several independent trees side by side.*/
 extern kdtree_t* self;
 extern kdtree_t* kd_tree_processing_space;
 extern kd_tree_node* node_space; 
@@ -126,6 +316,15 @@ Description:   kd_tree_get_kd_tree returns reference to the tree & accesd
 ==========================================================*/
 kdtree_t* kd_tree_get_kd_tree();
 
+/*=============================================================================
+Function       kd_tree_set_kd_tree
+Description:   selects the default tree used by the legacy kd_tree_* API 
+ *             & points the legacy heap variables (node_space, 
+ *             node_knn_result_space, etc.) at its heaps. kdtree_alloc() 
+ *             selects the first allocated tree. NULL clears the default.
+==========================================================*/
+void kd_tree_set_kd_tree(kdtree_t* tree);
+
 
 /*=============================================================================
 Function        kd_tree_get_root
@@ -167,6 +366,14 @@ TODO:           Use rebuild threshhold.Must be greater than 1
 void
 kd_tree_add_points(kd_tree_node** root,const float data []);
 
+/*=============================================================================
+Function        kd_tree_add_points_batch 
+Description:    kdtree_add_points_batch() of the default tree, e.g. for the 
+ *              rows of batch_node_processing_space.
+==========================================================*/
+/*mutator*/
+int kd_tree_add_points_batch(const float* points, int n);
+
 /*===========================================================================
 Function        delete_data_point
 Description:    Given a data_point (query point) attempts to delete
@@ -310,7 +517,10 @@ int kd_tree_points_equal(const float point1[],const  float point2[],
 /*START-memory managment-START*/
 /*=============================================================================
 Function        kdtree_alloc
-Description:    Allocates all memory for kdtree library
+Description:    Allocates all memory for a new kd-tree with max_rows nodes & 
+ *              max_cols features. Every call returns a new independent tree.
+ *              The first tree allocated becomes the default tree of the 
+ *              legacy kd_tree_* API, see kd_tree_set_kd_tree().
 ==========================================================*/
 kdtree_t* kdtree_alloc(int max_rows, int max_cols);
 
@@ -322,7 +532,8 @@ void kdtree_init(kdtree_t* self);
 
 /*=============================================================================
 Function        kdtree_free
-Description:    frees all memory for kdtree library
+Description:    frees all memory of a tree. If the tree is the default tree the
+ *              default is cleared.
 ==========================================================*/
 void kdtree_free(kdtree_t* self);
 /*END-memory management-END*/
@@ -330,33 +541,409 @@ void kdtree_free(kdtree_t* self);
 void
 kd_tree_print_data_for_debug(kd_tree_node* data, const int k_dimensions,
                       const int result_size);
-/*
- * FLANN style convenience wrappers
-
-
-int kdtree_build_index( kdtree_t* self,
-                        float* dataset,
-                             int rows,
-                             int cols);
-
-int kdtree_find_nearest_neighbors_index(kdtree_t* self,
-                                        float* dataset,
-                                        int rows,
-                                        int cols,
-                                        float* testset,
-                                        int trows,
-                                        int* indices,
-                                        float* dists,
-                                        int nn);
-
-int kdtree_radius_search(kdtree_t* self, 
-                         float* query, // query point
-                         int* indices, // array for storing the indices found (will be modified) 
-                         float* dists, // similar, but for storing distances 
-                         int max_nn,  // size of arrays indices and dists
-                         float radius);// search radius (squared radius for euclidian metric) 
-
-*/
+
+/*START-Handle based API-START*/
+/*Every function below works on the kdtree_t* returned by kdtree_alloc(). 
+ Each tree owns its own node heap, medians & processing space, therefore any 
+ number of trees can be used side by side, e.g. built on separate threads.
+ A single tree is NOT thread safe, except for queries that only read it, see 
+ kdtree_context_alloc().*/
+
+/*=============================================================================
+Function        kdtree_is_debug_on, kdtree_set_debug_on
+Description:    getter/setter for extra debug output of a tree.
+==========================================================*/
+int kdtree_is_debug_on(kdtree_t* self);
+void kdtree_set_debug_on(kdtree_t* self, int on);
+
+/*=============================================================================
+Function        kdtree_get_k_dimensions
+Description:    number of features of the tree, set by kdtree_alloc().
+==========================================================*/
+int kdtree_get_k_dimensions(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_get_root
+Description:    get current kd-tree root.
+==========================================================*/
+kd_tree_node* kdtree_get_root(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_set_rebuild_threshold, kdtree_get_rebuild_threshold
+Description:    setter/getter for rebuild_threshold. By default is 2.
+==========================================================*/
+void kdtree_set_rebuild_threshold(kdtree_t* self, const float threshold);
+float kdtree_get_rebuild_threshold(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_set_leaf_size, kdtree_get_leaf_size
+Description:    setter/getter for the max number of points per leaf bucket,
+ *              1 to KD_TREE_MAX_LEAF_SIZE, by default KD_TREE_LEAF_SIZE. 
+ *              kdtree_build(), kdtree_build_index() & rebuilds store subtrees
+ *              of up to leaf_size points in one leaf that search scans 
+ *              linearly, 8 to 64 saves most of the nodes visited. The setter
+ *              returns 0 if leaf_size is out of range, it applies from the 
+ *              next build or rebuild.
+==========================================================*/
+int kdtree_set_leaf_size(kdtree_t* self, int leaf_size);
+int kdtree_get_leaf_size(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_set_split_policy, kdtree_get_split_policy
+Description:    setter/getter for the choice of split dimension of 
+ *              kdtree_build(), kdtree_build_index(), rebuilds & 
+ *              kdtree_freeze(). KD_TREE_SPLIT_ROUND_ROBIN (default) cycles 
+ *              through the dimensions by depth. KD_TREE_SPLIT_MAX_SPREAD & 
+ *              KD_TREE_SPLIT_MAX_VARIANCE split every node in the dimension
+ *              where its points have the largest range or variance, which 
+ *              visits fewer nodes on anisotropic data, e.g. a thin Z band.
+ *              Those split at the median, KD_TREE_SPLIT_SLIDING_MIDPOINT 
+ *              splits the dimension of largest range at the middle of the 
+ *              range instead, moved to the nearest point if one side would be
+ *              empty. Its cells keep a bounded aspect ratio around dense 
+ *              clusters, but the tree is not balanced. Snapshots of 
+ *              kdtree_freeze() always split at the median (max spread).
+ *              Points added one by one still cycle through the dimensions.
+ *              The setter returns 0 for an unknown policy, it applies from 
+ *              the next build.
+==========================================================*/
+int kdtree_set_split_policy(kdtree_t* self, int policy);
+int kdtree_get_split_policy(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_set_balance_factor, kdtree_get_balance_factor
+Description:    setter/getter for alpha, the weight balance factor of inserts.
+ *              0 (default) rebuilds the whole tree every time its size 
+ *              crosses rebuild_threshold times the size of the last rebuild.
+ *              alpha in (KD_TREE_MIN_BALANCE_FACTOR, 
+ *              KD_TREE_MAX_BALANCE_FACTOR), e.g. 0.7, rebuilds only a 
+ *              subtree instead: after an insert the highest node on its path
+ *              with a child holding more than alpha of the node's points is
+ *              rebuilt at the median over its own slots. Every node stays 
+ *              alpha balanced, the depth stays below log(n) / log(1 / alpha)
+ *              + 1 & an insert costs O(log n) amortized, no stall of a whole
+ *              tree rebuild. Leaf buckets of a rebuilt subtree become single
+ *              point nodes, deletes do not rebalance. The setter returns 0 if
+ *              alpha is out of range.
+References:     I. Galperin, R. L. Rivest, 1993, Scapegoat trees.
+==========================================================*/
+int kdtree_set_balance_factor(kdtree_t* self, float alpha);
+float kdtree_get_balance_factor(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_set_forest, kdtree_is_forest
+Description:    on (1) keeps the points in a forest of static trees for insert
+ *              heavy streams: O(log^2 n) amortized per insert & per search, 
+ *              no insert waits for a whole tree rebuild. Deletes, updates & 
+ *              kdtree_in_order_traversal() are not available until it is 
+ *              turned off (0), which builds one tree. The setter returns 0 
+ *              for a read only index, kdtree_init() turns it off.
+References:     J. L. Bentley, J. B. Saxe, 1980, Decomposable searching 
+ *              problems I: static-to-dynamic transformation.
+==========================================================*/
+int kdtree_set_forest(kdtree_t* self, int on);
+int kdtree_is_forest(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_set_background_rebuild, kdtree_is_rebuilding, 
+ *              kdtree_wait_rebuild
+Description:    on (1) runs the rebuilds of the rebuild_threshold policy on a 
+ *              background thread, the tree stays usable meanwhile & the new 
+ *              tree replaces it at a later insert, delete or update. 
+ *              kdtree_is_rebuilding() returns 1 until then, 
+ *              kdtree_wait_rebuild() blocks until a running rebuild is swapped
+ *              in & returns 1 if one was. Off (0, default) rebuilds on the 
+ *              inserting thread. The tree is still not safe for concurrent 
+ *              calls. Node pointers, e.g. kdtree_get_root(), are stale after
+ *              the swap.
+==========================================================*/
+int kdtree_set_background_rebuild(kdtree_t* self, int on);
+int kdtree_is_rebuilding(kdtree_t* self);
+int kdtree_wait_rebuild(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_set_buffer_size, kdtree_get_buffer_size, 
+ *              kdtree_get_buffered_points, kdtree_flush_buffer
+Description:    capacity > 0, at most max_rows, buffers inserts & merges them
+ *              into the tree once per capacity inserts. Searches, deletes & 
+ *              updates see buffered points, 
+ *              kdtree_get_current_number_of_kd_tree_nodes(), 
+ *              kdtree_get_height() & kdtree_in_order_traversal() do not. 
+ *              kdtree_flush_buffer() merges now & returns the number of 
+ *              points merged, kdtree_get_buffered_points() the number 
+ *              waiting. Builds drop the buffer. 0 (default) merges & turns 
+ *              it off, so does kdtree_init(). The setter returns 0 for a 
+ *              read only index.
+==========================================================*/
+int kdtree_set_buffer_size(kdtree_t* self, int capacity);
+int kdtree_get_buffer_size(kdtree_t* self);
+int kdtree_get_buffered_points(kdtree_t* self);
+int kdtree_flush_buffer(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_get_current_number_of_kd_tree_nodes
+Description:    Returns current number of tree nodes. 
+==========================================================*/
+int kdtree_get_current_number_of_kd_tree_nodes(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_get_height
+Description:    Returns the number of levels of the tree, 0 if it is empty. 
+ *              Walks the whole tree, used for debugging & tests.
+==========================================================*/
+int kdtree_get_height(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_get_knn_result_space
+Description:    Returns the result heap of the tree. It holds the results of 
+ *              the last kdtree_knn(), kdtree_knn_based_on_radius() or 
+ *              kdtree_in_order_traversal() call on this tree.
+==========================================================*/
+kd_tree_node* kdtree_get_knn_result_space(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_add_points 
+Description:    adds a single point with k_dimensions to the tree. 
+==========================================================*/
+/*mutator*/
+void kdtree_add_points(kdtree_t* self, const float data []);
+
+/*=============================================================================
+Function        kdtree_add_point_with_id 
+Description:    adds a single point with a caller chosen id >= 0, e.g. the
+ *              index of the record it belongs to. Search results report 
+ *              this id, see kdtree_knn_ids(). Ids are not checked for 
+ *              duplicates.
+==========================================================*/
+/*mutator*/
+void kdtree_add_point_with_id(kdtree_t* self, const float data [], int id);
+
+/*=============================================================================
+Function        kdtree_add_points_batch 
+Description:    adds n points (row major, n x k_dimensions floats) & 
+ *              rebalances the whole tree once, O((m + n) log(m + n)) for m 
+ *              points already in the tree, instead of the rebuilds triggered
+ *              by adding them one by one. Returns number of points in the 
+ *              tree, 0 on error.
+==========================================================*/
+/*mutator*/
+int kdtree_add_points_batch(kdtree_t* self, const float* points, int n);
+
+/*=============================================================================
+Function        kdtree_delete_data_point 
+Description:    deletes a single point. Returns 1 if it was deleted else 0.
+==========================================================*/
+/*mutator*/
+int kdtree_delete_data_point(kdtree_t* self, const float data_point []);
+
+/*=============================================================================
+Function        kdtree_update_point 
+Description:    replaces target_data [] with new_data [], the point keeps its
+ *              id. Returns 1 if successful else 0.
+==========================================================*/
+/*mutator*/
+int kdtree_update_point(kdtree_t* self, const float target_data [],  
+        const float new_data []);
+
+/*=============================================================================
+Function        kdtree_rebuild 
+Description:    rebalances the tree, see kd_tree_rebuild(). Returns number of 
+ *              nodes in the rebuilt tree. 
+==========================================================*/
+/*mutator*/
+int kdtree_rebuild(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_build 
+Description:    replaces the content of the tree by rows points (row major,
+ *              rows x k_dimensions floats) & builds a balanced tree in
+ *              O(n log n), every subtree is split at its own median. 
+ *              Returns number of nodes in the tree, 0 on error.
+==========================================================*/
+/*mutator*/
+int kdtree_build(kdtree_t* self, const float* data, int rows);
+
+/*=============================================================================
+Function        kdtree_build_index, kdtree_free_index
+Description:    builds a balanced tree like kdtree_build() but references the
+ *              rows of the caller's dataset (rows x cols floats, row major, 
+ *              cols == k_dimensions) instead of copying them, the id of a 
+ *              point is its row. dataset is not modified & must stay valid
+ *              until kdtree_free_index() or kdtree_free(). The tree is read 
+ *              only in between, kdtree_free_index() empties it & makes it 
+ *              writable again. Returns number of nodes, 0 on error.
+==========================================================*/
+int kdtree_build_index(kdtree_t* self, float* dataset, int rows, int cols);
+void kdtree_free_index(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_compact, kdtree_is_compact
+Description:    copies the tree into compact nodes (kd_tree_compact_node), 16
+ *              bytes per point plus its coordinates, so more of the tree 
+ *              stays in cache. kNN, batch & radius searches walk the compact 
+ *              nodes, unless there is a snapshot (kdtree_freeze()), until 
+ *              the next insert, delete, update or build, which drop them;
+ *              call kdtree_compact() again after updates. O(n).
+ *              Returns number of nodes in the tree, 0 if it is empty or on
+ *              error. kdtree_is_compact() returns 1 while searches use them.
+==========================================================*/
+int kdtree_compact(kdtree_t* self);
+int kdtree_is_compact(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_freeze, kdtree_is_frozen
+Description:    copies the points of the tree into a read only snapshot, a 
+ *              balanced tree laid out in breadth first order with implicit
+ *              children (2i+1, 2i+2) & the coordinates in the same order, so
+ *              the top levels share cache lines & pages. For trees that are 
+ *              queried far more often than updated, e.g. static maps. kNN, 
+ *              batch & radius searches use the snapshot until the next 
+ *              insert, delete, update or build. O(n log n), the snapshot 
+ *              takes about 6 bytes per point plus a copy of the coordinates.
+ *              Returns number of points in the snapshot, 0 if the tree is 
+ *              empty or on error. kdtree_is_frozen() returns 1 while searches
+ *              use the snapshot.
+==========================================================*/
+int kdtree_freeze(kdtree_t* self);
+int kdtree_is_frozen(kdtree_t* self);
+
+/*=============================================================================
+Function        kdtree_set_distance_kernel, kdtree_get_distance_kernel
+Description:    The squared Euclidean distance runs on SSE2, AVX2 or AVX-512
+ *              kernels, by default the widest one the CPU supports is 
+ *              selected when the library is loaded. kdtree_set_distance_kernel
+ *              forces a kernel (KD_TREE_KERNEL_*), returns 0 if the CPU does 
+ *              not support it. Applies to all trees, not thread safe.
+==========================================================*/
+int kdtree_set_distance_kernel(int kernel);
+int kdtree_get_distance_kernel(void);
+
+/*=============================================================================
+Function        kdtree_squared_distance, kdtree_squared_distance_block
+Description:    squared Euclidean distance of n dimensional points a & b using
+ *              the selected kernel. The block version computes the distance
+ *              of query to each of rows points (rows x n floats, row major)
+ *              into out[rows].
+==========================================================*/
+float kdtree_squared_distance(const float* a, const float* b, int n);
+void kdtree_squared_distance_block(const float* query, const float* points,
+        int rows, int n, float* out);
+
+/*=============================================================================
+Function        kdtree_search_data_point 
+Description:    Returns  0 (false) with NOT found. Returns 1 (true) if found. 
+==========================================================*/
+int kdtree_search_data_point(kdtree_t* self, const float data []);
+
+/*=============================================================================
+Function        kdtree_knn
+Description:    finds number_of_nearest_neighbors nearest neighbors of 
+ *              data_point. Results are in kdtree_get_knn_result_space(). 
+Output:         int - number of neighbors found.
+==========================================================*/
+int kdtree_knn(kdtree_t* self, const float data_point[],
+        int number_of_nearest_neighbors);
+
+/*=============================================================================
+Function        kdtree_knn_ids
+Description:    same as kdtree_knn() but nothing is copied to the result heap,
+ *              the ids & distances of the neighbors are written to out_ids &
+ *              out_dists (number_of_nearest_neighbors entries each), sorted by
+ *              ascending distance.
+Output:         int - number of neighbors found.
+==========================================================*/
+int kdtree_knn_ids(kdtree_t* self, const float data_point[],
+        int number_of_nearest_neighbors, int* out_ids, float* out_dists);
+
+/*=============================================================================
+Function        kdtree_knn_batch
+Description:    finds the k nearest neighbors of each of the nq queries
+ *              (nq x k_dimensions floats, row major) in parallel. The ids &
+ *              distances of the neighbors of query q are written to 
+ *              out_indices[q*k .. q*k+k) & out_dists[q*k .. q*k+k) sorted by
+ *              ascending distance, unused entries are -1 & FLT_MAX. 
+ *              Does not use the result heap of the tree, safe as long as no
+ *              mutator runs at the same time.
+Output:         int - number of queries answered, 0 on error.
+==========================================================*/
+int kdtree_knn_batch(kdtree_t* self, const float* queries, int nq, int k,
+        int* out_indices, float* out_dists);
+
+/*=============================================================================
+Function        kdtree_knn_based_on_radius
+Description:    finds neighbors within range_from_data_point of data_point. 
+ *              Results are in kdtree_get_knn_result_space(). 
+Output:         int - number of neighbors found.
+==========================================================*/
+int kdtree_knn_based_on_radius(kdtree_t* self, const float data_point[],
+        float range_from_data_point);
+
+/*=============================================================================
+Function        kdtree_radius_search
+Description:    same as kdtree_knn_based_on_radius() but the ids & distances 
+ *              of the max_nn nearest neighbors within radius (a distance, NOT
+ *              squared) are written to indices & dists, sorted by ascending
+ *              distance. 
+Output:         int - number of neighbors written, at most max_nn.
+==========================================================*/
+int kdtree_radius_search(kdtree_t* self, const float* query, int* indices,
+        float* dists, int max_nn, float radius);
+
+/*=============================================================================
+Function        kdtree_context_alloc, kdtree_context_free, kdtree_knn_context,
+ *              kdtree_radius_search_context
+Description:    a context holds the candidate heap of one thread's queries, 
+ *              O(max_rows) of self, so it serves trees up to that size. 
+ *              kdtree_knn_context() & kdtree_radius_search_context() are 
+ *              kdtree_knn_ids() & kdtree_radius_search() with the scratch of
+ *              the context instead of the tree's: they only read the tree. 
+ *              So do kdtree_search_data_point() & kdtree_knn_batch(). Any 
+ *              number of threads, each with its own context, can run these on
+ *              one tree at the same time without locks, as long as no mutator
+ *              & no query using the tree's result heap or candidate heap 
+ *              (kdtree_knn(), kdtree_knn_ids(), ...) runs meanwhile.
+Output:         kdtree_context_alloc() returns NULL on error. The queries 
+ *              return the number of neighbors written, 0 on error.
+==========================================================*/
+kdtree_context_t* kdtree_context_alloc(kdtree_t* self);
+void kdtree_context_free(kdtree_context_t* context);
+int kdtree_knn_context(kdtree_t* self, kdtree_context_t* context,
+        const float data_point[], int number_of_nearest_neighbors,
+        int* out_ids, float* out_dists);
+int kdtree_radius_search_context(kdtree_t* self, kdtree_context_t* context,
+        const float* query, int* indices, float* dists, int max_nn,
+        float radius);
+
+/*=============================================================================
+Function        kdtree_publish, kdtree_knn_published, 
+ *              kdtree_radius_search_published
+Description:    kdtree_publish() makes the points of self a read only version:
+ *              O(n log n), O(n) if self is frozen (kdtree_freeze()) & O(1) if
+ *              it did not change since the last publish. A version holds O(n)
+ *              memory until no reader can see it. The published queries of 
+ *              any number of threads, each with its own context, search it 
+ *              without locks while one writer mutates & publishes. At most 
+ *              KD_TREE_MAX_READERS contexts of self run published queries.
+ *              Free the contexts before self.
+Output:         kdtree_publish() returns the version number, 0 on error. The 
+ *              queries return the number of neighbors written, 0 if nothing 
+ *              is published, the reader limit is reached or on error.
+==========================================================*/
+unsigned long kdtree_publish(kdtree_t* self);
+int kdtree_knn_published(kdtree_t* self, kdtree_context_t* context,
+        const float data_point[], int number_of_nearest_neighbors,
+        int* out_ids, float* out_dists);
+int kdtree_radius_search_published(kdtree_t* self, kdtree_context_t* context,
+        const float* query, int* indices, float* dists, int max_nn,
+        float radius);
+
+/*=============================================================================
+Function        kdtree_in_order_traversal
+Description:    copies all tree nodes in order to kdtree_get_knn_result_space()
+ *              & returns number of nodes copied. The tree is not modified.
+==========================================================*/
+int kdtree_in_order_traversal(kdtree_t* self);
+/*END-Handle based API-END*/
 
 #if defined __cplusplus
 }
@@ -0,0 +1,778 @@
+/*Copyright 2020, by the California Institute of Technology.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * File:   knn_brute_force_test.c
+ * Author: anaim (aryan.e.naim@jpl.nasa.gov)
+ *
+ * Checks kdtree_knn() & kdtree_knn_based_on_radius() against a brute force
+ * scan over random points, before & after deleting points, for a tree built
+ * point by point & one built by kdtree_build(). kdtree_knn_batch() must
+ * return the same neighbors with the ids of the kdtree_build() rows. Ids
+ * given to kdtree_add_point_with_id() are returned by kdtree_knn_ids() & 
+ * kdtree_radius_search() & survive updates. An index built over the points by
+ * kdtree_build_index() gives the same results without copying them. The
+ * bulk builds run with one point per node & with leaf buckets of 16 points.
+ * Searches over the compact nodes of kdtree_compact() & over the breadth 
+ * first snapshot of kdtree_freeze() give the same results. Last the points 
+ * are squeezed into a thin Z band & built with the max spread & variance 
+ * split policies, then half of them into a dense cluster for the sliding 
+ * midpoint policy. kdtree_add_points_batch() loads the points in two 
+ * batches. Points added in sorted order with a balance factor stay balanced
+ * by partial rebuilds. A forest of kdtree_set_forest() gives the same 
+ * results with one fully built tree of 2^i points per bit of n. With 
+ * background rebuilds points are deleted & searched while a thread rebuilds
+ * the tree, the writes are replayed on the new tree, which is swapped in
+ * from a second node heap. With an insert buffer the buffered points are 
+ * found, deleted & updated before & after they are merged into the tree, a
+ * merge inserts them without rebuilding the tree. A tree of sorted inserts 
+ * without rebuilds checks that a chain DEEP_ROWS levels deep is still built
+ * & searched, with a balance factor the same inserts stay logarithmic.
+ *
+ * IMPORTANT: Must call kdtree_alloc() & kdtree_init() once before using the 
+ * API. In order to cleanup call kdtree_free().
+ */
+
+#include <stdio.h>
+#include "kdtree.h"
+
+#define ROWS 2000
+#define COLS 3
+#define QUERIES 200
+#define BATCH_K 8
+#define DEEP_ROWS 5000
+
+float points[ROWS][COLS];
+float points_copy[ROWS][COLS];
+int deleted[ROWS];
+float brute_force_distances[ROWS];
+float batch_queries[QUERIES][COLS];
+int batch_indices[QUERIES * BATCH_K];
+float batch_dists[QUERIES * BATCH_K];
+int ids[ROWS];
+float dists[ROWS];
+
+float distance(const float* a, const float* b) {
+    float total = 0.0f;
+    int i = 0;
+    for (; i < COLS; i++) {
+        total += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return sqrt(total);
+}
+
+int compare_floats(const void* a, const void* b) {
+    float d1 = *(const float*) a;
+    float d2 = *(const float*) b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+/*rows of points by their first coordinate*/
+int compare_rows(const void* a, const void* b) {
+    return compare_floats(a, b);
+}
+
+/*levels of an alpha weight balanced tree of n points*/
+int balanced_height(int n, float alpha) {
+    return (int) (log(n) / log(1.0f / alpha)) + 1;
+}
+
+/*sorted distances of every point still in the tree to query*/
+int brute_force(const float* query) {
+    int n = 0;
+    int i = 0;
+    for (; i < ROWS; i++) {
+        if (!deleted[i]) {
+            brute_force_distances[n++] = distance(query, points[i]);
+        }
+    }
+    qsort(brute_force_distances, n, sizeof (float), compare_floats);
+    return n;
+}
+
+void check_queries(kdtree_t* tree) {
+    int neighbors[] = {1, 5, 20};
+    float query[COLS];
+    int q = 0;
+    int count = 0;
+    for (; q < QUERIES; q++) {
+        int c = 0;
+        int n = 0;
+        int i = 0;
+        for (; c < COLS; c++) {
+            query[c] = (rand() % 2400) / 10.0f - 20.0f;
+        }
+        n = brute_force(query);
+        for (c = 0; c < 3; c++) {
+            int result_size = kdtree_knn(tree, query, neighbors[c]);
+            kd_tree_node* result = kdtree_get_knn_result_space(tree);
+            assert(result_size == neighbors[c]);
+            for (i = 0; i < result_size; i++) {
+                assert(fabs(result[i].distance_to_neighbor -
+                        brute_force_distances[i]) < 1e-3);
+                assert(fabs(distance(query, result[i].dataset) -
+                        brute_force_distances[i]) < 1e-3);
+            }
+        }
+        /*radius between the 10th & 11th neighbor, exactly 10 are inside*/
+        float range = (brute_force_distances[9] +
+                brute_force_distances[10]) / 2;
+        if (brute_force_distances[10] - brute_force_distances[9] > 1e-3 &&
+                n > 10) {
+            count = kdtree_knn_based_on_radius(tree, query, range);
+            assert(count == 10);
+            count = kdtree_radius_search(tree, query, ids, dists, ROWS, range);
+            assert(count == 10);
+            count = kdtree_radius_search(tree, query, ids, dists, 4, range);
+            assert(count == 4);
+            for (i = 0; i < 4; i++) {
+                assert(fabs(dists[i] - brute_force_distances[i]) < 1e-3);
+            }
+        }
+    }
+}
+
+/*batch results are the brute force neighbors, ids are rows of points*/
+void check_batch(kdtree_t* tree) {
+    int q = 0;
+    int i = 0;
+    int count = 0;
+    for (; q < QUERIES; q++) {
+        for (i = 0; i < COLS; i++) {
+            batch_queries[q][i] = (rand() % 2400) / 10.0f - 20.0f;
+        }
+    }
+    count = kdtree_knn_batch(tree, &batch_queries[0][0], QUERIES, BATCH_K,
+            batch_indices, batch_dists);
+    assert(count == QUERIES);
+    for (q = 0; q < QUERIES; q++) {
+        brute_force(batch_queries[q]);
+        for (i = 0; i < BATCH_K; i++) {
+            int id = batch_indices[q * BATCH_K + i];
+            assert(id >= 0 && id < ROWS && !deleted[id]);
+            assert(fabs(batch_dists[q * BATCH_K + i] -
+                    brute_force_distances[i]) < 1e-3);
+            assert(fabs(distance(batch_queries[q], points[id]) -
+                    brute_force_distances[i]) < 1e-3);
+        }
+    }
+}
+
+/*kdtree_build(), updates of the built tree & kdtree_build_index()*/
+void check_bulk_build(kdtree_t* tree) {
+    int i = 0;
+    int count = 0;
+    int found = 0;
+    int ok = 0;
+
+    /*bulk build over the same points, balanced by per node medians*/
+    count = kdtree_build(tree, &points[0][0], ROWS);
+    assert(count == ROWS);
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found);
+    }
+    assert(kdtree_get_current_number_of_kd_tree_nodes(tree) == ROWS);
+    printf("leaf size %d, height after build %d\n", kdtree_get_leaf_size(tree),
+            kdtree_get_height(tree));
+    assert(kdtree_get_height(tree) <= (int) ceil(log2(ROWS)) + 1);
+    assert(kdtree_get_height(tree) <=
+            (int) ceil(log2(ROWS / kdtree_get_leaf_size(tree))) + 2);
+    count = kdtree_in_order_traversal(tree);
+    assert(count == ROWS);
+    check_queries(tree);
+    printf("knn after build matches brute force ok \n");
+    check_batch(tree);
+    printf("batch knn after build ok \n");
+    count = kdtree_compact(tree);
+    assert(count == ROWS && kdtree_is_compact(tree));
+    check_queries(tree);
+    check_batch(tree);
+    printf("knn over compact nodes ok \n");
+    count = kdtree_freeze(tree);
+    assert(count == ROWS && kdtree_is_frozen(tree));
+    check_queries(tree);
+    check_batch(tree);
+    printf("knn over snapshot ok \n");
+    /*incremental insert & delete keep working on a built tree*/
+    for (i = 0; i < ROWS; i += 2) {
+        ok = kdtree_delete_data_point(tree, points[i]);
+        assert(ok);
+        deleted[i] = 1;
+    }
+    /*ids survive delete & rebuild*/
+    check_batch(tree);
+    assert(!kdtree_is_compact(tree) && !kdtree_is_frozen(tree));
+    count = kdtree_rebuild(tree);
+    assert(count == ROWS / 2);
+    check_batch(tree);
+    printf("batch knn after delete & rebuild ok \n");
+    for (i = 0; i < ROWS; i += 4) {
+        kdtree_add_points(tree, points[i]);
+        deleted[i] = 0;
+    }
+    for (i = 0; i < ROWS; i++) {
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found == !deleted[i]);
+    }
+    count = kdtree_in_order_traversal(tree);
+    assert(count == kdtree_get_current_number_of_kd_tree_nodes(tree));
+    check_queries(tree);
+    printf("knn after build & update matches brute force ok \n");
+    count = kdtree_compact(tree);
+    assert(count == kdtree_get_current_number_of_kd_tree_nodes(tree));
+    check_queries(tree);
+
+    /*index over the caller's rows, which are neither copied nor modified*/
+    memcpy(points_copy, points, sizeof (points));
+    count = kdtree_build_index(tree, &points[0][0], ROWS, COLS);
+    assert(count == ROWS);
+    assert(memcmp(points_copy, points, sizeof (points)) == 0);
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found);
+    }
+    assert(kdtree_get_height(tree) <= (int) ceil(log2(ROWS)) + 1);
+    check_queries(tree);
+    check_batch(tree);
+    count = kdtree_compact(tree);
+    assert(count == ROWS);
+    check_queries(tree);
+    check_batch(tree);
+    count = kdtree_freeze(tree);
+    assert(count == ROWS);
+    check_queries(tree);
+    check_batch(tree);
+    /*read only until kdtree_free_index()*/
+    ok = kdtree_delete_data_point(tree, points[0]);
+    assert(!ok);
+    ok = kdtree_update_point(tree, points[0], points[1]);
+    assert(!ok);
+    assert(kdtree_get_current_number_of_kd_tree_nodes(tree) == ROWS);
+    assert(kdtree_is_compact(tree) && kdtree_is_frozen(tree));
+    kdtree_free_index(tree);
+    assert(!kdtree_is_compact(tree) && !kdtree_is_frozen(tree));
+    assert(kdtree_get_current_number_of_kd_tree_nodes(tree) == 0);
+    kdtree_add_points(tree, points[0]);
+    found = kdtree_search_data_point(tree, points[0]);
+    assert(found);
+    assert(memcmp(points_copy, points, sizeof (points)) == 0);
+    printf("index over caller's points ok \n");
+}
+
+    int found = 0;
+int main(int argc, char** argv) {
+    int count = 0;
+    int ok = 0;
+    int found = 0;
+
+    kdtree_t* tree = kdtree_alloc(ROWS, COLS);
+    int i = 0;
+    int c = 0;
+    assert(tree);
+    kdtree_init(tree);
+    srand(1);
+    for (; i < ROWS; i++) {
+        for (c = 0; c < COLS; c++) {
+            points[i][c] = (rand() % 2000) / 10.0f;
+        }
+        kdtree_add_points(tree, points[i]);
+    }
+    check_queries(tree);
+    printf("knn matches brute force ok \n");
+
+    for (i = 0; i < ROWS; i += 3) {
+        ok = kdtree_delete_data_point(tree, points[i]);
+        assert(ok);
+        deleted[i] = 1;
+    }
+    for (i = 0; i < ROWS; i++) {
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found == !deleted[i]);
+    }
+    check_queries(tree);
+    printf("knn after delete matches brute force ok \n");
+    /*the deletes left an unbalanced tree with holes in node_space*/
+    count = kdtree_compact(tree);
+    assert(count == kdtree_get_current_number_of_kd_tree_nodes(tree));
+    check_queries(tree);
+    printf("knn over compact nodes after delete ok \n");
+    count = kdtree_freeze(tree);
+    assert(count == kdtree_get_current_number_of_kd_tree_nodes(tree));
+    check_queries(tree);
+    printf("knn over snapshot after delete ok \n");
+
+    /*bulk builds with one point per node & with leaf buckets*/
+    check_bulk_build(tree);
+    ok = kdtree_set_leaf_size(tree, KD_TREE_MAX_LEAF_SIZE + 1);
+    assert(!ok);
+    ok = kdtree_set_leaf_size(tree, 16);
+    assert(ok);
+    check_bulk_build(tree);
+    ok = kdtree_set_leaf_size(tree, 1);
+    assert(ok);
+
+    /*caller chosen ids, e.g. record numbers. init also ends an index*/
+    count = kdtree_build_index(tree, &points[0][0], ROWS, COLS);
+    assert(count == ROWS);
+    kdtree_init(tree);
+    assert(memcmp(points_copy, points, sizeof (points)) == 0);
+    for (i = 0; i < ROWS; i++) {
+        kdtree_add_point_with_id(tree, points[i], 5000 + i);
+    }
+    for (i = 0; i < QUERIES; i++) {
+        int result_size = kdtree_knn_ids(tree, points[i * 7], 5, ids, dists);
+        assert(result_size == 5);
+        assert(ids[0] == 5000 + i * 7 && dists[0] == 0.0f);
+        for (c = 0; c < result_size; c++) {
+            assert(fabs(distance(points[i * 7], points[ids[c] - 5000]) -
+                    dists[c]) < 1e-3);
+        }
+    }
+    /*automatic ids continue above the caller's ids, the tree is full so
+     make room first*/
+    float extra[COLS] = {-50.0f, -50.0f, -50.0f};
+    ok = kdtree_delete_data_point(tree, points[1]);
+    assert(ok);
+    kdtree_add_points(tree, extra);
+    count = kdtree_knn_ids(tree, extra, 1, ids, dists);
+    assert(count == 1);
+    assert(ids[0] == 5000 + ROWS);
+    /*an updated point keeps its id*/
+    float moved[COLS] = {-60.0f, -60.0f, -60.0f};
+    ok = kdtree_update_point(tree, points[3], moved);
+    assert(ok);
+    count = kdtree_knn_ids(tree, moved, 1, ids, dists);
+    assert(count == 1);
+    assert(ids[0] == 5003 && dists[0] == 0.0f);
+    printf("ids ok \n");
+
+    /*wide XY extent, thin Z band, the top levels must not split on Z*/
+    for (i = 0; i < ROWS; i++) {
+        points[i][2] /= 200.0f;
+    }
+    ok = kdtree_set_split_policy(tree, KD_TREE_SPLIT_SLIDING_MIDPOINT + 1);
+    assert(!ok);
+    ok = kdtree_set_split_policy(tree, KD_TREE_SPLIT_MAX_SPREAD);
+    assert(ok);
+    count = kdtree_build(tree, &points[0][0], ROWS);
+    assert(count == ROWS);
+    assert(kdtree_get_root(tree)->split_dimension != 2);
+    assert(kdtree_get_root(tree)->left->split_dimension != 2);
+    assert(kdtree_get_root(tree)->right->split_dimension != 2);
+    check_bulk_build(tree);
+    ok = kdtree_set_split_policy(tree, KD_TREE_SPLIT_MAX_VARIANCE);
+    assert(ok);
+    ok = kdtree_set_leaf_size(tree, 8);
+    assert(ok);
+    count = kdtree_build(tree, &points[0][0], ROWS);
+    assert(count == ROWS);
+    assert(kdtree_get_root(tree)->split_dimension != 2);
+    check_bulk_build(tree);
+    printf("split policies ok \n");
+
+    /*every other point in a dense cluster, sliding midpoint splits*/
+    for (i = 0; i < ROWS; i += 2) {
+        for (c = 0; c < COLS; c++) {
+            points[i][c] = 100.0f + points[i][c] / 1000.0f;
+        }
+    }
+    ok = kdtree_set_split_policy(tree, KD_TREE_SPLIT_SLIDING_MIDPOINT);
+    assert(ok);
+    count = kdtree_build(tree, &points[0][0], ROWS);
+    assert(count == ROWS);
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found);
+    }
+    printf("sliding midpoint, height after build %d\n",
+            kdtree_get_height(tree));
+    count = kdtree_in_order_traversal(tree);
+    assert(count == ROWS);
+    check_queries(tree);
+    check_batch(tree);
+    for (i = 0; i < ROWS; i += 3) {
+        ok = kdtree_delete_data_point(tree, points[i]);
+        assert(ok);
+        deleted[i] = 1;
+    }
+    check_queries(tree);
+    count = kdtree_rebuild(tree);
+    assert(count == kdtree_get_current_number_of_kd_tree_nodes(tree));
+    check_batch(tree);
+    count = kdtree_freeze(tree);
+    assert(count == kdtree_get_current_number_of_kd_tree_nodes(tree));
+    check_batch(tree);
+    printf("sliding midpoint ok \n");
+
+    /*load in two batches, one bulk build each, ids continue in order*/
+    kdtree_init(tree);
+    count = kdtree_add_points_batch(tree, &points[0][0], ROWS / 2);
+    assert(count == ROWS / 2);
+    ok = kdtree_delete_data_point(tree, points[0]);
+    assert(ok);
+    count = kdtree_add_points_batch(tree, &points[ROWS / 2][0], ROWS / 2);
+    assert(count == ROWS - 1);
+    count = kdtree_add_points_batch(tree, &points[0][0], 2);
+    assert(!count);
+    count = kdtree_add_points_batch(tree, &points[0][0], 1);
+    assert(count == ROWS);
+    assert(kdtree_get_height(tree) <= (int) ceil(log2(ROWS)) + 1);
+    count = kdtree_in_order_traversal(tree);
+    assert(count == ROWS);
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found);
+    }
+    check_queries(tree);
+    count = kdtree_knn_ids(tree, points[0], 1, ids, dists);
+    assert(count == 1);
+    assert(ids[0] == ROWS && dists[0] == 0.0f);
+    count = kdtree_knn_ids(tree, points[ROWS - 1], 1, ids, dists);
+    assert(count == 1);
+    assert(ids[0] == ROWS - 1 && dists[0] == 0.0f);
+    printf("batch insert ok \n");
+
+    /*sorted inserts, partial rebuilds instead of whole tree rebuilds*/
+    kdtree_init(tree);
+    assert(kdtree_get_balance_factor(tree) == 0.0f);
+    ok = kdtree_set_balance_factor(tree, KD_TREE_MIN_BALANCE_FACTOR);
+    assert(!ok);
+    ok = kdtree_set_balance_factor(tree, KD_TREE_MAX_BALANCE_FACTOR);
+    assert(!ok);
+    ok = kdtree_set_balance_factor(tree, 0.7f);
+    assert(ok);
+    for (i = 0; i < ROWS; i++) {
+        for (c = 0; c < COLS; c++) {
+            points[i][c] = (rand() % 20000) / 100.0f;
+        }
+    }
+    qsort(points, ROWS, sizeof (points[0]), compare_rows);
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        kdtree_add_points(tree, points[i]);
+    }
+    printf("partial rebuilds %d, height %d\n",
+            tree->_internals->partial_rebuild_counter, kdtree_get_height(tree));
+    assert(tree->_internals->rebuild_counter == 0);
+    assert(tree->_internals->partial_rebuild_counter > 0);
+    assert(kdtree_get_height(tree) <= balanced_height(ROWS, 0.7f));
+    assert(kdtree_get_root(tree)->subtree_size == ROWS);
+    check_queries(tree);
+    for (i = 0; i < ROWS; i += 3) {
+        ok = kdtree_delete_data_point(tree, points[i]);
+        assert(ok);
+        deleted[i] = 1;
+    }
+    assert(kdtree_get_root(tree)->subtree_size ==
+            kdtree_get_current_number_of_kd_tree_nodes(tree));
+    check_queries(tree);
+    for (i = 0; i < ROWS; i += 6) {
+        kdtree_add_points(tree, points[i]);
+        deleted[i] = 0;
+    }
+    assert(kdtree_get_root(tree)->subtree_size ==
+            kdtree_get_current_number_of_kd_tree_nodes(tree));
+    count = kdtree_in_order_traversal(tree);
+    assert(count == kdtree_get_current_number_of_kd_tree_nodes(tree));
+    for (i = 0; i < ROWS; i++) {
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found == !deleted[i]);
+    }
+    check_queries(tree);
+    /*partial rebuilds of a bulk built tree with leaf buckets*/
+    ok = kdtree_set_leaf_size(tree, 16);
+    assert(ok);
+    count = kdtree_build(tree, &points[0][0], ROWS / 2);
+    assert(count == ROWS / 2);
+    for (i = ROWS / 2; i < ROWS; i++) {
+        kdtree_add_points(tree, points[i]);
+    }
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found);
+    }
+    assert(kdtree_get_root(tree)->subtree_size == ROWS);
+    assert(kdtree_get_height(tree) <= balanced_height(ROWS, 0.7f));
+    check_queries(tree);
+    ok = kdtree_set_leaf_size(tree, 1);
+    assert(ok);
+    printf("partial rebuild ok \n");
+
+    /*forest, every insert merges the levels like a binary counter*/
+    kdtree_init(tree);
+    ok = kdtree_set_forest(tree, 1);
+    assert(ok && kdtree_is_forest(tree));
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        kdtree_add_points(tree, points[i]);
+    }
+    for (c = 0; c < KD_TREE_FOREST_LEVELS; c++) {
+        kd_tree_node* level = tree->_internals->forest_roots[c];
+        assert((NULL != level) == ((ROWS >> c) & 1));
+        assert(NULL == level || level->subtree_size == 1 << c);
+    }
+    assert(tree->_internals->rebuild_counter == 0);
+    assert(kdtree_get_height(tree) <= (int) ceil(log2(ROWS)) + 1);
+    for (i = 0; i < ROWS; i++) {
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found);
+    }
+    check_queries(tree);
+    check_batch(tree);
+    count = kdtree_knn_ids(tree, points[7], 1, ids, dists);
+    assert(count == 1);
+    assert(ids[0] == 7 && dists[0] == 0.0f);
+    /*points are packed, no delete & update*/
+    ok = kdtree_delete_data_point(tree, points[0]);
+    assert(!ok);
+    ok = kdtree_update_point(tree, points[0], points[1]);
+    assert(!ok);
+    count = kdtree_compact(tree);
+    assert(count == ROWS);
+    check_queries(tree);
+    check_batch(tree);
+    count = kdtree_freeze(tree);
+    assert(count == ROWS);
+    check_batch(tree);
+    /*back to one tree for deletes, then a forest of what is left*/
+    ok = kdtree_set_forest(tree, 0);
+    assert(ok && !kdtree_is_forest(tree));
+    assert(kdtree_get_height(tree) <= (int) ceil(log2(ROWS)) + 1);
+    for (i = 0; i < ROWS; i += 3) {
+        ok = kdtree_delete_data_point(tree, points[i]);
+        assert(ok);
+        deleted[i] = 1;
+    }
+    ok = kdtree_set_forest(tree, 1);
+    assert(ok);
+    for (i = 0; i < ROWS; i += 6) {
+        kdtree_add_points(tree, points[i]);
+        deleted[i] = 0;
+    }
+    for (i = 0; i < ROWS; i++) {
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found == !deleted[i]);
+    }
+    check_queries(tree);
+    printf("forest ok \n");
+
+    /*background rebuilds, writes & queries go on while the thread builds*/
+    kdtree_init(tree);
+    ok = kdtree_set_background_rebuild(tree, 1);
+    assert(ok);
+    int rebuilding = 0;
+    kd_tree_node* heap = tree->_internals->node_space;
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        kdtree_add_points(tree, points[i]);
+        if (kdtree_is_rebuilding(tree) && i >= 10 && i % 2 == 0) {
+            ok = kdtree_delete_data_point(tree, points[i - 10]);
+            assert(ok);
+            deleted[i - 10] = 1;
+            count = kdtree_knn_ids(tree, points[i], 1, ids, dists);
+            assert(count == 1);
+            assert(ids[0] == i);
+            rebuilding++;
+        }
+    }
+    kdtree_wait_rebuild(tree);
+    printf("background rebuilds %d, writes during rebuilds %d\n",
+            tree->_internals->rebuild_counter, rebuilding);
+    assert(!kdtree_is_rebuilding(tree));
+    assert(tree->_internals->rebuild_counter > 0);
+    /*every rebuild swapped in the other node heap*/
+    assert((tree->_internals->node_space != heap) ==
+            tree->_internals->rebuild_counter % 2);
+    for (i = 0; i < ROWS; i++) {
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found == !deleted[i]);
+    }
+    assert(kdtree_get_root(tree)->subtree_size ==
+            kdtree_get_current_number_of_kd_tree_nodes(tree));
+    count = kdtree_in_order_traversal(tree);
+    assert(count == kdtree_get_current_number_of_kd_tree_nodes(tree));
+    check_queries(tree);
+    check_batch(tree);
+    ok = kdtree_set_background_rebuild(tree, 0);
+    assert(ok);
+    printf("background rebuild ok \n");
+
+    /*insert buffer, searches merge the buffered points with the tree*/
+    float original[COLS];
+    kdtree_init(tree);
+    ok = kdtree_set_buffer_size(tree, ROWS + 1);
+    assert(!ok);
+    ok = kdtree_set_buffer_size(tree, 64);
+    assert(ok);
+    assert(kdtree_get_buffer_size(tree) == 64);
+    for (i = 0; i < ROWS; i++) {
+        deleted[i] = 0;
+        kdtree_add_points(tree, points[i]);
+        if (i % 97 == 0) {
+            found = kdtree_search_data_point(tree, points[i]);
+            assert(found);
+            count = kdtree_knn_ids(tree, points[i], 1, ids, dists);
+            assert(count == 1);
+            assert(ids[0] == i);
+        }
+    }
+    assert(kdtree_get_buffered_points(tree) == ROWS % 64);
+    assert(kdtree_get_current_number_of_kd_tree_nodes(tree) ==
+            ROWS - ROWS % 64);
+    /*a buffered point & a point of the tree*/
+    ok = kdtree_delete_data_point(tree, points[ROWS - 1]);
+    assert(ok);
+    deleted[ROWS - 1] = 1;
+    ok = kdtree_delete_data_point(tree, points[0]);
+    assert(ok);
+    deleted[0] = 1;
+    assert(kdtree_get_buffered_points(tree) == ROWS % 64 - 1);
+    found = kdtree_search_data_point(tree, points[ROWS - 1]);
+    assert(!found);
+    memcpy(original, points[ROWS - 2], sizeof (original));
+    points[ROWS - 2][0] += 0.25f;
+    ok = kdtree_update_point(tree, original, points[ROWS - 2]);
+    assert(ok);
+    count = kdtree_knn_ids(tree, points[ROWS - 2], 1, ids, dists);
+    assert(count == 1);
+    assert(ids[0] == ROWS - 2);
+    check_queries(tree);
+    check_batch(tree);
+    count = kdtree_flush_buffer(tree);
+    assert(count == ROWS % 64 - 1);
+    assert(kdtree_get_buffered_points(tree) == 0);
+    for (i = 0; i < ROWS; i++) {
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found == !deleted[i]);
+    }
+    /*original back by an update of the tree*/
+    ok = kdtree_update_point(tree, points[ROWS - 2], original);
+    assert(ok);
+    memcpy(points[ROWS - 2], original, sizeof (original));
+    check_queries(tree);
+    check_batch(tree);
+    /*a full tree & buffer reject the insert instead of dropping it*/
+    kdtree_add_points(tree, points[0]);
+    kdtree_add_points(tree, points[ROWS - 1]);
+    assert(kdtree_get_buffered_points(tree) == 2);
+    original[0] = -1.0f;
+    kdtree_add_points(tree, original);
+    assert(kdtree_get_buffered_points(tree) == 0);
+    assert(kdtree_get_current_number_of_kd_tree_nodes(tree) == ROWS);
+    found = kdtree_search_data_point(tree, original);
+    assert(!found);
+    found = kdtree_search_data_point(tree, points[ROWS - 1]);
+    assert(found);
+    /*a flush links the buffered points into the tree, for a small & a large
+     tree it keeps the root & rebuilds nothing, its cost is the 64 inserts*/
+    for (c = ROWS / 8; c <= ROWS / 2; c *= 4) {
+        count = kdtree_build(tree, &points[0][0], c);
+        assert(count == c);
+        kd_tree_node* root = kdtree_get_root(tree);
+        int rebuilds = tree->_internals->rebuild_counter;
+        for (i = c; i < c + 64; i++) {
+            kdtree_add_points(tree, points[i]);
+        }
+        assert(kdtree_get_buffered_points(tree) == 0);
+        assert(kdtree_get_root(tree) == root);
+        assert(tree->_internals->rebuild_counter == rebuilds);
+        for (i = 0; i < c + 64; i++) {
+            found = kdtree_search_data_point(tree, points[i]);
+            assert(found);
+        }
+    }
+    /*merges during a background rebuild are logged, the rebuild is not 
+     dropped & every rebuild swaps the node heaps*/
+    kdtree_init(tree);
+    ok = kdtree_set_background_rebuild(tree, 1);
+    assert(ok);
+    ok = kdtree_set_buffer_size(tree, 64);
+    assert(ok);
+    heap = tree->_internals->node_space;
+    for (i = 0; i < ROWS; i++) {
+        kdtree_add_points(tree, points[i]);
+    }
+    kdtree_wait_rebuild(tree);
+    assert(tree->_internals->rebuild_counter > 0);
+    assert((tree->_internals->node_space != heap) ==
+            tree->_internals->rebuild_counter % 2);
+    assert(kdtree_get_current_number_of_kd_tree_nodes(tree) ==
+            ROWS - ROWS % 64);
+    for (i = 0; i < ROWS; i++) {
+        found = kdtree_search_data_point(tree, points[i]);
+        assert(found);
+    }
+    ok = kdtree_set_background_rebuild(tree, 0);
+    assert(ok);
+    ok = kdtree_set_buffer_size(tree, 0);
+    assert(ok);
+    printf("insert buffer ok \n");
+
+    /*sorted inserts without rebuilds, every point is the right child of
+     the previous one*/
+    kdtree_t* deep = kdtree_alloc(DEEP_ROWS, COLS);
+    float point[COLS];
+    assert(deep);
+    kdtree_init(deep);
+    kdtree_set_rebuild_threshold(deep, 1e9f);
+    for (i = 0; i < DEEP_ROWS; i++) {
+        point[0] = point[1] = point[2] = (float) i;
+        kdtree_add_points(deep, point);
+    }
+    assert(kdtree_get_height(deep) == DEEP_ROWS);
+    count = kdtree_in_order_traversal(deep);
+    assert(count == DEEP_ROWS);
+    assert(kdtree_get_knn_result_space(deep)[DEEP_ROWS - 1].id ==
+            DEEP_ROWS - 1);
+    for (i = 0; i < DEEP_ROWS; i += 7) {
+        point[0] = point[1] = point[2] = (float) i;
+        found = kdtree_search_data_point(deep, point);
+        assert(found);
+    }
+    point[0] = point[1] = point[2] = DEEP_ROWS - 1.2f;
+    count = kdtree_knn_ids(deep, point, 1, ids, dists);
+    assert(count == 1);
+    assert(ids[0] == DEEP_ROWS - 1);
+    printf("deep insert ok \n");
+    /*same inserts with a balance factor*/
+    kdtree_init(deep);
+    kdtree_set_rebuild_threshold(deep, 1e9f);
+    ok = kdtree_set_balance_factor(deep, 0.75f);
+    assert(ok);
+    for (i = 0; i < DEEP_ROWS; i++) {
+        point[0] = point[1] = point[2] = (float) i;
+        kdtree_add_points(deep, point);
+    }
+    printf("balanced deep insert, height %d\n", kdtree_get_height(deep));
+    assert(kdtree_get_height(deep) <= balanced_height(DEEP_ROWS, 0.75f));
+    for (i = 0; i < DEEP_ROWS; i += 7) {
+        point[0] = point[1] = point[2] = (float) i;
+        found = kdtree_search_data_point(deep, point);
+        assert(found);
+    }
+    point[0] = point[1] = point[2] = DEEP_ROWS - 1.2f;
+    count = kdtree_knn_ids(deep, point, 1, ids, dists);
+    assert(count == 1);
+    assert(ids[0] == DEEP_ROWS - 1);
+    kdtree_free(deep);
+    printf("balanced deep insert ok \n");
+
+    kdtree_free(tree);
+    printf("free ok \n");
+    return 0;
+}
@@ -58,9 +58,50 @@ int main(int argc, char** argv) {
     assert(kdtree);
     printf("init ok\n");
 
+    /*node pool: fill every slot, release slots by delete & reuse them*/
+    float point[10] = {0};
+    int i = 0;
+    for (; i < max_rows; i++) {
+        point[0] = i;
+        point[1] = max_rows - i;
+        kdtree_add_points(kdtree, point);
+    }
+    assert(kdtree_get_current_number_of_kd_tree_nodes(kdtree) == max_rows);
+    /*pool is exhausted, insert is rejected*/
+    point[0] = max_rows;
+    kdtree_add_points(kdtree, point);
+    printf("\n");
+    assert(kdtree_get_current_number_of_kd_tree_nodes(kdtree) == max_rows);
+    assert(!kdtree_search_data_point(kdtree, point));
+    int released = 0;
+    for (i = 0; i < max_rows / 2; i++) {
+        point[0] = i;
+        point[1] = max_rows - i;
+        released += kdtree_delete_data_point(kdtree, point);
+    }
+    assert(released > 0);
+    assert(kdtree_get_current_number_of_kd_tree_nodes(kdtree) ==
+            max_rows - released);
+    for (i = 0; i < released; i++) {
+        point[0] = i + 0.5f;
+        point[1] = max_rows - i;
+        kdtree_add_points(kdtree, point);
+        assert(kdtree_search_data_point(kdtree, point));
+    }
+    assert(kdtree_get_current_number_of_kd_tree_nodes(kdtree) == max_rows);
+    printf("node pool reuse ok\n");
+
     kdtree_free(kdtree);
     printf("free ok \n");
 
+    /*heaps are O(rows*cols), a large capacity must not need rows*rows*/
+    kdtree = kdtree_alloc(100000, 3);
+    assert(kdtree);
+    kdtree_init(kdtree);
+    assert(kdtree_get_knn_result_space(kdtree));
+    kdtree_free(kdtree);
+    printf("large alloc ok \n");
+
     return (EXIT_SUCCESS);
 }
 
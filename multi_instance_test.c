@@ -0,0 +1,262 @@
+/*Copyright 2020, by the California Institute of Technology.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * File:   multi_instance_test.c
+ * Author: anaim (aryan.e.naim@jpl.nasa.gov)
+ *
+ * Example of the handle based API (kdtree_* functions). Several independent
+ * trees are allocated, built in parallel on separate threads & then searched.
+ * Each tree owns its own heaps, therefore trees do NOT share any state.
+ * A large kdtree_build() runs on OpenMP tasks inside a single tree, which is
+ * then queried by all threads at once, each with its own kdtree_context_t.
+ * Last, readers search published versions (kdtree_publish()) while a writer
+ * keeps inserting, deleting & publishing.
+ *
+ * IMPORTANT: Must call kdtree_alloc() & kdtree_init() once per tree before
+ * using the API. In order to cleanup call kdtree_free() per tree.
+ */
+
+#include <stdio.h>
+#include <omp.h>
+#include "kdtree.h"
+
+#define NUMBER_OF_TREES 4
+#define NEIGHBORS 4
+
+int main(int argc, char** argv) {
+
+    int max_rows = 2000;
+    int max_cols = 3;
+    kdtree_t* trees[NUMBER_OF_TREES];
+    int t = 0;
+
+    for (; t < NUMBER_OF_TREES; t++) {
+        trees[t] = kdtree_alloc(max_rows, max_cols);
+        assert(trees[t]);
+        kdtree_init(trees[t]);
+    }
+    printf("alloc & init ok \n");
+
+    /*build every tree on its own thread, tree t holds points {t, i, i}*/
+    #pragma omp parallel for
+    for (t = 0; t < NUMBER_OF_TREES; t++) {
+        int i = 0;
+        float point[3];
+        for (; i < max_rows / 2; i++) {
+            point[0] = t;
+            point[1] = i;
+            point[2] = i;
+            kdtree_add_points(trees[t], point);
+        }
+    }
+    printf("parallel insert ok \n");
+
+    for (t = 0; t < NUMBER_OF_TREES; t++) {
+        float point[3];
+        int i = 0;
+        int found_counter = 0;
+        assert(kdtree_get_current_number_of_kd_tree_nodes(trees[t]) ==
+                max_rows / 2);
+        for (; i < max_rows / 2; i++) {
+            point[0] = t;
+            point[1] = i;
+            point[2] = i;
+            found_counter += kdtree_search_data_point(trees[t], point);
+            /*points of the other trees are NOT in this tree*/
+            point[0] = (t + 1) % NUMBER_OF_TREES;
+            assert(!kdtree_search_data_point(trees[t], point));
+        }
+        printf("tree %d, found_counter:%d\n", t, found_counter);
+        assert(found_counter == max_rows / 2);
+
+        /*nearest neighbor of {t, 10.2, 10.2} is in this tree only*/
+        point[0] = t;
+        point[1] = 10.2f;
+        point[2] = 10.2f;
+        int result_size = kdtree_knn(trees[t], point, 1);
+        assert(result_size == 1);
+        kd_tree_print_data_for_debug(kdtree_get_knn_result_space(trees[t]),
+                kdtree_get_k_dimensions(trees[t]), result_size);
+        assert(kdtree_get_knn_result_space(trees[t])[0].dataset[0] == t);
+    }
+
+    /*delete from one tree does NOT change the others*/
+    float point[] = {0, 5, 5};
+    int deleted = kdtree_delete_data_point(trees[0], point);
+    assert(deleted);
+    assert(!kdtree_search_data_point(trees[0], point));
+    point[0] = 1;
+    assert(kdtree_search_data_point(trees[1], point));
+    printf("delete ok \n");
+
+    for (t = 0; t < NUMBER_OF_TREES; t++) {
+        kdtree_free(trees[t]);
+    }
+    printf("free ok \n");
+
+    /*parallel bulk build, large enough to fork subtree tasks*/
+    int big_rows = 200000;
+    float* data = (float*) malloc(sizeof (float) * big_rows * max_cols);
+    kdtree_t* big = kdtree_alloc(big_rows, max_cols);
+    int i = 0;
+    assert(data && big);
+    kdtree_init(big);
+    srand(7);
+    for (; i < big_rows * max_cols; i++) {
+        data[i] = rand() / (float) RAND_MAX * 1000.0f;
+    }
+    double start = omp_get_wtime();
+    int built = kdtree_build(big, data, big_rows);
+    assert(built == big_rows);
+    printf("parallel build of %d points, %f secs\n", big_rows,
+            omp_get_wtime() - start);
+    assert(kdtree_get_height(big) <= (int) ceil(log2(big_rows)) + 1);
+    for (i = 0; i < big_rows; i++) {
+        assert(kdtree_search_data_point(big, data + i * max_cols));
+    }
+    printf("parallel build search ok \n");
+
+    /*concurrent readers without locks, one context per thread. Same
+     neighbors as the batch search*/
+    int queries = 2000;
+    int* batch_ids = (int*) malloc(sizeof (int) * queries * NEIGHBORS);
+    float* batch_dists = (float*) malloc(sizeof (float) * queries * NEIGHBORS);
+    int mismatches = 0;
+    int searched = 0;
+    assert(batch_ids && batch_dists);
+    searched = kdtree_knn_batch(big, data, queries, NEIGHBORS, batch_ids,
+            batch_dists);
+    assert(searched == queries);
+    #pragma omp parallel reduction(+:mismatches)
+    {
+        kdtree_context_t* context = kdtree_context_alloc(big);
+        int ids[NEIGHBORS];
+        float dists[NEIGHBORS];
+        int q = 0;
+        assert(context);
+        #pragma omp for
+        for (q = 0; q < queries; q++) {
+            const float* query = data + (size_t) q * max_cols;
+            int n = kdtree_knn_context(big, context, query, NEIGHBORS, ids,
+                    dists);
+            mismatches += n != NEIGHBORS;
+            for (n = 0; n < NEIGHBORS; n++) {
+                mismatches += ids[n] != batch_ids[q * NEIGHBORS + n];
+            }
+            mismatches += kdtree_radius_search_context(big, context, query,
+                    ids, dists, NEIGHBORS, 0.0f) < 1;
+            mismatches += !kdtree_search_data_point(big, query);
+        }
+        kdtree_context_free(context);
+    }
+    printf("concurrent queries, mismatches %d\n", mismatches);
+    assert(mismatches == 0);
+    free(batch_ids);
+    free(batch_dists);
+    kdtree_free(big);
+    free(data);
+
+    /*published versions, a reader sees a point until the next publish*/
+    int live_rows = 600;
+    kdtree_t* live = kdtree_alloc(live_rows, max_cols);
+    kdtree_context_t* readers[KD_TREE_MAX_READERS + 1];
+    int ids[NEIGHBORS];
+    float dists[NEIGHBORS];
+    unsigned long version = 0;
+    int found = 0;
+    assert(live);
+    kdtree_init(live);
+    for (i = 0; i < live_rows / 2; i++) {
+        point[0] = i;
+        point[1] = i;
+        point[2] = i;
+        kdtree_add_points(live, point);
+    }
+    for (i = 0; i <= KD_TREE_MAX_READERS; i++) {
+        readers[i] = kdtree_context_alloc(live);
+        assert(readers[i] && readers[i]->reader < 0);
+    }
+    found = kdtree_knn_published(live, readers[0], point, 1, ids, dists);
+    assert(found == 0 && readers[0]->reader >= 0);
+    version = kdtree_publish(live);
+    assert(version == 1);
+    /*an unchanged tree keeps its version*/
+    version = kdtree_publish(live);
+    assert(version == 1);
+    point[0] = point[1] = point[2] = 10;
+    found = kdtree_delete_data_point(live, point);
+    assert(found);
+    found = kdtree_knn_published(live, readers[0], point, NEIGHBORS, ids,
+            dists);
+    assert(found == NEIGHBORS && dists[0] == 0.0f && ids[0] == 10);
+    assert(readers[0]->version == 1);
+    version = kdtree_publish(live);
+    assert(version == 2);
+    found = kdtree_radius_search_published(live, readers[0], point, ids,
+            dists, NEIGHBORS, 0.0f);
+    assert(found == 0 && readers[0]->version == 2);
+    found = kdtree_knn_published(live, readers[0], point, NEIGHBORS, ids,
+            dists);
+    assert(found == NEIGHBORS && dists[0] > 0.0f);
+    /*every context runs context queries, KD_TREE_MAX_READERS read versions*/
+    for (i = 0; i <= KD_TREE_MAX_READERS; i++) {
+        found = kdtree_knn_context(live, readers[i], point, 1, ids, dists);
+        assert(found == 1);
+        found = kdtree_knn_published(live, readers[i], point, 1, ids, dists);
+        assert(found == (i < KD_TREE_MAX_READERS));
+    }
+    for (i = 0; i <= KD_TREE_MAX_READERS; i++) {
+        kdtree_context_free(readers[i]);
+    }
+    printf("publish ok \n");
+
+    /*thread 0 writes & publishes, the other threads read without locks*/
+    int done = 0;
+    int rounds = 200;
+    mismatches = 0;
+    #pragma omp parallel reduction(+:mismatches)
+    {
+        kdtree_context_t* context = kdtree_context_alloc(live);
+        int reader_ids[NEIGHBORS];
+        float reader_dists[NEIGHBORS];
+        unsigned long seen = 0;
+        int r = 0;
+        float p[3];
+        assert(context);
+        if (0 == omp_get_thread_num()) {
+            for (; r < rounds; r++) {
+                p[0] = p[1] = p[2] = live_rows + r;
+                kdtree_add_points(live, p);
+                if (r % 2) {
+                    mismatches += !kdtree_delete_data_point(live, p);
+                }
+                mismatches += kdtree_publish(live) != 3 + r;
+            }
+            __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+        }
+        while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+            /*the first points are never deleted after the 2nd version*/
+            p[0] = p[1] = p[2] = 11 + r++ % (live_rows / 2 - 11);
+            mismatches += kdtree_radius_search_published(live, context, p,
+                    reader_ids, reader_dists, NEIGHBORS, 0.0f) != 1;
+            mismatches += context->version < seen;
+            seen = context->version;
+        }
+        kdtree_context_free(context);
+    }
+    printf("published queries, mismatches %d\n", mismatches);
+    assert(mismatches == 0);
+    kdtree_free(live);
+
+    return 0;
+}